@@ -221,9 +221,13 @@ void Vacuum::execute()
                 qstate = 4;
                 log( "vacuum: delete from bodyparts", Log::Significant );
                 do {
+                    // bodyparts stored while a message was arriving
+                    // have no part_numbers until it's injected
                     q = new Query( "delete from bodyparts where id in (select id "
                                    "from bodyparts b left join part_numbers p on "
                                    "(b.id=p.bodypart) where bodypart is null "
+                                   "and (b.spooled_at is null or b.spooled_at<"
+                                   "current_timestamp-'1 day'::interval)"
                                    " limit " MSGBLOCKCOUNT ")", this );
                     q->execute();
             case 4:
@@ -3,21 +3,81 @@
 #include "stats.h"
 
 #include "query.h"
+#include "buffer.h"
+#include "endpoint.h"
+#include "resolver.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "estringlist.h"
 #include "configuration.h"
 
 #include <stdio.h>
 
 
+class StatisticsReader
+    : public Connection
+{
+public:
+    StatisticsReader( EventHandler * owner )
+        : Connection(), done( false ), o( owner ) {
+        EString addr;
+        EString a( Configuration::text( Configuration::StatisticsAddress ) );
+        if ( a.isEmpty() ) {
+            addr = "127.0.0.1";
+        }
+        else {
+            EStringList::Iterator it( Resolver::resolve( a ) );
+            if ( it )
+                addr = *it;
+        }
+        if ( addr.isEmpty() ) {
+            done = true;
+        }
+        else {
+            connect( Endpoint( addr, Configuration::scalar(
+                                   Configuration::StatisticsPort ) ) );
+            EventLoop::global()->addConnection( this );
+            setTimeoutAfter( 10 );
+        }
+    }
+    void react( Event e ) {
+        switch ( e ) {
+        case Read:
+            while ( EString * l = readBuffer()->removeLine() )
+                lines.append( l );
+            return;
+
+        case Connect:
+            return;
+
+        case Timeout:
+        case Shutdown:
+        case Error:
+        case Close:
+            setState( Closing );
+            break;
+        }
+        done = true;
+        o->execute();
+    }
+
+    bool done;
+    EventHandler * o;
+    EStringList lines;
+};
+
+
 class ShowCountsData
     : public Garbage
 {
 public:
     ShowCountsData()
-        : state( 0 ), query( 0 )
+        : state( 0 ), query( 0 ), statistics( 0 )
     {}
 
     int state;
     Query * query;
+    StatisticsReader * statistics;
 };
 
 
@@ -28,7 +88,12 @@ f( "show", "counts", "Show number of users, messages etc..",
    "    as well as the total size of the mail stored.\n"
    "\n"
    "    The -f flag makes aox collect slow-but-accurate counts.\n"
-   "    Without it, by default, you get quick estimates.\n" );
+   "    Without it, by default, you get quick estimates.\n"
+   "\n"
+   "    If use-statistics is enabled, aox also shows the memory,\n"
+   "    garbage collection and prepared statement statistics reported\n"
+   "    by one server process, including the hit rates of the most\n"
+   "    frequently executed statements.\n" );
 
 
 /*! \class ShowCounts stats.h
@@ -99,20 +164,19 @@ void ShowCounts::execute()
                     r->getInt( "bodyparts" ) );
             printf( "Addresses: %d (estimated)\n",
                     r->getInt( "addresses" ) );
-            d->state = 666;
-            finish();
-            return;
+            d->state = 5;
+        }
+        else {
+            d->query =
+                new Query( "select count(*)::int as messages, "
+                           "coalesce(sum(rfc822size)::bigint,0) as totalsize, "
+                           "(select count(*) from mailbox_messages)::int "
+                           "as mm, "
+                           "(select count(*) from deleted_messages)::int "
+                           "as dm from messages", this );
+            d->query->execute();
+            d->state = 2;
         }
-
-        d->query =
-            new Query( "select count(*)::int as messages, "
-                       "coalesce(sum(rfc822size)::bigint,0) as totalsize, "
-                       "(select count(*) from mailbox_messages)::int "
-                       "as mm, "
-                       "(select count(*) from deleted_messages)::int "
-                       "as dm from messages", this );
-        d->query->execute();
-        d->state = 2;
     }
 
     if ( d->state == 2 ) {
@@ -173,6 +237,93 @@ void ShowCounts::execute()
             error( "Couldn't fetch addresses counts." );
 
         printf( "Addresses: %d\n", r->getInt( "addresses" ) );
+        d->state = 5;
+    }
+
+    if ( d->state == 5 ) {
+        if ( !Configuration::toggle( Configuration::UseStatistics ) ) {
+            finish();
+            return;
+        }
+        d->statistics = new StatisticsReader( this );
+        d->state = 6;
+    }
+
+    if ( d->state == 6 ) {
+        if ( !d->statistics->done )
+            return;
+
+        // each line is a name followed by time:value pairs, the last
+        // of which is the current value, except that the busiest
+        // statements are reported as "statement" followed by a
+        // fingerprint, executions, parses and the text.
+        bool any = false;
+        EStringList statements;
+        EStringList busiest;
+        uint parses = 0;
+        uint reuses = 0;
+        EStringList::Iterator i( d->statistics->lines );
+        while ( i ) {
+            EString name = i->section( " ", 1 );
+            if ( name == "statement" ) {
+                uint executions = i->section( " ", 3 ).number( 0 );
+                uint p = i->section( " ", 4 ).number( 0 );
+                // the text may contain spaces, so it's the rest
+                int c = -1;
+                uint spaces = 0;
+                while ( spaces < 4 && ( c = i->find( ' ', c + 1 ) ) >= 0 )
+                    spaces++;
+                if ( executions && c >= 0 ) {
+                    EString text = i->mid( c + 1 );
+                    EString l( "    " );
+                    l.append( i->section( " ", 2 ) );
+                    l.append( ": " );
+                    l.appendNumber( executions );
+                    l.append( " executions, " );
+                    l.appendNumber( p );
+                    l.append( " parses, " );
+                    l.appendNumber( executions > p
+                                    ? 100 * ( executions - p ) / executions
+                                    : 0 );
+                    l.append( "% hits: " );
+                    l.append( text );
+                    busiest.append( l );
+                }
+                ++i;
+                continue;
+            }
+            int c = i->length() - 1;
+            while ( c >= 0 && (*i)[c] != ':' )
+                c--;
+            EString value = i->mid( c + 1 );
+            if ( name.startsWith( "gc-" ) || name.startsWith( "memory-" ) ||
+                 name.startsWith( "message-cache-" ) ) {
+                if ( !any )
+                    printf( "Memory (one server process):\n" );
+                any = true;
+                printf( "    %s: %s\n", name.cstr(), value.cstr() );
+            }
+            else if ( name.startsWith( "statement-" ) ) {
+                statements.append( "    " + name + ": " + value );
+                if ( name == "statement-parses" )
+                    parses = value.number( 0 );
+                else if ( name == "statement-reuses" )
+                    reuses = value.number( 0 );
+            }
+            ++i;
+        }
+        if ( !any )
+            printf( "Memory: No statistics available from the server\n" );
+        if ( !statements.isEmpty() ) {
+            printf( "Statements (one server process):\n%s\n",
+                    statements.join( "\n" ).cstr() );
+            if ( parses + reuses )
+                printf( "    hit rate: %u%%\n",
+                        100 * reuses / ( parses + reuses ) );
+        }
+        if ( !busiest.isEmpty() )
+            printf( "Most executed statements (one server process):\n%s\n",
+                    busiest.join( "\n" ).cstr() );
         d->state = 666;
     }
 
@@ -98,8 +98,7 @@ void Exporter::execute()
         }
         d->fetcher = new Fetcher( d->messages, this, 0 );
         d->fetcher->fetch( Fetcher::Addresses );
-        d->fetcher->fetch( Fetcher::OtherHeader );
-        d->fetcher->fetch( Fetcher::Body );
+        d->fetcher->fetch( Fetcher::Rfc822 );
         d->fetcher->fetch( Fetcher::Trivia );
         d->fetcher->execute();
     }
@@ -108,9 +107,7 @@ void Exporter::execute()
         Message * m = d->messages->firstElement();
         if ( !m->hasAddresses() )
             return;
-        if ( !m->hasHeaders() )
-            return;
-        if ( !m->hasBodies() )
+        if ( !m->hasRfc822() )
             return;
         if ( !m->hasTrivia() )
             return;
@@ -17,6 +17,7 @@
 #include "database.h"
 #include "dbsignal.h"
 #include "selector.h"
+#include "fetcher.h"
 #include "managesieve.h"
 #include "spoolmanager.h"
 #include "entropy.h"
@@ -299,6 +300,7 @@ int main( int argc, char *argv[] )
 
     SpoolManager::setup();
     Selector::setup();
+    Fetcher::setup();
     Flag::setup();
     IMAP::setup();
 
@@ -16,6 +16,12 @@
 // mmap, munmap
 #include <sys/mman.h>
 
+// open
+#include <fcntl.h>
+
+// pread, write, close, getpid, sysconf
+#include <unistd.h>
+
 // memset
 #include <string.h>
 
@@ -151,6 +157,119 @@ static uint tos;
 static uint peak;
 static AllocationBlock ** stack;
 
+// what was in use after the last full collection
+static uint oldAfterFull;
+
+// what the last collection did, for statistics
+static uint lastPause;
+static bool pauseWasNursery;
+static uint classLive[32];
+static uint classFreed[32];
+
+static void push( AllocationBlock * );
+
+
+// Nursery collections need to know which old objects may have been
+// modified since the last collection. On Linux, the kernel tracks
+// that for us: Each page has a soft-dirty bit in /proc/self/pagemap,
+// which is set on the first write after clear_refs resets it.
+//
+// A chrooted server can't reach /proc, so Server::secure() calls
+// trackDirtyPages() to open the files before chroot(). The files
+// refer to the process that opened them and give access to nothing
+// else, so keeping them open in the jail is harmless. A process
+// forked inside the jail can't open its own, and does only full
+// collections.
+
+static int pagemap = -1;
+static int clearRefs = -1;
+static int probedPid = 0;
+static bool probeReported = false;
+static bool dirtyPagesKnown = false;
+static bool collected = false;
+static uint pageSize = 4096;
+static const unsigned long long softDirty = 1ULL << 55;
+
+
+static bool clearDirtyPages()
+{
+    return ::write( clearRefs, "4", 1 ) == 1;
+}
+
+
+static bool isDirty( const void * p )
+{
+    unsigned long long e = 0;
+    off_t o = ( (unsigned long)p / pageSize ) * sizeof( e );
+    if ( ::pread( pagemap, &e, sizeof( e ), o ) != sizeof( e ) )
+        return true;
+    return ( e & softDirty ) != 0;
+}
+
+
+static void probeDirtyPages()
+{
+    // /proc/self is resolved when it's opened, so a forked child has
+    // to open the files again.
+    int pid = ::getpid();
+    if ( pid == probedPid )
+        return;
+    probedPid = pid;
+    dirtyPagesKnown = false;
+    if ( pagemap >= 0 )
+        ::close( pagemap );
+    if ( clearRefs >= 0 )
+        ::close( clearRefs );
+    pagemap = -1;
+    clearRefs = -1;
+
+#if defined(__linux__)
+    pageSize = ::sysconf( _SC_PAGESIZE );
+    pagemap = ::open( "/proc/self/pagemap", O_RDONLY );
+    clearRefs = ::open( "/proc/self/clear_refs", O_WRONLY );
+    bool ok = pagemap >= 0 && clearRefs >= 0;
+
+    // the files may exist even though the kernel doesn't track
+    // soft-dirty pages, so we check that it does what we need
+    char * p = 0;
+    if ( ok ) {
+        p = (char*)mmap( 0, pageSize, PROT_READ|PROT_WRITE,
+                         MAP_ANON|MAP_PRIVATE, -1, 0 );
+        if ( p == MAP_FAILED )
+            ok = false;
+    }
+    if ( ok ) {
+        p[0] = 1;
+        if ( !clearDirtyPages() || isDirty( p ) )
+            ok = false;
+        p[0] = 2;
+        if ( ok && !isDirty( p ) )
+            ok = false;
+        munmap( p, pageSize );
+    }
+    // until the first collection nothing is old, so the bits need
+    // only be reset for the first nursery collection to be correct
+    if ( ok && !collected )
+        dirtyPagesKnown = clearDirtyPages();
+    if ( ok )
+        return;
+
+    if ( pagemap >= 0 )
+        ::close( pagemap );
+    if ( clearRefs >= 0 )
+        ::close( clearRefs );
+    pagemap = -1;
+    clearRefs = -1;
+#endif
+
+    if ( probeReported )
+        return;
+    probeReported = true;
+    log( "Soft-dirty page tracking is not available, "
+         "so only full garbage collections are possible",
+         Log::Info );
+}
+
 
 static void oneMegabyteAllocated()
 {
@@ -265,6 +384,19 @@ Allocator * Allocator::allocator( uint size )
     reachable. It can be called whenever there are no pointers into
     the heap, ie. only during the main event loop.
 
+    Collecting everything takes time proportional to the live heap,
+    and every client waits meanwhile. When the operating system can
+    tell which pages have been written to (see generational()),
+    freeNursery() offers a cheaper alternative: Everything that
+    survived the previous collection is considered old and live, and
+    only the objects allocated since then, the nursery, are examined.
+    Old objects on modified pages are rescanned, since they may have
+    been changed to point into the nursery. Most objects die young in
+    an event-driven server, so a nursery collection frees most of
+    what a full collection would, with a pause proportional to the
+    amount allocated since the last collection. Old garbage is
+    reclaimed by the next full collection.
+
     Each single instance of the Allocator class allocates memory blocks
     of a given size. There are static functions to the heavy loading,
     such as free() to free all unreachable memory, allocate() to
@@ -284,7 +416,7 @@ Allocator * Allocator::allocator( uint size )
 
 Allocator::Allocator( uint s )
     : base( 0 ), step( s ), taken( 0 ), capacity( 0 ),
-      used( 0 ), marked( 0 ), buffer( 0 ),
+      used( 0 ), marked( 0 ), old( 0 ), buffer( 0 ),
       next( 0 )
 {
     if ( s < ( BlockSize ) )
@@ -327,6 +459,9 @@ Allocator::Allocator( uint s )
     marked = (ulong*)::calloc( bl, sizeof( ulong ) );
     if ( !marked )
         die( Memory );
+    old = (ulong*)::calloc( bl, sizeof( ulong ) );
+    if ( !old )
+        die( Memory );
 
     AllocatorMapTable::insert( this );
 }
@@ -344,6 +479,7 @@ Allocator::~Allocator()
 
     ::free( used );
     ::free( marked );
+    ::free( old );
 
     next = 0;
     used = 0;
@@ -379,6 +515,7 @@ void * Allocator::allocate( uint size, uint pointers )
                         b->x.number = pointers;
                     b->x.magic = ::magic;
                     marked[base/bits] &= ~( 1UL << j );
+                    old[base/bits] &= ~( 1UL << j );
                     used[base/bits] |= ( 1UL << j );
                     taken++;
                     base++;
@@ -413,8 +550,9 @@ void Allocator::deallocate( void * p )
     AllocationBlock * m = (AllocationBlock *)block( i );
     if ( m->x.magic != ::magic )
         die( Memory );
-    used[i/bits] &= ~(1UL << i);
-    marked[i/bits] &= ~(1UL << i);
+    used[i/bits] &= ~(1UL << (i%bits));
+    marked[i/bits] &= ~(1UL << (i%bits));
+    old[i/bits] &= ~(1UL << (i%bits));
     taken--;
     m->x.magic = 0;
 
@@ -487,6 +625,15 @@ void Allocator::mark( void * p )
     // is there any chance that it contains children?
     if ( !b->x.number )
         return;
+    push( b );
+}
+
+
+// puts b on the stack of objects whose children mark() has yet to
+// mark.
+
+static void push( AllocationBlock * b )
+{
     // is there space on the stack for this object?
     if ( tos == 524288 ) {
         log( "Ran out of stack space while collecting garbage",
@@ -541,6 +688,65 @@ void Allocator::mark()
 */
 
 Garbage * Allocator::free( List<Garbage> * entries )
+{
+    return collect( entries, false );
+}
+
+
+/*! Frees the unreachable objects allocated since the last collection,
+    without examining the rest of the heap, and returns true. This is
+    much faster than free(), but leaves older garbage alone.
+
+    Returns false without doing anything if nursery collection isn't
+    possible (see generational()), or if so much
+    has survived nursery collections that it's time for a full
+    collection. The caller should call free() instead in that case.
+*/
+
+bool Allocator::freeNursery()
+{
+    if ( !generational() )
+        return false;
+    if ( (uint)::total > 2 * ::oldAfterFull + 8 * BlockSize )
+        return false;
+    collect( 0, true );
+    return true;
+}
+
+
+/*! Returns true if freeNursery() is usable now, that is, if the
+    operating system tells us which pages have been written to and
+    the page bits have been reset since the last collection (or
+    before the first) in this process, and false if only full
+    collections are possible.
+*/
+
+bool Allocator::generational()
+{
+    probeDirtyPages();
+    return pagemap >= 0 && dirtyPagesKnown;
+}
+
+
+/*! Opens the files generational() needs to track which pages have
+    been written to, if they aren't already open in this process.
+    Each process must call this itself before it chroots or changes
+    UID, since /proc is unavailable afterwards. Does nothing except
+    on Linux.
+*/
+
+void Allocator::trackDirtyPages()
+{
+    probeDirtyPages();
+}
+
+
+/*! This private helper does the work for free() and freeNursery(),
+    collecting either everything or only the \a nursery. \a entries
+    is as for free().
+*/
+
+Garbage * Allocator::collect( List<Garbage> * entries, bool nursery )
 {
     struct timeval start, afterMark, afterSweep;
     start.tv_sec = 0;
@@ -551,7 +757,8 @@ Garbage * Allocator::free( List<Garbage> * entries )
     afterSweep.tv_usec = 0;
     gettimeofday( &start, 0 );
 
-    Cache::clearAllCaches( false );
+    if ( !nursery )
+        Cache::clearAllCaches( false );
 
     total = 0;
     peak = 0;
@@ -561,6 +768,30 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
     Garbage * biggest = 0;
 
+    // in a nursery collection, the old objects count as marked from
+    // the start, and those that may point to new ones are rescanned
+    if ( nursery ) {
+        uint i = 0;
+        while ( i < 32 ) {
+            Allocator * a = allocators[i];
+            while ( a ) {
+                memcpy( a->marked, a->old,
+                        sizeof( ulong ) * ( ( a->capacity + bits - 1 ) / bits ) );
+                a = a->next;
+            }
+            i++;
+        }
+        i = 0;
+        while ( i < 32 ) {
+            Allocator * a = allocators[i];
+            while ( a ) {
+                a->scanDirtyPages();
+                a = a->next;
+            }
+            i++;
+        }
+    }
+
     // mark
     if ( entries ) {
         uint size = 0;
@@ -583,8 +814,10 @@ Garbage * Allocator::free( List<Garbage> * entries )
             uint m = ::marked;
             mark( ::roots[i].root );
             mark();
-            ::roots[i].objects = objects - o;
-            ::roots[i].size = ::marked - m;
+            if ( !nursery ) {
+                ::roots[i].objects = objects - o;
+                ::roots[i].size = ::marked - m;
+            }
         }
 
         i++;
@@ -595,6 +828,8 @@ Garbage * Allocator::free( List<Garbage> * entries )
     i = 0;
     uint blocks = 0;
     while ( i < 32 ) {
+        classLive[i] = 0;
+        classFreed[i] = 0;
         Allocator * a = allocators[i];
         while ( a ) {
             uint taken = a->taken;
@@ -602,6 +837,8 @@ Garbage * Allocator::free( List<Garbage> * entries )
                 a->sweep();
             freed = freed + ( taken - a->taken ) * a->step;
             total = total + a->taken * a->step;
+            classFreed[i] += ( taken - a->taken ) * a->step;
+            classLive[i] += a->taken * a->step;
             a = a->next;
         }
         Allocator * s = 0;
@@ -621,6 +858,14 @@ Garbage * Allocator::free( List<Garbage> * entries )
         allocators[i] = s;
         i++;
     }
+    // the next nursery collection can trust the soft-dirty bits only
+    // if they've been reset after a collection
+    probeDirtyPages();
+    if ( pagemap >= 0 )
+        dirtyPagesKnown = clearDirtyPages();
+    collected = true;
+    if ( !nursery )
+        ::oldAfterFull = total;
     gettimeofday( &afterSweep, 0 );
 
     uint timeToMark = 0;
@@ -631,6 +876,8 @@ Garbage * Allocator::free( List<Garbage> * entries )
         timeToSweep = ( afterSweep.tv_sec - afterMark.tv_sec ) * 1000000 +
                       ( afterSweep.tv_usec - afterMark.tv_usec );
     }
+    ::lastPause = timeToMark + timeToSweep;
+    ::pauseWasNursery = nursery;
     // dumpRandomObject();
 
     if ( !freed )
@@ -638,7 +885,8 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
     if ( verbose && ( ::allocated >= 4*1024*1024 ||
                       timeToMark + timeToSweep >= 10000 ) )
-        log( "Allocator: allocated " +
+        log( EString( nursery ? "Allocator (nursery)" : "Allocator" ) +
+             ": allocated " +
              EString::humanNumber( ::allocated ) +
              " then freed " +
              EString::humanNumber( freed ) +
@@ -731,12 +979,58 @@ void Allocator::sweep()
             i++;
         }
         marked[b] = 0;
+        old[b] = used[b];
         b++;
     }
     base = 0;
 }
 
 
+/*! Scans the old objects on those of this Allocator's pages that have
+    been written to since the last collection, so that mark() will
+    mark any new objects they point to. If the operating system can't
+    say whether a page has been written, it is assumed to have been.
+*/
+
+void Allocator::scanDirtyPages()
+{
+    ulong first = (ulong)buffer / pageSize;
+    ulong pages = ( capacity * step + pageSize - 1 ) / pageSize;
+    unsigned long long e[512];
+    uint last = UINT_MAX;
+    ulong p = 0;
+    while ( p < pages ) {
+        uint n = 512;
+        if ( pages - p < n )
+            n = pages - p;
+        int r = ::pread( pagemap, e, n * sizeof( e[0] ),
+                         ( first + p ) * sizeof( e[0] ) );
+        if ( r != (int)( n * sizeof( e[0] ) ) )
+            memset( e, 0xff, sizeof( e ) );
+        uint j = 0;
+        while ( j < n ) {
+            if ( e[j] & softDirty ) {
+                ulong start = ( p + j ) * pageSize;
+                uint i = start / step;
+                while ( i < capacity && i * step < start + pageSize ) {
+                    if ( i != last && ( old[i/bits] & 1UL << (i%bits) ) ) {
+                        AllocationBlock * b = (AllocationBlock*)block( i );
+                        if ( b->x.number )
+                            push( b );
+                    }
+                    last = i;
+                    i++;
+                }
+            }
+            j++;
+        }
+        // mark the children before the stack gets too deep
+        mark();
+        p += n;
+    }
+}
+
+
 /*! Returns the amount of memory allocated to hold \a p and any object
     to which p points.
 
@@ -881,6 +1175,82 @@ uint Allocator::inUse()
 }
 
 
+/*! Returns the time taken by the last collection, in microseconds.
+    All other processing stops during that time.
+*/
+
+uint Allocator::lastPause()
+{
+    return ::lastPause;
+}
+
+
+/*! Returns true if the last collection was done by freeNursery(), and
+    false if it was a full collection.
+*/
+
+bool Allocator::lastWasNursery()
+{
+    return ::pauseWasNursery;
+}
+
+
+/*! Returns the size of the chunks in size class \a i, where \a i is
+    at least 0 and less than 32. The sizes are powers of two, as used
+    by rounded(). liveBytes() and freedBytes() use the same numbering.
+*/
+
+uint Allocator::classSize( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    if ( bits == 64 )
+        return 16UL << i;
+    return 8UL << i;
+}
+
+
+/*! Returns the number of bytes used by objects in size class \a i
+    after the last collection. See classSize().
+*/
+
+uint Allocator::liveBytes( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ::classLive[i];
+}
+
+
+/*! Returns the number of bytes the last collection freed in size
+    class \a i. See classSize().
+*/
+
+uint Allocator::freedBytes( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ::classFreed[i];
+}
+
+
+/*! Returns the number of eternal objects, ie. the roots from which
+    collection starts. See addEternal().
+*/
+
+uint Allocator::eternals()
+{
+    uint n = 0;
+    uint i = 0;
+    while ( i < ::numRoots ) {
+        if ( ::roots[i].root )
+            n++;
+        i++;
+    }
+    return n;
+}
+
+
 /*! Returns the amount of memory gobbled up when this Allocator
     allocates memory. This is a little bigger than the biggest object
     this Allocator can provide.
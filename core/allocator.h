@@ -21,6 +21,9 @@ public:
     static Allocator * allocator( uint size );
 
     static Garbage * free( List<Garbage> * = 0 );
+    static bool freeNursery();
+    static bool generational();
+    static void trackDirtyPages();
     static void addEternal( const void *, const char * );
 
     static void removeEternal( void * );
@@ -31,6 +34,13 @@ public:
     static uint allocated();
     static uint inUse();
 
+    static uint lastPause();
+    static bool lastWasNursery();
+    static uint classSize( uint );
+    static uint liveBytes( uint );
+    static uint freedBytes( uint );
+    static uint eternals();
+
     static void * alloc( uint, uint = UINT_MAX );
     static void dealloc( void * );
 
@@ -54,6 +64,7 @@ private:
     uint capacity;
     ulong * used;
     ulong * marked;
+    ulong * old;
     void * buffer;
     Allocator * next;
 
@@ -63,6 +74,8 @@ private:
 private:
     static void mark( void * );
     static void mark();
+    static Garbage * collect( List<Garbage> *, bool );
+    void scanDirtyPages();
     void sweep();
 };
 
@@ -5,28 +5,53 @@
 #include "list.h"
 #include "estring.h"
 #include "allocator.h"
+#include "configuration.h"
 
 // open, O_CREAT|O_RDWR|O_EXCL
 #include <fcntl.h>
 // read, write, unlink, lseek, close
 #include <unistd.h>
+// readv, writev, struct iovec
+#include <sys/uio.h>
 // strlen, memmove
 #include <string.h>
+// malloc, realloc
+#include <stdlib.h>
 
 #include <zlib.h>
 
+#include <errno.h>
+
 
 static const uint bufsiz = 8192;
 static char buffer[bufsiz];
 
+// write() hands at most this many Vectors to each writev() call
+static const uint iovecs = 64;
+
+// a failed read() or write() means the peer is gone, unless there's
+// just nothing to do right now
+static bool lost( int n )
+{
+    return n < 0 && errno != EAGAIN && errno != EWOULDBLOCK;
+}
+
+
+// appendShared() copies strings shorter than this anyway
+static const uint minShared = 1024;
+
 
 
 /*! \class Buffer buffer.h
     A Buffer is a FIFO of bytes.
 
-    There are two ways to append data: append() and read(). Data in
-    the buffer can be examined with operator[] or string(), removed
-    with remove(), or written with write().
+    There are three ways to append data: append(), appendShared() and
+    read(). Data in the buffer can be examined with operator[] or
+    string(), removed with remove(), or written with write().
+
+    write() uses writev() to write as many Vectors as possible with
+    each system call, and read() uses readv() to read straight into
+    the Buffer's own memory. syscalls() and copied() count the cost.
 
     Generally, a buffer is used only to read or only to write. In the
     former case, its owner calls append() and EventLoop calls write(),
@@ -34,24 +59,42 @@ static char buffer[bufsiz];
     calls remove() etc. However, its owner has the option of putting
     things into the buffer and later removing them. One class does use
     that: IMAPS.
+
+    A Compressing Buffer doesn't compress data as it's appended, but
+    keeps it until compress() is called, or until its owner takes it
+    with takeUncompressed() and hands it to deflate(), perhaps in
+    another thread, and then to appendCompressed(). Connection::write()
+    does that via Compressor.
 */
 
 /*! Creates an empty Buffer. */
 
 Buffer::Buffer()
-    : filter( None ), zs( 0 ),
+    : filter( None ), zs( 0 ), pending( 0 ),
       firstused( 0 ), firstfree( 0 ),
-      bytes( 0 )
+      bytes( 0 ), calls( 0 ), copies( 0 ), scanned( 0 )
 {
 }
 
 
-/*! Appends \a l bytes starting at \a s to the Buffer. */
+/*! Appends \a l bytes starting at \a s to the Buffer. If the
+    Buffer is Compressing, the bytes are kept aside until compress()
+    or takeUncompressed() is called.
+*/
 
 void Buffer::append( const char * s, uint l )
 {
-    if ( l )
-        append( s, l, true );
+    if ( !l )
+        return;
+
+    if ( filter == Compressing ) {
+        if ( !pending )
+            pending = new EString;
+        pending->append( s, l );
+        return;
+    }
+
+    append( s, l, true );
 }
 
 
@@ -126,6 +169,7 @@ void Buffer::append( const char * s, uint l, bool f )
 void Buffer::append2( const char * s, uint l )
 {
     bytes += l;
+    copies += l;
 
     // First, we copy as much as we can into the last vector.
     uint n, copied = 0;
@@ -176,48 +220,183 @@ void Buffer::append( const EString &s )
 }
 
 
+/*! Appends \a s to the Buffer without copying it, if possible. The
+    Buffer refers to the storage of \a s until it has been written,
+    and since EString copies its storage before modifying shared
+    storage, later changes to \a s don't affect the Buffer.
+
+    Short strings are copied anyway, as are strings appended to a
+    compressing Buffer.
+*/
+
+void Buffer::appendShared( const EString & s )
+{
+    if ( filter != None || s.length() < minShared ) {
+        append( s );
+        return;
+    }
+
+    // taking a copy marks the storage as shared
+    EString c( s );
+
+    // the current last vector has to end where its data ends
+    Vector * l = vecs.last();
+    if ( l && !bytes ) {
+        vecs.clear();
+        firstused = 0;
+    }
+    else if ( l ) {
+        l->len = firstfree;
+    }
+
+    Vector * v = new Vector;
+    v->base = (char*)c.data();
+    v->len = c.length();
+    v->shared = true;
+    if ( vecs.isEmpty() )
+        firstused = 0;
+    vecs.append( v );
+    firstfree = v->len;
+    bytes += v->len;
+}
+
+
 /*! Reads as much as possible from the file descriptor \a fd into the
     Buffer. It assumes that the file descriptor is nonblocking, and
     that enough memory is available.
+
+    If the Buffer doesn't decompress, readv() reads into the free
+    space of the last Vector first. Small reads are copied from the
+    stack, and large ones go straight into new Vectors.
+
+    Returns true if the other end has closed \a fd or the connection
+    has failed (e.g. been reset), and false if it merely has nothing
+    more to read just now. With edge-triggered polling, the end of the
+    data may arrive together with the last data, and there won't be
+    another chance to notice it.
 */
 
-void Buffer::read( int fd )
+bool Buffer::read( int fd )
 {
-    char buf[32768];
+    if ( filter != None ) {
+        char buf[32768];
+        int n = 1;
+        while ( n > 0 || ( n < 0 && errno == EINTR ) ) {
+            n = ::read( fd, &buf, 32768 );
+            calls++;
+            if ( n > 0 )
+                append( buf, n );
+        }
+        return n == 0 || lost( n );
+    }
 
-    int n = ::read( fd, &buf, 32768 );
-    while ( n > 0 ) {
-        append( buf, n );
-        n = ::read( fd, &buf, 32768 );
+    // a small read is copied from the stack, so that idle
+    // connections don't each keep a spare Vector. once a read fills
+    // the stack buffer, more is probably coming, so the rest is read
+    // straight into new Vectors.
+    char buf[bufsiz];
+    Vector * spare = 0;
+    bool bulk = false;
+    int n = 1;
+    while ( n > 0 || ( n < 0 && errno == EINTR ) ) {
+        struct iovec iov[2];
+        uint c = 0;
+        Vector * v = vecs.last();
+        uint room = 0;
+        if ( v && !v->shared && v->len > firstfree ) {
+            room = v->len - firstfree;
+            iov[c].iov_base = v->base + firstfree;
+            iov[c].iov_len = room;
+            c++;
+        }
+        if ( bulk && !spare ) {
+            spare = new Vector;
+            spare->len = Allocator::rounded( bufsiz );
+            spare->base = (char*)Allocator::alloc( spare->len, 0 );
+        }
+        if ( spare ) {
+            iov[c].iov_base = spare->base;
+            iov[c].iov_len = spare->len;
+        }
+        else {
+            iov[c].iov_base = buf;
+            iov[c].iov_len = bufsiz;
+        }
+        c++;
+
+        n = ::readv( fd, iov, c );
+        calls++;
+        if ( n > 0 ) {
+            uint r = n;
+            if ( r <= room ) {
+                bytes += r;
+                firstfree += r;
+            }
+            else if ( spare ) {
+                bytes += r;
+                if ( vecs.isEmpty() )
+                    firstused = 0;
+                vecs.append( spare );
+                firstfree = r - room;
+                spare = 0;
+            }
+            else {
+                bytes += room;
+                firstfree += room;
+                append2( buf, r - room );
+                bulk = ( r - room == bufsiz );
+            }
+        }
     }
+    return n == 0 || lost( n );
 }
 
 
 /*! Writes as much as possible from the Buffer to its file descriptor
     \a fd. That file descriptor must be nonblocking.
+
+    Each writev() call writes as many Vectors as it can, so many
+    small responses cost one system call rather than one each.
+
+    Returns true if the connection has failed (e.g. the peer has
+    reset it), and false if all was written or the rest must wait.
 */
 
-void Buffer::write( int fd )
+bool Buffer::write( int fd )
 {
     int written = 1;
 
-    while ( written > 0 ) {
-        Vector * v = vecs.firstElement();
-
-        int max = 0;
-        if ( v )
-            max = v->len;
-        if ( vecs.count() == 1 )
-            max = firstfree;
-        int n = max - firstused;
+    while ( ( written > 0 || ( written < 0 && errno == EINTR ) ) &&
+            bytes > 0 ) {
+        struct iovec iov[iovecs];
+        uint c = 0;
+        uint first = firstused;
+        List< Vector >::Iterator i( vecs );
+        while ( i && c < iovecs ) {
+            Vector * v = i;
+            ++i;
+            uint end = v->len;
+            if ( !i )
+                end = firstfree;
+            if ( end > first ) {
+                iov[c].iov_base = v->base + first;
+                iov[c].iov_len = end - first;
+                c++;
+            }
+            first = 0;
+        }
 
-        if ( n <= 0 || !v )
+        if ( !c ) {
             written = 0;
-        else
-            written = ::write( fd, v->base+firstused, n );
+        }
+        else {
+            written = ::writev( fd, iov, c );
+            calls++;
+        }
         if ( written > 0 )
             remove( written );
     }
+    return lost( written );
 }
 
 
@@ -235,13 +414,17 @@ void Buffer::remove( uint n )
     if ( n > bytes )
         n = bytes;
     bytes -= n;
+    if ( scanned > n )
+        scanned -= n;
+    else
+        scanned = 0;
 
     Vector *v = vecs.firstElement();
 
     if ( bytes == 0 ) {
         firstused = firstfree = 0;
         vecs.clear();
-        if ( v && ( v->len > 100 && v->len < 20000 ) )
+        if ( v && !v->shared && ( v->len > 100 && v->len < 20000 ) )
             vecs.append( v );
         return;
     }
@@ -343,34 +526,203 @@ EString Buffer::string( uint num ) const
     line less than \a s bytes long, this function a null pointer.
 
     If \a s has its default value of 0, the entire Buffer is searched.
+
+    The Buffer remembers how far it has searched, so calling this
+    repeatedly while a long line arrives doesn't search the start of
+    the line again each time.
 */
 
 EString * Buffer::removeLine( uint s )
 {
-    uint i = 0, n = 0;
-    EString * r;
-
     if ( s == 0 || s > size() )
         s = size();
 
-    while ( i < s && (*this)[i] != '\012' )
-        i++;
-
-    if ( i == s )
+    uint from = scanned;
+    if ( from > s )
+        from = s;
+    int lf = find( '\012', from, s );
+    if ( lf < 0 ) {
+        scanned = s;
         return 0;
+    }
 
-    n = 1;
+    uint i = lf;
+    uint n = 1;
     if ( i > 0 && (*this)[i-1] == '\015' ) {
         i--;
         n++;
     }
 
-    r = new EString( string( i ) );
+    EString * r = new EString( string( i ) );
     remove( i+n );
     return r;
 }
 
 
+/*! Removes as many complete lines of SMTP DATA as the Buffer
+    contains, undoes the dot-stuffing and appends them to \a body,
+    each with a CRLF line ending. If the line containing only a dot
+    is found, that line is removed too, and this function returns
+    true. Otherwise it returns false, and leaves any incomplete line
+    in the Buffer.
+
+    This does the same as calling removeLine() for each line, but
+    walks the Vectors just once, using memchr() to find line endings,
+    and copies each line straight into \a body.
+*/
+
+bool Buffer::removeDotStuffed( EString * body )
+{
+    // body is truncated to keep and consumed bytes removed when
+    // we're done, so that any incomplete line stays in the Buffer
+    uint keep = body->length();
+    uint consumed = 0;
+    uint pos = 0;
+    bool lineStart = true;
+    bool dotted = false;
+    bool empty = true;
+    bool cr = false;
+    bool done = false;
+
+    uint first = firstused;
+    List< Vector >::Iterator i( vecs );
+    while ( i && !done ) {
+        Vector * v = i;
+        ++i;
+        const char * p = v->base + first;
+        const char * e = v->base + v->len;
+        if ( !i )
+            e = v->base + firstfree;
+        first = 0;
+        while ( p < e && !done ) {
+            if ( lineStart ) {
+                lineStart = false;
+                dotted = ( *p == '.' );
+                empty = true;
+                if ( dotted ) {
+                    p++;
+                    pos++;
+                    continue;
+                }
+            }
+            const char * lf = (const char *)memchr( p, '\012', e - p );
+            const char * stop = e;
+            if ( lf )
+                stop = lf;
+            if ( cr && p < stop ) {
+                // the CR before the previous Vector's end wasn't
+                // part of a line ending after all
+                body->append( '\015' );
+                cr = false;
+                empty = false;
+            }
+            const char * t = stop;
+            if ( t > p && t[-1] == '\015' ) {
+                t--;
+                cr = true;
+            }
+            if ( t > p ) {
+                body->append( p, t - p );
+                empty = false;
+            }
+            pos += stop - p;
+            p = stop;
+            if ( lf ) {
+                cr = false;
+                if ( dotted && empty ) {
+                    done = true;
+                }
+                else {
+                    body->append( "\r\n" );
+                    keep = body->length();
+                    lineStart = true;
+                }
+                p++;
+                pos++;
+                consumed = pos;
+            }
+        }
+    }
+
+    body->truncate( keep );
+    remove( consumed );
+    if ( !done )
+        scanned = size();
+    return done;
+}
+
+
+/*! Returns the index of the first occurrence of \a c in the Buffer at
+    or after \a from and before \a to, or -1 if there is none. The
+    search uses memchr() on each Vector in turn.
+*/
+
+int Buffer::find( char c, uint from, uint to ) const
+{
+    if ( to > bytes )
+        to = bytes;
+    uint offset = 0;
+    uint first = firstused;
+    List< Vector >::Iterator i( vecs );
+    while ( i && offset < to ) {
+        Vector * v = i;
+        ++i;
+        uint n = v->len - first;
+        if ( !i )
+            n = firstfree - first;
+        if ( offset + n > from ) {
+            uint a = 0;
+            if ( from > offset )
+                a = from - offset;
+            uint b = n;
+            if ( to - offset < b )
+                b = to - offset;
+            const char * base = v->base + first;
+            if ( b > a ) {
+                const char * p = (const char *)memchr( base + a, c, b - a );
+                if ( p )
+                    return offset + ( p - base );
+            }
+        }
+        offset += n;
+        first = 0;
+    }
+    return -1;
+}
+
+
+/*! Appends the \a n bytes starting at index \a from in the Buffer to
+    \a s, copying from each Vector in turn. The bytes must exist.
+*/
+
+void Buffer::extract( EString * s, uint from, uint n ) const
+{
+    uint offset = 0;
+    uint first = firstused;
+    List< Vector >::Iterator i( vecs );
+    while ( i && n ) {
+        Vector * v = i;
+        ++i;
+        uint l = v->len - first;
+        if ( !i )
+            l = firstfree - first;
+        if ( offset + l > from ) {
+            uint a = 0;
+            if ( from > offset )
+                a = from - offset;
+            uint c = l - a;
+            if ( c > n )
+                c = n;
+            s->append( v->base + first + a, c );
+            from += c;
+            n -= c;
+        }
+        offset += l;
+        first = 0;
+    }
+}
+
+
 /*! Instructs this Buffer to compress any data added if \a c is
     Compressing, and to decompress if \a c is Decompressing.
 
@@ -384,9 +736,20 @@ void Buffer::setCompression( Compression c )
     zs->zalloc = 0;
     zs->zfree = 0;
     zs->opaque = 0;
-    if ( c == Compressing )
-        ::deflateInit2( zs, 9, Z_DEFLATED,
-                        -15, 9, Z_DEFAULT_STRATEGY );
+    if ( c == Compressing ) {
+        uint level =
+            Configuration::scalar( Configuration::CompressionLevel );
+        if ( level > 9 )
+            level = 9;
+        uint memLevel =
+            Configuration::scalar( Configuration::CompressionMemoryLevel );
+        if ( memLevel < 1 )
+            memLevel = 1;
+        else if ( memLevel > 9 )
+            memLevel = 9;
+        ::deflateInit2( zs, level, Z_DEFLATED,
+                        -15, memLevel, Z_DEFAULT_STRATEGY );
+    }
     else if ( c == Decompressing )
         ::inflateInit2( zs, -15 );
     filter = c;
@@ -417,5 +780,118 @@ void Buffer::close()
     else if ( filter == Decompressing )
         ::inflateEnd( zs );
     zs = 0;
+    pending = 0;
     filter = None;
 }
+
+
+/*! Returns the number of bytes appended to this Compressing Buffer
+    and not yet compressed or taken by takeUncompressed(). */
+
+uint Buffer::uncompressed() const
+{
+    if ( !pending )
+        return 0;
+    return pending->length();
+}
+
+
+/*! Compresses everything appended to this Compressing Buffer so far
+    and adds the result to the Buffer, flushing zlib so the peer can
+    decompress all of it.
+*/
+
+void Buffer::compress()
+{
+    if ( !pending || pending->isEmpty() )
+        return;
+
+    EString * s = pending;
+    pending = 0;
+    append( s->data(), s->length(), true );
+}
+
+
+/*! Returns the data appended to this Compressing Buffer and not yet
+    compressed, and forgets it. The caller must give it to deflate()
+    and the result to appendCompressed() before anything else is
+    compressed.
+*/
+
+EString Buffer::takeUncompressed()
+{
+    if ( !pending )
+        return "";
+    EString r( *pending );
+    pending = 0;
+    return r;
+}
+
+
+/*! Compresses \a input, flushing zlib at the end, and stores a
+    pointer to the result in \a output and its size in \a length.
+    The result is allocated with malloc(), and the caller must free()
+    it.
+
+    This function doesn't allocate garbage-collected memory, and uses
+    nothing but this Buffer's zlib state, so it may be called from
+    another thread as long as nothing else uses this Buffer's
+    compressor meanwhile.
+*/
+
+void Buffer::deflate( const EString & input, char ** output, uint * length )
+{
+    uint size = input.length() / 2 + 64;
+    uint used = 0;
+    char * o = (char*)::malloc( size );
+    zs->avail_in = input.length();
+    zs->next_in = (Bytef*)input.data();
+    int r = Z_OK;
+    while ( o && r == Z_OK ) {
+        zs->next_out = (Bytef*)o + used;
+        zs->avail_out = size - used;
+        r = ::deflate( zs, Z_SYNC_FLUSH );
+        used = size - zs->avail_out;
+        if ( zs->avail_out )
+            break;
+        size *= 2;
+        char * n = (char*)::realloc( o, size );
+        if ( !n )
+            ::free( o );
+        o = n;
+    }
+    *output = o;
+    *length = o ? used : 0;
+}
+
+
+/*! Adds the \a l bytes at \a s, which deflate() produced, to this
+    Buffer.
+*/
+
+void Buffer::appendCompressed( const char * s, uint l )
+{
+    if ( l )
+        append2( s, l );
+}
+
+
+/*! Returns the number of read and write system calls this Buffer has
+    made.
+*/
+
+uint Buffer::syscalls() const
+{
+    return calls;
+}
+
+
+/*! Returns the number of bytes this Buffer has copied into its own
+    memory, including bytes de-/compressed into it, but not bytes
+    read() or appendShared() without copying.
+*/
+
+uint Buffer::copied() const
+{
+    return copies;
+}
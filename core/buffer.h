@@ -22,14 +22,18 @@ public:
 
     void append( const EString & );
     void append( const char *, uint );
+    void appendShared( const EString & );
 
-    void read( int );
-    void write( int );
+    bool read( int );
+    bool write( int );
 
     uint size() const { return bytes; }
     void remove( uint );
     EString string( uint ) const;
     EString * removeLine( uint = 0 );
+    void extract( EString *, uint, uint ) const;
+    bool removeDotStuffed( EString * );
+    int find( char, uint = 0, uint = UINT_MAX ) const;
 
     char operator[]( uint i ) const {
         if ( i >= bytes )
@@ -45,6 +49,15 @@ public:
 
     void close();
 
+    uint uncompressed() const;
+    void compress();
+    EString takeUncompressed();
+    void deflate( const EString &, char **, uint * );
+    void appendCompressed( const char *, uint );
+
+    uint syscalls() const;
+    uint copied() const;
+
 private:
     char at( uint ) const;
 
@@ -55,19 +68,23 @@ private:
     struct Vector
         : public Garbage
     {
-        Vector() : base( 0 ), len( 0 ) {
+        Vector() : base( 0 ), len( 0 ), shared( false ) {
             setFirstNonPointer( &len );
         }
         char *base;
         // no pointers after this line
         uint len;
+        bool shared;
     };
 
     List< Vector > vecs;
     Compression filter;
     struct z_stream_s * zs;
+    EString * pending;
     uint firstused, firstfree;
     uint bytes;
+    uint calls, copies;
+    uint scanned;
 };
 
 
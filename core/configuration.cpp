@@ -164,7 +164,10 @@ static struct {
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "compression-level", Configuration::CompressionLevel, 9 },
+    { "compression-memory-level", Configuration::CompressionMemoryLevel, 9 },
+    { "compression-threads", Configuration::CompressionThreads, 0 }
 };
 
 
@@ -243,7 +246,9 @@ static struct {
     { "use-statistics", Configuration::UseStatistics, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
-    { "use-imap-quota", Configuration::UseImapQuota, true }
+    { "use-imap-quota", Configuration::UseImapQuota, true },
+    { "use-tls-threads", Configuration::UseTlsThreads, false },
+    { "store-rfc822", Configuration::StoreRfc822, false }
 };
 
 
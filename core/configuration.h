@@ -57,6 +57,9 @@ public:
         StatisticsPort,
         LdapServerPort,
         MemoryLimit,
+        CompressionLevel,
+        CompressionMemoryLevel,
+        CompressionThreads,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -134,6 +137,8 @@ public:
         SoftBounce,
         CheckSenderAddresses,
         UseImapQuota,
+        UseTlsThreads,
+        StoreRfc822,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
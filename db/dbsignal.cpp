@@ -11,15 +11,19 @@
 
 static List<DatabaseSignal> * signals = 0;
 
+// if the owner doesn't pick up the payloads, we keep only this many
+static const uint maxPayloads = 1024;
+
 
 class DatabaseSignalData
     : public Garbage
 {
 public:
-    DatabaseSignalData(): o( 0 ), l( new Log ) {}
+    DatabaseSignalData(): o( 0 ), l( new Log ), payloads( 0 ) {}
     EString n;
     EventHandler * o;
     Log * l;
+    EStringList * payloads;
 };
 
 
@@ -32,6 +36,9 @@ public:
 
     This is an eternal object. Once you've done this, there is no
     turning back. The listening never stops.
+
+    If the NOTIFY includes a payload, the owner can retrieve it using
+    takePayloads().
 */
 
 
@@ -57,21 +64,50 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name, after recording \a payload (if it's not empty) for
+    takePayloads().
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::notifyAll( const EString & name,
+                                const EString & payload )
 {
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
         ++i;
-        if ( name == s->d->n && s->d->o )
+        if ( name == s->d->n && s->d->o ) {
+            if ( !payload.isEmpty() ) {
+                if ( !s->d->payloads )
+                    s->d->payloads = new EStringList;
+                // an empty string stands in for everything we drop
+                if ( s->d->payloads->count() < maxPayloads )
+                    s->d->payloads->append( payload );
+                else if ( !s->d->payloads->lastElement()->isEmpty() )
+                    s->d->payloads->append( "" );
+            }
             s->d->o->notify();
+        }
     }
 }
 
 
+/*! Returns the payloads of the notifications received since the last
+    call, in the order they were received, and forgets them. Returns a
+    null pointer if there are none.
+
+    If too many notifications arrive without anyone calling this
+    function, the excess payloads are replaced by a single empty
+    string.
+*/
+
+EStringList * DatabaseSignal::takePayloads()
+{
+    EStringList * r = d->payloads;
+    d->payloads = 0;
+    return r;
+}
+
+
 /*! This destructor is private, so noone can ever call it. Objects of
     this class are indestructible by nature.
 */
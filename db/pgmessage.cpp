@@ -8,9 +8,13 @@
 #include "buffer.h"
 #include "query.h"
 
+// memcpy
+#include <string.h>
+
 
 static bool haveAskedForCitext;
 static int citextOid;
+static bool integerDatetimes = true;
 
 CitextLookup::CitextLookup() : EventHandler() {
     ::haveAskedForCitext = true;
@@ -662,7 +666,7 @@ PgParseComplete::PgParseComplete( Buffer *b )
 
 PgBind::PgBind( const EString &src, const EString &dst )
     : PgClientMessage( 'B' ),
-      stmt( src ), portal( dst ), values( 0 )
+      stmt( src ), portal( dst ), values( 0 ), format( Query::Binary )
 {
 }
 
@@ -677,6 +681,16 @@ void PgBind::bind( List< Query::Value > *v )
 }
 
 
+/*! Asks the server to send all result columns in format \a f. The
+    default is Query::Binary.
+*/
+
+void PgBind::setResultFormat( Query::Format f )
+{
+    format = f;
+}
+
+
 void PgBind::encodeData()
 {
     appendString( portal );
@@ -707,9 +721,9 @@ void PgBind::encodeData()
         }
     }
 
-    // All results should be binary-encoded.
-    appendInt16( 1 );
+    // One result format, which applies to all columns.
     appendInt16( 1 );
+    appendInt16( format );
 }
 
 
@@ -754,6 +768,46 @@ void PgDescribe::encodeData()
 
 
 
+/*! \class PgClose pgmessage.h
+    C: Closes a prepared statement or portal.
+
+    This message consists of one byte ('S' for a prepared statement, and
+    'P' for a portal) followed by a name (EString).
+*/
+
+/*! Creates a Close message for the name \a n of type \a t, which must
+    be P or S ('S' by default).
+*/
+
+PgClose::PgClose( const EString &n, char t )
+    : PgClientMessage( 'C' ),
+      type( t ), name( n )
+{
+}
+
+
+void PgClose::encodeData()
+{
+    appendByte( type );
+    appendString( name );
+}
+
+
+
+/*! \class PgCloseComplete pgmessage.h
+    S: This indicates that a Close message was successfully processed.
+
+    This message contains no data.
+*/
+
+PgCloseComplete::PgCloseComplete( Buffer *b )
+    : PgServerMessage( b )
+{
+    end();
+}
+
+
+
 /*! \class PgNoData pgmessage.h
     S: The description of something that cannot return data.
 
@@ -903,9 +957,10 @@ PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
                 cv->type = Column::Bytes;
                 break;
             }
-            log( "PostgreSQL: Unknown field type " + fn( it->type ) +
-                 " for column " + it->name.quoted(),
-                 Log::Error );
+            if ( it->format == 1 )
+                log( "PostgreSQL: Unknown field type " + fn( it->type ) +
+                     " for column " + it->name.quoted(),
+                     Log::Error );
             cv->type = Column::Unknown;
             break;
         }
@@ -914,6 +969,13 @@ PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
         if ( length == -1 )
             cv->type = Column::Null;
 
+        if ( it->format == 0 && cv->type != Column::Null ) {
+            decodeText( cv, decodeByten( length ), it->type );
+            ++it;
+            i++;
+            continue;
+        }
+
         switch ( cv->type ) {
         case Column::Unknown:
             // we've just logged the error, but supplement it
@@ -976,7 +1038,33 @@ PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
             cv->s = decodeByten( length );
             break;
         case Column::Timestamp:
-            cv->s = decodeByten( length );
+            if ( length == 8 ) {
+                int64 t = (((int64)(*buf)[0]) << 56) |
+                          (((int64)(*buf)[1]) << 48) |
+                          (((int64)(*buf)[2]) << 40) |
+                          (((int64)(*buf)[3]) << 32) |
+                          (((int64)(*buf)[4]) << 24) |
+                          (((int64)(*buf)[5]) << 16) |
+                          (((int64)(*buf)[6]) <<  8) |
+                          (*buf)[7];
+                buf->remove( 8 );
+                n += 8;
+                // microseconds or seconds since 2000-01-01 00:00 UTC,
+                // which is 946684800 in Unix time
+                if ( ::integerDatetimes ) {
+                    cv->bi = t / 1000000;
+                }
+                else {
+                    double f;
+                    memcpy( &f, &t, 8 );
+                    cv->bi = (int64)f;
+                }
+                cv->bi += 946684800;
+            }
+            else {
+                log( "Timestamp column " + it->name.quoted() +
+                     " has value " + decodeByten( length ).quoted() );
+            }
             break;
         case Column::Null:
             // nothing needed
@@ -992,6 +1080,86 @@ PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
 }
 
 
+/*! This private helper stores the text-format value \a v in \a cv,
+    which has already been given a type based on the type \a oid.
+    Values whose type we don't know are kept as strings, since that's
+    what a query asks for text results for.
+*/
+
+void PgDataRow::decodeText( Column * cv, const EString & v, int oid )
+{
+    bool ok = true;
+    bool minus = v.startsWith( "-" );
+    EString digits = v;
+    if ( minus )
+        digits = v.mid( 1 );
+
+    switch ( cv->type ) {
+    case Column::Boolean:
+        cv->b = ( v == "t" );
+        break;
+    case Column::Integer:
+        cv->i = digits.number( &ok );
+        if ( minus )
+            cv->i = -cv->i;
+        break;
+    case Column::Bigint:
+        cv->bi = 0;
+        for ( uint j = 0; j < digits.length() && ok; j++ ) {
+            if ( digits[j] < '0' || digits[j] > '9' )
+                ok = false;
+            else
+                cv->bi = cv->bi * 10 + digits[j] - '0';
+        }
+        if ( minus )
+            cv->bi = -cv->bi;
+        break;
+    case Column::Bytes:
+        if ( oid == 17 && v.startsWith( "\\x" ) ) {
+            // bytea's hex output format
+            cv->s.truncate();
+            cv->s.reserve( v.length() / 2 );
+            uint j = 2;
+            while ( j + 1 < v.length() && ok ) {
+                uint c = v.mid( j, 2 ).number( &ok, 16 );
+                cv->s.append( (char)c );
+                j += 2;
+            }
+        }
+        else {
+            cv->s = v;
+        }
+        break;
+    case Column::Timestamp:
+        // we keep the text, but can't offer the Unix time
+        cv->s = v;
+        cv->bi = 0;
+        break;
+    case Column::Unknown:
+        cv->type = Column::Bytes;
+        cv->s = v;
+        break;
+    case Column::Null:
+        break;
+    }
+
+    if ( !ok )
+        log( "Column of type " + Column::typeName( cv->type ) +
+             " has value " + v.quoted() );
+}
+
+
+/*! Records whether the server's timestamps count microseconds in an
+    integer (\a i is true, the default) or seconds in a double (\a i is
+    false), as reported by the integer_datetimes parameter.
+*/
+
+void PgDataRow::setIntegerDatetimes( bool i )
+{
+    ::integerDatetimes = i;
+}
+
+
 /*! Returns a pointer to a Row object based on the contents of the
     data row message.
 */
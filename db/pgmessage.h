@@ -206,6 +206,7 @@ class PgBind
 public:
     PgBind( const EString & = "", const EString & = "" );
     void bind( List< Query::Value > * );
+    void setResultFormat( Query::Format );
 
 private:
     void encodeData();
@@ -213,6 +214,7 @@ private:
     EString stmt;
     EString portal;
     List< Query::Value > *values;
+    Query::Format format;
 };
 
 
@@ -238,6 +240,28 @@ private:
 };
 
 
+class PgClose
+    : public PgClientMessage
+{
+public:
+    PgClose( const EString &, char = 'S' );
+
+private:
+    void encodeData();
+
+    char type;
+    EString name;
+};
+
+
+class PgCloseComplete
+    : public PgServerMessage
+{
+public:
+    PgCloseComplete( Buffer * );
+};
+
+
 class PgNoData
     : public PgServerMessage
 {
@@ -295,8 +319,12 @@ public:
     PgDataRow( Buffer *, const PgRowDescription * );
     Row *row() const;
 
+    static void setIntegerDatetimes( bool );
+
 private:
     Row *r;
+
+    void decodeText( class Column *, const EString &, int );
 };
 
 
@@ -32,6 +32,106 @@ static uint serverVersion;
 static Postgres * listener = 0;
 
 
+// an ad-hoc query is prepared once its text has been executed this
+// many times...
+static const uint promotionThreshold = 3;
+// ...each backend keeps at most this many such statements...
+static const uint maxAutoPrepared = 64;
+// ...and we remember the execution counts of this many texts.
+static const uint maxStatements = 2048;
+
+
+class PgStatement
+    : public Garbage
+{
+public:
+    PgStatement()
+        : Garbage(), executions( 0 ), parses( 0 ), lastUse( 0 )
+    {}
+
+    EString text;
+    uint executions;
+    uint parses;
+    uint lastUse;
+};
+
+
+class PgPrepared
+    : public Garbage
+{
+public:
+    PgPrepared(): Garbage(), lastUse( 0 ), syncs( 0 ) {}
+
+    EString text;
+    EString name;
+    uint lastUse;
+    uint syncs;
+};
+
+
+static Dict<PgStatement> * statements = 0;
+static List<PgStatement> * statementList = 0;
+static uint statementCount = 0;
+static uint statementUses = 0;
+static GraphableCounter * statementParses = 0;
+static GraphableCounter * statementReuses = 0;
+
+
+// the statistics port shows the hit rates of this many statements
+static const uint reportedStatements = 10;
+
+
+class PgStatementReport
+    : public GraphableReport
+{
+public:
+    PgStatementReport(): GraphableReport() {}
+
+    // one line per statement: fingerprint, executions, parses and
+    // the beginning of the text
+    EString report() {
+        PgStatement * top[reportedStatements];
+        uint n = 0;
+        List<PgStatement>::Iterator i( ::statementList );
+        while ( i ) {
+            PgStatement * st = i;
+            ++i;
+            uint j = n;
+            while ( j > 0 && top[j-1]->executions < st->executions ) {
+                if ( j < reportedStatements )
+                    top[j] = top[j-1];
+                j--;
+            }
+            if ( j < reportedStatements ) {
+                top[j] = st;
+                if ( n < reportedStatements )
+                    n++;
+            }
+        }
+
+        EString r;
+        uint j = 0;
+        while ( j < n ) {
+            PgStatement * st = top[j];
+            EString text = st->text.simplified();
+            if ( text.length() > 64 )
+                text = text.mid( 0, 60 ) + "...";
+            r.append( "statement " );
+            r.append( MD5::hash( st->text ).hex().mid( 0, 8 ) );
+            r.append( " " );
+            r.appendNumber( st->executions );
+            r.append( " " );
+            r.appendNumber( st->parses );
+            r.append( " " );
+            r.append( text );
+            r.append( "\r\n" );
+            j++;
+        }
+        return r;
+    }
+};
+
+
 class PgData
     : public Garbage
 {
@@ -43,7 +143,7 @@ public:
           sendingCopy( false ), error( false ),
           keydata( 0 ),
           description( 0 ), transaction( 0 ),
-          needNotify( 0 ), backendPid( 0 )
+          needNotify( 0 ), backendPid( 0 ), autoNames( 0 )
         {}
 
     bool active;
@@ -60,14 +160,20 @@ public:
     PgRowDescription *description;
     Dict<Postgres> prepared;
     EStringList preparesPending;
+    Dict<PgPrepared> autoPrepared;
+    List<PgPrepared> autoPreparedList;
+    List<PgPrepared> closesPending;
+    List<PgPrepared> closesToResend;
 
     List< Query > queries;
+    List< Query > syncs;
     Transaction *transaction;
     Query * needNotify;
 
     EString user;
 
     uint backendPid;
+    uint autoNames;
 
     class LockSpotter
         : public EventHandler {
@@ -180,11 +286,18 @@ Postgres::~Postgres()
 
 void Postgres::processQueue()
 {
-    if ( !d->queries.isEmpty() )
+    if ( d->sendingCopy )
         return;
 
-    if ( d->sendingCopy )
+    // While the backend is busy, we can still pipeline more queries
+    // from the same transaction behind those we've already sent.
+    // Anything else waits until the backend is idle.
+    if ( !d->queries.isEmpty() ) {
+        if ( !d->transaction || d->transaction->done() || d->error )
+            return;
+        pipeline( d->transaction->submittedQueries() );
         return;
+    }
 
     if ( d->transaction &&
          ( d->transaction->state() == Transaction::Completed ||
@@ -210,14 +323,85 @@ void Postgres::processQueue()
             Transaction * t = l->firstElement()->transaction();
             d->transaction = t;
             t->setDatabase( this );
+            // whatever the transaction has queued up can go along
+            // with its begin
+            l->append( t->submittedQueries() );
+        }
+    }
+
+    if ( d->transaction ) {
+        pipeline( l );
+    }
+    else {
+        // Outside a transaction, each query commits on its own and
+        // must not be rolled back if the next one fails, so each gets
+        // its own Sync.
+        Query * q = l->shift();
+        while ( q ) {
+            q->setState( Query::Executing );
+            if ( !d->error ) {
+                processQuery( q );
+            }
+            else {
+                q->setError( "Database handle no longer usable." );
+                q->notify();
+            }
+            q = l->shift();
         }
     }
 
+    if ( d->queries.isEmpty() )
+        reactToIdleness();
+}
+
+
+// Returns true if \a s starts with "rollback" in any case. This is
+// called for every pipelined query, so it doesn't copy \a s.
+
+static bool isRollback( const EString & s )
+{
+    const char * r = "rollback";
+    uint i = 0;
+    while ( r[i] ) {
+        if ( i >= s.length() || ( s[i] | 0x20 ) != r[i] )
+            return false;
+        i++;
+    }
+    return true;
+}
+
+
+/*! Sends all the queries in \a l as a single pipeline, followed by one
+    Sync message, so the backend processes them all without waiting
+    for us in between. All the queries must belong to the current
+    transaction.
+
+    If one of the queries fails, the backend skips the others until
+    the Sync, and process() fails them when the corresponding
+    ReadyForQuery message arrives.
+*/
+
+void Postgres::pipeline( List< Query > * l )
+{
+    uint n = 0;
+    uint batch = 0;
     Query * q = l->shift();
     while ( q ) {
         q->setState( Query::Executing );
         if ( !d->error ) {
-            processQuery( q );
+            // a rollback must not be skipped because of an error
+            // earlier in the same pipeline, so it starts a new one
+            if ( batch && isRollback( q->string() ) ) {
+                sync();
+                batch = 0;
+            }
+            processQuery( q, false );
+            n++;
+            batch++;
+            // the backend accepts nothing but copy data once the
+            // copy starts, so nothing may be sent after it
+            if ( q->inputLines() )
+                d->sendingCopy = true;
         }
         else {
             q->setError( "Database handle no longer usable." );
@@ -226,25 +410,46 @@ void Postgres::processQueue()
         q = l->shift();
     }
 
-    if ( d->queries.isEmpty() )
-        reactToIdleness();
+    if ( !n )
+        return;
+
+    if ( batch )
+        sync();
+    if ( n > 1 )
+        log( "Pipelined " + fn( n ) + " queries on backend " +
+             fn( connectionNumber() ), Log::Debug );
 }
 
 
 /*! Sends whatever messages are required to make the backend process the
-    query \a q.
+    query \a q. If \a sync is true (the default), a Sync message follows,
+    so the query is processed on its own. If not, the caller must send
+    the Sync itself, after any other queries it wants in the same
+    pipeline.
 */
 
-void Postgres::processQuery( Query * q )
+void Postgres::processQuery( Query * q, bool sync )
 {
     Scope x( q->log() );
+    List<PgPrepared>::Iterator ci( d->closesToResend );
+    while ( ci ) {
+        PgPrepared * p = ci;
+        d->closesToResend.take( ci );
+        closeStatement( p );
+    }
     d->queries.append( q );
+    EString text( queryString( q ) );
+    PgStatement * st = statement( text );
+    if ( q->name() == "" && !q->inputLines() )
+        reuseStatement( q, st );
     EString s( "Sent " );
     if ( q->name() == "" ||
          !d->prepared.contains( q->name() ) )
     {
-        PgParse a( queryString( q ), q->name() );
+        PgParse a( text, q->name() );
         a.enqueue( writeBuffer() );
+        st->parses++;
+        statementParses->tick();
 
         if ( q->name() != "" ) {
             d->prepared.insert( q->name(), this );
@@ -253,9 +458,13 @@ void Postgres::processQuery( Query * q )
 
         s.append( "parse/" );
     }
+    else {
+        statementReuses->tick();
+    }
 
     PgBind b( q->name() );
     b.bind( q->values() );
+    b.setResultFormat( q->resultFormat() );
     b.enqueue( writeBuffer() );
 
     PgDescribe c;
@@ -264,8 +473,8 @@ void Postgres::processQuery( Query * q )
     PgExecute ex;
     ex.enqueue( writeBuffer() );
 
-    PgSync e;
-    e.enqueue( writeBuffer() );
+    if ( sync )
+        this->sync();
 
     s.append( "execute for " );
     s.append( q->description() );
@@ -463,6 +672,9 @@ void Postgres::backendStartup( char type )
     case 'Z':
         setTimeout( 0 );
         d->startup = false;
+        // process() will see this ReadyForQuery too, but it doesn't
+        // answer a Sync of ours
+        d->syncs.append( (Query *)0 );
         if ( CitextLookup::necessary() )
             processQuery( (new CitextLookup())->q );
         addHandle( this );
@@ -520,6 +732,13 @@ void Postgres::process( char type )
         }
         break;
 
+    case '3':
+        {
+            PgCloseComplete msg( readBuffer() );
+            d->closesPending.shift();
+        }
+        break;
+
     case 'n':
         {
             PgNoData msg( readBuffer() );
@@ -620,6 +839,8 @@ void Postgres::process( char type )
         {
             PgReady msg( readBuffer() );
             setState( msg.state() );
+            skipped( d->syncs.shift() );
+            closesSkipped();
         }
         break;
 
@@ -631,7 +852,7 @@ void Postgres::process( char type )
                 s = " (" + msg.source() + ")";
             log( "Received notify " + msg.name().quoted() +
                  " from server pid " + fn( msg.pid() ) + s, Log::Debug );
-            DatabaseSignal::notifyAll( msg.name() );
+            DatabaseSignal::notifyAll( msg.name(), msg.source() );
         }
         break;
 
@@ -678,7 +899,8 @@ void Postgres::unknown( char type )
                 //     information)."
                 // We don't care about that. Email uses only seconds,
                 // and only a fairly limited time range. Both on and
-                // off are okay.
+                // off are okay, but binary timestamps look different.
+                PgDataRow::setIntegerDatetimes( v == "on" );
             }
             else if ( n == "is_superuser" ) {
                 if ( v.simplified().lower() != "off" )
@@ -918,6 +1140,55 @@ void Postgres::serverMessage()
 }
 
 
+/*! Sends a Sync message, which ends the current pipeline, and notes
+    which query was the last one before it.
+*/
+
+void Postgres::sync()
+{
+    PgSync e;
+    e.enqueue( writeBuffer() );
+    d->syncs.append( d->queries.lastElement() );
+}
+
+
+/*! This private helper is called when a ReadyForQuery message arrives,
+    with \a last being the last query sent before the corresponding
+    Sync. If \a last is still waiting for a result, then some query
+    before it failed, and the backend skipped the rest of the pipeline
+    up to the Sync. This fails all the skipped queries.
+*/
+
+void Postgres::skipped( Query * last )
+{
+    if ( !last || !d->queries.find( last ) )
+        return;
+
+    Query * q = 0;
+    while ( q != last && !d->queries.isEmpty() ) {
+        q = d->queries.shift();
+        Scope x( q->log() );
+        EString * pp = d->preparesPending.first();
+        if ( q->name() != "" && pp && *pp == q->name() ) {
+            d->prepared.remove( q->name() );
+            d->preparesPending.shift();
+        }
+        if ( q->inputLines() )
+            d->sendingCopy = false;
+        ::log( "Query " + q->description() + " skipped after an earlier "
+               "error on backend " + fn( connectionNumber() ),
+               Log::Debug );
+        if ( !q->done() ) {
+            q->setError( "Not executed because an earlier query in "
+                         "the same transaction failed" );
+            countQueries( q );
+        }
+        q->notify();
+    }
+    d->needNotify = 0;
+}
+
+
 // these errors are based on a selection of the results from
 // select indexname from pg_indexes where tablename in
 //  (select tablename from pg_tables where tableowner='aoxsuper')
@@ -1110,6 +1381,154 @@ bool Postgres::usable() const
 }
 
 
+/*! Returns the server-wide record for the query string \a text,
+    creating it if necessary, and counts one more execution of it.
+
+    The records are kept in a global registry which remembers at most
+    a few thousand texts. When it's full, the half that was used least
+    recently is forgotten, and the hit rate of each well-used statement
+    is logged as it goes. The statistics port reports the hit rates of
+    the most frequently executed statements.
+*/
+
+PgStatement * Postgres::statement( const EString & text )
+{
+    if ( !::statements ) {
+        ::statements = new Dict<PgStatement>;
+        Allocator::addEternal( ::statements, "statement registry" );
+        ::statementList = new List<PgStatement>;
+        Allocator::addEternal( ::statementList, "statement registry" );
+        ::statementParses = new GraphableCounter( "statement-parses" );
+        ::statementReuses = new GraphableCounter( "statement-reuses" );
+        Allocator::addEternal( new PgStatementReport, "statement report" );
+    }
+
+    PgStatement * st = ::statements->find( text );
+    if ( !st ) {
+        if ( ::statementCount >= maxStatements ) {
+            uint oldest = 0;
+            if ( ::statementUses > maxStatements / 2 )
+                oldest = ::statementUses - maxStatements / 2;
+            List<PgStatement>::Iterator i( ::statementList );
+            while ( i ) {
+                PgStatement * old = i;
+                if ( old->lastUse < oldest ) {
+                    if ( old->executions >= promotionThreshold )
+                        log( "Forgetting statement executed " +
+                             fn( old->executions ) + " times, parsed " +
+                             fn( old->parses ) + " times (" +
+                             fn( 100 * ( old->executions - old->parses ) /
+                                 old->executions ) +
+                             "% hits): " + old->text.simplified(),
+                             Log::Debug );
+                    ::statements->remove( old->text );
+                    ::statementList->take( i );
+                    ::statementCount--;
+                }
+                else {
+                    ++i;
+                }
+            }
+        }
+        st = new PgStatement;
+        st->text = text;
+        ::statements->insert( text, st );
+        ::statementList->append( st );
+        ::statementCount++;
+    }
+
+    st->executions++;
+    st->lastUse = ++::statementUses;
+    return st;
+}
+
+
+/*! Gives \a q, whose text is recorded in \a st, the name of a statement
+    prepared on this backend, if that text has been executed often
+    enough to make it worthwhile. processQuery() will prepare the
+    statement if this backend doesn't have it yet.
+
+    Each backend keeps a limited number of these statements, and closes
+    the one it used least recently to make room for another.
+*/
+
+void Postgres::reuseStatement( Query * q, PgStatement * st )
+{
+    PgPrepared * p = d->autoPrepared.find( st->text );
+    if ( !p ) {
+        if ( st->executions < promotionThreshold )
+            return;
+
+        if ( d->autoPreparedList.count() >= maxAutoPrepared ) {
+            List<PgPrepared>::Iterator i( d->autoPreparedList );
+            List<PgPrepared>::Iterator lru( i );
+            while ( i ) {
+                if ( i->lastUse < lru->lastUse )
+                    lru = i;
+                ++i;
+            }
+            PgPrepared * old = lru;
+            d->autoPreparedList.take( lru );
+            d->autoPrepared.remove( old->text );
+            d->prepared.remove( old->name );
+            closeStatement( old );
+        }
+
+        // each name is used only once per backend, so a statement
+        // which isn't closed yet can't cause trouble later
+        p = new PgPrepared;
+        p->text = st->text;
+        p->name = "a" + fn( ++d->autoNames );
+        d->autoPrepared.insert( p->text, p );
+        d->autoPreparedList.append( p );
+        log( "Preparing statement " + p->name + " on backend " +
+             fn( connectionNumber() ) + " after " + fn( st->executions ) +
+             " executions", Log::Debug );
+    }
+
+    p->lastUse = st->lastUse;
+    q->setName( p->name );
+}
+
+
+/*! Sends a Close for \a p, which is no longer used, and records
+    that it's pending until the backend confirms it. closesSkipped()
+    sends it again if the backend skips it.
+*/
+
+void Postgres::closeStatement( PgPrepared * p )
+{
+    PgClose c( p->name );
+    c.enqueue( writeBuffer() );
+    p->syncs = d->syncs.count();
+    d->closesPending.append( p );
+}
+
+
+/*! This private helper is called when a ReadyForQuery message arrives.
+    If a Close sent before the corresponding Sync hasn't been confirmed
+    by then, the backend skipped it after an earlier error, and would
+    keep the statement for the life of the connection. Such Closes are
+    sent again along with the next query.
+*/
+
+void Postgres::closesSkipped()
+{
+    List<PgPrepared>::Iterator i( d->closesPending );
+    while ( i ) {
+        if ( i->syncs ) {
+            i->syncs--;
+            ++i;
+        }
+        else {
+            log( "Close of " + i->name + " was skipped on backend " +
+                 fn( connectionNumber() ) + ", will resend", Log::Debug );
+            d->closesToResend.append( d->closesPending.take( i ) );
+        }
+    }
+}
+
+
 static GraphableCounter * goodQueries = 0;
 static GraphableCounter * badQueries = 0;
 
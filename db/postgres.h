@@ -6,6 +6,7 @@
 #include "database.h"
 
 class Query;
+class PgStatement;
 
 
 class Postgres
@@ -29,7 +30,14 @@ public:
 private:
     class PgData *d;
 
-    void processQuery( Query * );
+    void processQuery( Query *, bool = true );
+    void pipeline( List< Query > * );
+    void sync();
+    void skipped( Query * );
+    PgStatement * statement( const EString & );
+    void reuseStatement( Query *, PgStatement * );
+    void closeStatement( class PgPrepared * );
+    void closesSkipped();
     void authentication( char );
     void backendStartup( char );
     void process( char );
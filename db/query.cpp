@@ -22,6 +22,7 @@ class QueryData
 public:
     QueryData()
         : state( Query::Inactive ), format( Query::Text ),
+          resultFormat( Query::Binary ),
           values( new Query::InputLine ), inputLines( 0 ),
           transaction( 0 ), owner( 0 ), totalRows( 0 ),
           canFail( false )
@@ -29,6 +30,7 @@ public:
 
     Query::State state;
     Query::Format format;
+    Query::Format resultFormat;
 
     EString name;
     EString query;
@@ -226,6 +228,34 @@ Query::Format Query::format() const
 }
 
 
+/*! Asks the server to send this Query's results in format \a f, which
+    may be Binary (the default) or Text.
+
+    Binary results need no parsing, and Row decodes booleans, integers,
+    bigints, strings, bytea and timestamptz. Text is for queries that
+    return other types, e.g. numeric or interval; Row offers those
+    columns as strings.
+
+    This must be called before the Query is executed.
+*/
+
+void Query::setResultFormat( Format f )
+{
+    if ( d->state != Inactive || f == Unknown )
+        return;
+    d->resultFormat = f;
+}
+
+
+/*! Returns the format in which the server sends this Query's results,
+    as set by setResultFormat(). */
+
+Query::Format Query::resultFormat() const
+{
+    return d->resultFormat;
+}
+
+
 /*! Binds the integer value \a s to the parameter \a n of this Query. */
 
 void Query::bind( uint n, int s )
@@ -311,22 +341,15 @@ void Query::bind( uint n, const UString &s )
 
 /*! \overload
 
-    This version binds each number in \a set as parameter \a n.
+    This version binds each number in \a set as parameter \a n. The
+    set is always sent as a binary int4[] array, whatever the format of
+    this Query, so the server doesn't have to parse a long list of
+    numbers.
 */
 
 void Query::bind( uint n, const class IntegerSet & set )
 {
-    if ( d->format == Text ) {
-        EString s( "{" );
-        s.append( set.csl() );
-        s.append( "}" );
-        bind( n, s );
-    }
-    else {
-        // XXX: Not implemented yet.
-        die( Invariant );
-    }
-
+    bind( n, set.array(), Binary );
 }
 
 
@@ -467,6 +490,18 @@ EString Query::name() const
 }
 
 
+/*! Records that this Query is to be executed using the prepared
+    statement named \a n. The Database calls this when it decides to
+    reuse a statement it prepared for an earlier Query with the same
+    text; there is no need to call it otherwise.
+*/
+
+void Query::setName( const EString & n )
+{
+    d->name = n;
+}
+
+
 /*! This virtual function is expected to return the complete SQL query
     as a string. Subclasses may reimplement this function to compose a
     query from individual parameters, rather than requiring the entire
@@ -895,6 +930,22 @@ UString Row::getUString( const char * f ) const
 }
 
 
+/*! Returns the value of the timestamptz column named \a f as a Unix
+    time (seconds since 1970), if it exists and is NOT NULL, and 0
+    otherwise. The column must have been sent in Query::Binary format.
+*/
+
+int64 Row::getTimestamp( const char * f ) const
+{
+    const Column * c = fetch( f, Column::Timestamp, true );
+    if ( !c )
+        return 0;
+    if ( c->type != Column::Timestamp )
+        return 0;
+    return c->bi;
+}
+
+
 /*! Returns true if this Row contains a column named \a f, and false
     otherwise.
 */
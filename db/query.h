@@ -45,6 +45,9 @@ public:
     enum Format { Unknown = -1, Text = 0, Binary };
     Format format() const;
 
+    void setResultFormat( Format );
+    Format resultFormat() const;
+
     void bind( uint, bool );
     void bind( uint, int );
     void bind( uint, uint );
@@ -93,6 +96,7 @@ public:
     };
 
     virtual EString name() const;
+    void setName( const EString & );
     virtual EString string() const;
     virtual void setString( const EString & );
 
@@ -153,6 +157,7 @@ public:
     bool getBoolean( const char * ) const;
     EString getEString( const char * ) const;
     UString getUString( const char * ) const;
+    int64 getTimestamp( const char * ) const;
     bool hasColumn( const char * ) const;
     Column::Type columnType( const char * ) const;
 
@@ -590,6 +590,20 @@ bool Schema::singleStep()
         c = stepTo96(); break;
     case 96:
         c = stepTo97(); break;
+    case 97:
+        c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
+    case 102:
+        c = stepTo103(); break;
+    case 103:
+        c = stepTo104(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4408,3 +4422,288 @@ bool Schema::stepTo97()
     d->t->enqueue( "drop table views" );
     return true;
 }
+
+
+/*! Add mailboxes.change and a trigger to maintain it and to notify
+    the servers about each changed mailbox, so they don't need to
+    reread the entire mailboxes table whenever a message arrives.
+*/
+
+bool Schema::stepTo98()
+{
+    describeStep( "Adding mailboxes.change and mailbox_change_trigger." );
+    d->t->enqueue( "create sequence mailbox_changes" );
+    d->t->enqueue( "alter table mailboxes "
+                   "add change bigint not null default 0" );
+    d->t->enqueue( "create index mb_change on mailboxes(change)" );
+    d->t->enqueue(
+        "create function mailbox_change() returns trigger as $$"
+        "begin "
+        "new.change := nextval('mailbox_changes'); "
+        "if tg_op = 'UPDATE' and new.name = old.name and "
+        "new.deleted = old.deleted and new.uidvalidity = old.uidvalidity and "
+        "new.owner is not distinct from old.owner then "
+        "perform pg_notify('mailboxes_updated',"
+        " new.id||' '||new.uidnext||' '||new.nextmodseq); "
+        "else "
+        "perform pg_notify('mailboxes_updated', new.id::text); "
+        "end if; "
+        "return new; "
+        "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger mailbox_change_trigger "
+                   "before insert or update on mailboxes for each "
+                   "row execute procedure mailbox_change()" );
+
+    // the new trigger notifies with a payload, so the old one stops
+    // sending plain notifications
+    d->t->enqueue(
+        "create or replace function check_mailbox_update() "
+        "returns trigger as $$"
+        "declare address text; "
+        "begin "
+        "if new.deleted='t' and old.deleted='f' then "
+        "perform * from mailbox_messages where mailbox=new.id; "
+        "if found then "
+        "raise exception '% is not empty', new.name;"
+        "end if; "
+        "select a.localpart||'@'||a.domain into address"
+        " from addresses a join aliases al on (a.id=al.address)"
+        " where al.mailbox=new.id;"
+        "if address is not null then "
+        "raise exception '% used by alias %', new.name, address; "
+        "end if; "
+        "perform * from fileinto_targets where mailbox=new.id; "
+        "if found then "
+        "raise exception '% is used by sieve fileinto', new.name;"
+        "end if; "
+        "end if; "
+        "return new;"
+        "end;$$ language 'plpgsql'" );
+    return true;
+}
+
+
+/*! Add the bodypart_trigrams and header_trigrams tables, which let
+    Selector find bodyparts and messages containing a string without
+    reading all of bodyparts.text, and fill them from the existing
+    messages. Each row holds all the trigrams of one bodypart or
+    message, so the tables are small next to bodyparts, and GIN
+    compresses the index.
+
+    The temporary function computes the same codes as Trigrams::add().
+*/
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding and filling the trigram index tables." );
+    d->t->enqueue( "create function pg_temp.fold(b int) returns int as $$"
+                   "select case when $1 between 65 and 90 then $1+32 "
+                   "when $1>=128 then 128 else $1 end"
+                   "$$ language sql immutable" );
+    d->t->enqueue( "create function pg_temp.trigrams(t text) "
+                   "returns setof int as $$"
+                   "select distinct (pg_temp.fold(get_byte(x.b,i))<<16)|"
+                   "(pg_temp.fold(get_byte(x.b,i+1))<<8)|"
+                   "pg_temp.fold(get_byte(x.b,i+2)) "
+                   "from (select convert_to($1,'UTF8') as b) x, "
+                   "generate_series(0,octet_length(convert_to($1,'UTF8'))-3)"
+                   " i"
+                   "$$ language sql immutable" );
+
+    d->t->enqueue( "create table bodypart_trigrams ("
+                   "bodypart integer primary key references bodyparts(id)"
+                   " on delete cascade,"
+                   "trigrams integer[] not null)" );
+    d->t->enqueue( "insert into bodypart_trigrams (bodypart,trigrams) "
+                   "select id,t from "
+                   "(select id,array(select pg_temp.trigrams(text)) as t "
+                   "from bodyparts where text is not null) x "
+                   "where array_length(t,1)>0" );
+    d->t->enqueue( "create index bpt_t on bodypart_trigrams "
+                   "using gin(trigrams)" );
+
+    d->t->enqueue( "create table header_trigrams ("
+                   "message integer primary key references messages(id)"
+                   " on delete cascade,"
+                   "trigrams integer[] not null)" );
+    d->t->enqueue( "insert into header_trigrams (message,trigrams) "
+                   "select message,array_agg(distinct t) from "
+                   "(select pg_temp.trigrams(value) as t,message "
+                   "from header_fields where value is not null) x "
+                   "group by message" );
+    d->t->enqueue( "create index ht_t on header_trigrams "
+                   "using gin(trigrams)" );
+
+    d->t->enqueue( "drop function pg_temp.trigrams(text)" );
+    d->t->enqueue( "drop function pg_temp.fold(int)" );
+    return true;
+}
+
+
+/*! Add the thread_members table, which records each message's parent
+    so that THREAD doesn't have to parse References fields, and fill
+    it from the existing header fields.
+*/
+
+bool Schema::stepTo100()
+{
+    describeStep( "Adding and filling thread_members." );
+    d->t->enqueue( "create table thread_members ("
+                   "message integer primary key references messages(id)"
+                   " on delete cascade,"
+                   "messageid text,"
+                   "parentid text,"
+                   "parent integer,"
+                   "subject text)" );
+    d->t->enqueue( "insert into thread_members "
+                   "(message,messageid,parentid,subject) "
+                   "select m.id, mid.value,"
+                   " substring(ref.value from '(<[^<>]*>)[^<>]*$'),"
+                   " subj.value "
+                   "from messages m "
+                   "left join header_fields mid on"
+                   " (mid.message=m.id and mid.part='' and mid.field=" +
+                   fn( HeaderField::MessageId ) + ") "
+                   "left join header_fields ref on"
+                   " (ref.message=m.id and ref.part='' and ref.field=" +
+                   fn( HeaderField::References ) + ") "
+                   "left join header_fields subj on"
+                   " (subj.message=m.id and subj.part='' and subj.field=" +
+                   fn( HeaderField::Subject ) + ")" );
+    d->t->enqueue( "create index tm_mid on thread_members(messageid)" );
+    d->t->enqueue( "create index tm_pid on thread_members(parentid) "
+                   "where parent is null" );
+    d->t->enqueue( "update thread_members c set parent=p.message "
+                   "from thread_members p "
+                   "where c.parentid=p.messageid and c.message!=p.message" );
+    d->t->enqueue( "create index tm_p on thread_members(parent)" );
+    d->t->enqueue(
+        "create function thread_member_removed() returns trigger as $$"
+        "begin "
+        "update thread_members set parent=old.parent "
+        "where parent=old.message; "
+        "return old; "
+        "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger thread_member_removed_trigger "
+                   "before delete on thread_members "
+                   "for each row execute procedure thread_member_removed()" );
+    return true;
+}
+
+
+/*! Add the sort_keys table, which holds one precomputed row of SORT
+    keys per message, and fill it from the existing header and
+    address fields. The SQL base subject is an approximation of
+    Message::baseSubject(); new messages get the real thing.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Adding and filling sort_keys." );
+    d->t->enqueue( "create table sort_keys ("
+                   "message integer primary key references messages(id)"
+                   " on delete cascade,"
+                   "arrival bigint not null,"
+                   "sent bigint not null,"
+                   "size integer not null,"
+                   "subject text not null,"
+                   "from_mailbox text not null,"
+                   "to_mailbox text not null,"
+                   "cc_mailbox text not null,"
+                   "display_from text not null,"
+                   "display_to text not null)" );
+    d->t->enqueue( "insert into sort_keys "
+                   "(message,arrival,sent,size,subject,"
+                   "from_mailbox,to_mailbox,cc_mailbox,"
+                   "display_from,display_to) "
+                   "select m.id, m.idate,"
+                   " coalesce((select extract(epoch from min(df.value))"
+                   "::bigint from date_fields df where df.message=m.id),"
+                   " m.idate),"
+                   " coalesce(m.rfc822size,0),"
+                   " upper(btrim(regexp_replace(regexp_replace("
+                   "coalesce(subj.value,''),"
+                   " '^(\\s*((re|fwd?|fw)\\s*(\\[[^]]*\\])?:|\\[[^]]*\\]))+',"
+                   " '', 'i'), '\\s*\\(fwd\\)\\s*$', '', 'i'))),"
+                   " upper(coalesce(fa.localpart,'')),"
+                   " upper(coalesce(ta.localpart,'')),"
+                   " upper(coalesce(ca.localpart,'')),"
+                   " upper(coalesce(case when fa.name='' then"
+                   " fa.localpart||'@'||fa.domain else fa.name end,'')),"
+                   " upper(coalesce(case when ta.name='' then"
+                   " ta.localpart||'@'||ta.domain else ta.name end,'')) "
+                   "from messages m "
+                   "left join header_fields subj on"
+                   " (subj.message=m.id and subj.part='' and subj.field=" +
+                   fn( HeaderField::Subject ) + ") "
+                   "left join address_fields faf on"
+                   " (faf.message=m.id and faf.part='' and faf.number=0"
+                   " and faf.field=" + fn( HeaderField::From ) + ") "
+                   "left join addresses fa on (faf.address=fa.id) "
+                   "left join address_fields taf on"
+                   " (taf.message=m.id and taf.part='' and taf.number=0"
+                   " and taf.field=" + fn( HeaderField::To ) + ") "
+                   "left join addresses ta on (taf.address=ta.id) "
+                   "left join address_fields caf on"
+                   " (caf.message=m.id and caf.part='' and caf.number=0"
+                   " and caf.field=" + fn( HeaderField::Cc ) + ") "
+                   "left join addresses ca on (caf.address=ca.id)" );
+    return true;
+}
+
+
+/*! Add the rfc822_blobs table, which holds the RFC 822 form of some
+    messages so that they needn't be assembled for each FETCH. It's
+    filled only for new messages, and only if store-rfc822 is set.
+
+    The forms are stored uncompressed, since a compressed value has
+    to be decompressed from its start to read any range of it.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Adding rfc822_blobs." );
+    d->t->enqueue( "create table rfc822_blobs ("
+                   "message integer primary key references messages(id)"
+                   " on delete cascade,"
+                   "bytes integer not null,"
+                   "utf8_bytes integer not null,"
+                   "has_nul boolean not null,"
+                   "data bytea not null,"
+                   "utf8 bytea)" );
+    d->t->enqueue( "alter table rfc822_blobs "
+                   "alter data set storage external" );
+    d->t->enqueue( "alter table rfc822_blobs "
+                   "alter utf8 set storage external" );
+    return true;
+}
+
+
+/*! Store the whole References field in thread_members, so that
+    threads can be built from the messages in a mailbox instead of
+    following the parent links across the entire database.
+*/
+
+bool Schema::stepTo103()
+{
+    describeStep( "Adding thread_members.refs." );
+    d->t->enqueue( "alter table thread_members add refs text" );
+    d->t->enqueue( "update thread_members tm set refs=hf.value "
+                   "from header_fields hf "
+                   "where hf.message=tm.message and hf.part='' and "
+                   "hf.field=" + fn( HeaderField::References ) );
+    return true;
+}
+
+
+/*! Record when a bodypart was stored ahead of its message, so that
+    aox vacuum doesn't remove it before the message is injected.
+*/
+
+bool Schema::stepTo104()
+{
+    describeStep( "Adding bodyparts.spooled_at." );
+    d->t->enqueue( "alter table bodyparts add spooled_at "
+                   "timestamp with time zone" );
+    return true;
+}
@@ -8,6 +8,7 @@
 #include "user.h"
 #include "buffer.h"
 #include "mailbox.h"
+#include "eventloop.h"
 #include "integerset.h"
 #include "imapparser.h"
 #include "transaction.h"
@@ -454,6 +455,7 @@ void Command::setState( State s )
     switch( s ) {
     case Retired:
         log( "Retired", Log::Debug );
+        EventLoop::freeNurserySoon();
         break;
     case Unparsed:
         // this is the initial state, it should never be called.
@@ -43,6 +43,7 @@
     RFC 5256: SORT,
     RFC 5257: ANNOTATE-EXPERIMENT-1,
     RFC 5258: LISTEXT,
+    RFC 5267: ESORT,
     RFC 5465: NOTIFY,
     RFC 6855: UTF=ACCEPT,
     RFC 7162: QRESYNC.
@@ -91,6 +92,7 @@ EString Capability::capabilities( IMAP * i, bool all )
     c.append( "ENABLE" );
     if ( all || login ) {
         c.append( "ESEARCH" );
+        c.append( "ESORT" );
         c.append( "I18NLEVEL=1" );
     }
     c.append( "ID" );
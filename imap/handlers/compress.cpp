@@ -44,6 +44,10 @@ void Compress::execute()
         return;
     }
 
+    // the OK must be sent uncompressed, after anything being streamed
+    if ( imap()->streaming() )
+        return;
+
     Buffer * r = imap()->readBuffer();
     Buffer * w = imap()->writeBuffer();
     emitResponses();
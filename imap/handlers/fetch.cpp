@@ -22,6 +22,7 @@
 #include "codec.h"
 #include "query.h"
 #include "scope.h"
+#include "eventloop.h"
 #include "store.h"
 #include "timer.h"
 #include "imap.h"
@@ -33,6 +34,37 @@
 
 
 
+// Stored RFC 822 forms larger than this are sent from the database
+// blobChunk bytes at a time as the client reads, instead of being
+// fetched whole.
+
+static const uint streamedBlobSize = 262144;
+static const uint blobChunk = 65536;
+
+
+class BlobStreamer
+    : public EventHandler
+{
+public:
+    BlobStreamer( IMAP *, uint, bool, uint, uint, EString * );
+
+    void execute();
+    ImapResponse::Refill refill();
+    void fetchNext();
+
+    IMAP * imap;
+    uint message;
+    bool utf8;
+    uint next;
+    uint end;
+    EString * part;
+    Query * q;
+    EString chunk;
+    bool ready;
+    bool waiting;
+};
+
+
 static const char * legalAnnotationAttributes[] = {
     "value",
     "value.priv",
@@ -60,8 +92,10 @@ public:
           databaseId( false ), threadId( false ), vanished( false ),
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
+          needsRfc822( false ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
-          annotationFetcher( 0 ), modseqFetcher( 0 )
+          annotationFetcher( 0 ), modseqFetcher( 0 ),
+          flagGeneration( 0 )
     {}
 
     int state;
@@ -97,6 +131,7 @@ public:
     bool needsAddresses;
     bool needsBody;
     bool needsPartNumbers;
+    bool needsRfc822;
 
     EStringList entries;
     EStringList attribs;
@@ -115,6 +150,8 @@ public:
     Query * flagFetcher;
     Query * annotationFetcher;
     Query * modseqFetcher;
+    uint flagGeneration;
+    List<BlobStreamer> streamers;
 };
 
 
@@ -247,6 +284,24 @@ void Fetch::parse()
         require( ")" );
     }
     end();
+    if ( d->needsBody && !d->envelope && !d->body && !d->bodystructure ) {
+        // if the only sections are entire messages, the stored RFC
+        // 822 form will do, and the Fetcher assembles the rest.
+        bool entire = true;
+        List<Section>::Iterator s( d->sections );
+        while ( s && entire ) {
+            if ( !s->part.isEmpty() ||
+                 !( s->id.isEmpty() || s->id == "rfc822" ) )
+                entire = false;
+            ++s;
+        }
+        if ( entire ) {
+            d->needsRfc822 = true;
+            d->needsAddresses = false;
+            d->needsHeader = false;
+            d->needsBody = false;
+        }
+    }
     if ( d->envelope ) {
         d->needsHeader = true;
         d->needsAddresses = true;
@@ -271,6 +326,8 @@ void Fetch::parse()
         l.append( "header" );
     if ( d->needsBody )
         l.append( "body" );
+    if ( d->needsRfc822 )
+        l.append( "rfc822" );
     if ( d->flags )
         l.append( "flags" );
     if ( d->internaldate || d->rfc822size || d->databaseId || d->threadId )
@@ -709,7 +766,7 @@ void Fetch::execute()
             else if ( d->modseq ||
                       d->needsAddresses || d->needsHeader ||
                       d->needsBody || d->needsPartNumbers ||
-                      d->rfc822size || d->internaldate ||
+                      d->needsRfc822 || d->rfc822size || d->internaldate ||
                       d->databaseId || d->threadId ) {
                 IntegerSet r;
                 IntegerSet s( d->set );
@@ -874,6 +931,7 @@ void Fetch::sendFetchQueries()
     bool haveBody = true;
     bool havePartNumbers = true;
     bool haveTrivia = true;
+    bool haveRfc822 = true;
 
     List<Message> * l = new List<Message>;
 
@@ -891,6 +949,8 @@ void Fetch::sendFetchQueries()
             haveBody = false;
         if ( !m->hasTrivia() )
             haveTrivia = false;
+        if ( !m->hasRfc822() && !m->storedRfc822Size( true ) )
+            haveRfc822 = false;
         l->append( m );
     }
 
@@ -906,6 +966,10 @@ void Fetch::sendFetchQueries()
         f->fetch( Fetcher::Trivia );
     if ( d->needsPartNumbers && !havePartNumbers )
         f->fetch( Fetcher::PartNumbers );
+    if ( d->needsRfc822 && !haveRfc822 ) {
+        f->fetch( Fetcher::Rfc822 );
+        f->setRfc822Limit( streamedBlobSize );
+    }
     f->execute();
 }
 
@@ -1083,33 +1147,27 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 }
 
 
-/* This function returns the response data for an element in
-   d->sections, to be included in the FETCH response by
-   fetchResponses() below. If \a unicode is false, the result will be
-   downgraded rather than contain unicode.
-*/
+// Section data at least this large is sent as a separate element of
+// the list returned by makeFetchResponse(), so IMAP can write it out
+// as the client reads instead of copying it into one big string.
 
-static EString sectionResponse( Section * s, Message * m, bool unicode )
-{
-    EString data( Fetch::sectionData( s, m, unicode ) );
-    if ( !s->item.startsWith( "BINARY.SIZE" ) )
-        data = Command::imapQuoted( data, Command::NString );
-    EString r;
-    r.reserve( data.length() + s->item.length() + 1 );
-    r.append( s->item );
-    r.append( " " );
-    r.append( data );
-    return r;
-}
+static const uint streamedLiteralSize = 16384;
 
 
-/*! Emits a single FETCH response for the message \a m, which is
-    trusted to have UID \a uid and MSN \a msn.
+/*! Makes a single FETCH response for the message \a m, which is
+    trusted to have UID \a uid and MSN \a msn, and returns it as a
+    list of strings to be sent one after another. Large literals are
+    separate elements of the list, and are not copied.
+
+    If only the size of the stored RFC 822 form of \a m has been
+    fetched, entire-message sections are sent from the database
+    piece by piece: The list contains an element which refill()
+    replaces with each piece in turn.
 
     The message must have all necessary content.
 */
 
-EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
+EStringList * Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
 {
     EStringList l;
     if ( d->uid )
@@ -1139,20 +1197,81 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
             l.append( "MODSEQ (" + fn( dd->modseq ) + ")" );
     }
 
+    EStringList * r = new EStringList;
+    EString * t = new EString;
+    EString payload = l.join( " " );
+    t->reserve( payload.length() + 30 );
+    t->appendNumber( msn );
+    t->append( " FETCH (" );
+    t->append( payload );
+
     List< Section >::Iterator it( d->sections );
     bool unicode = imap()->clientSupports( IMAP::Unicode );
+    bool space = !l.isEmpty();
     while ( it ) {
-        l.append( sectionResponse( it, m, unicode ) );
+        uint stored = m->storedRfc822Size( !unicode );
+        if ( stored && !m->hasRfc822() && it->part.isEmpty() &&
+             ( it->id.isEmpty() || it->id == "rfc822" ) ) {
+            // the same range as sectionData()'s EString::mid()
+            uint start = 0;
+            uint length = stored;
+            if ( it->partial ) {
+                start = it->offset;
+                length = it->length;
+            }
+            if ( start > stored )
+                start = stored;
+            if ( length > stored - start )
+                length = stored - start;
+            if ( space )
+                t->append( " " );
+            space = true;
+            t->append( it->id.isEmpty() ? "BODY[]" : "RFC822" );
+            if ( it->partial )
+                t->append( "<" + fn( it->offset ) + ">" );
+            t->append( " {" );
+            t->appendNumber( length );
+            t->append( "}\r\n" );
+            r->append( t );
+            t = new EString;
+            if ( length ) {
+                EString * p = new EString;
+                r->append( p );
+                d->streamers.append(
+                    new BlobStreamer( imap(), m->databaseId(), unicode,
+                                      start, length, p ) );
+            }
+            ++it;
+            continue;
+        }
+        // sectionData() sets it->item, so it must be called first
+        EString data( sectionData( it, m, unicode ) );
+        if ( space )
+            t->append( " " );
+        space = true;
+        t->append( it->item );
+        t->append( " " );
+        if ( it->item.startsWith( "BINARY.SIZE" ) ) {
+            t->append( data );
+        }
+        else if ( data.length() < streamedLiteralSize ) {
+            t->append( Command::imapQuoted( data, Command::NString ) );
+        }
+        else {
+            if ( data.contains( 0 ) )
+                t->append( "~" );
+            t->append( "{" );
+            t->appendNumber( data.length() );
+            t->append( "}\r\n" );
+            r->append( t );
+            r->append( new EString( data ) );
+            t = new EString;
+        }
         ++it;
     }
 
-    EString r;
-    EString payload = l.join( " " );
-    r.reserve( payload.length() + 30 );
-    r.appendNumber( msn );
-    r.append( " FETCH (" );
-    r.append( payload );
-    r.append( ")" );
+    t->append( ")" );
+    r->append( t );
     return r;
 }
 
@@ -1669,6 +1788,28 @@ void Fetch::pickup()
         }
         if ( d->seenDeletedFetcher->done() &&
              d->flagFetcher->done() ) {
+            // now the session knows all flags of these messages,
+            // which lets Search work without the database. messages
+            // which changed while we fetched are left out.
+            if ( !d->seenDeletedFetcher->failed() &&
+                 !d->flagFetcher->failed() ) {
+                IntegerSet known =
+                    s->flagsUnchanged( d->set, d->flagGeneration );
+                uint i = 1;
+                while ( i <= known.count() ) {
+                    uint uid = known.value( i );
+                    FetchData::DynamicData * dd = d->dynamics.find( uid );
+                    if ( dd ) {
+                        Dict<EString>::Iterator f( dd->flags );
+                        while ( f ) {
+                            s->addFlag( *f, uid );
+                            ++f;
+                        }
+                    }
+                    i++;
+                }
+                s->learnFlags( known );
+            }
             d->seenDeletedFetcher = 0;
             d->flagFetcher = 0;
         }
@@ -1733,6 +1874,9 @@ void Fetch::pickup()
             ok = false;
         if ( d->needsBody && !m->hasBodies() )
             ok = false;
+        if ( d->needsRfc822 && !m->hasRfc822() &&
+             !m->storedRfc822Size( true ) )
+            ok = false;
         if ( ( d->rfc822size || d->internaldate ||
                d->databaseId || d->threadId ) && !m->hasTrivia() )
             ok = false;
@@ -1771,11 +1915,32 @@ ImapFetchResponse::ImapFetchResponse( ImapSession * s,
 
 
 EString ImapFetchResponse::text() const
+{
+    EStringList * l = textParts();
+    return l->join( "" );
+}
+
+
+/*! Returns the response as made by Fetch::makeFetchResponse(), so
+    that large literals can be written as the client reads them.
+*/
+
+EStringList * ImapFetchResponse::textParts() const
 {
     uint msn = session()->msn( u );
     if ( u && msn )
         return f->makeFetchResponse( f->message( u ), u, msn );
-    return "";
+    return new EStringList;
+}
+
+
+/*! Hands \a part to Fetch::refill(), so that stored RFC 822 forms
+    can be sent piece by piece.
+*/
+
+ImapResponse::Refill ImapFetchResponse::refill( EString * part )
+{
+    return f->refill( part );
 }
 
 
@@ -1794,6 +1959,133 @@ void ImapFetchResponse::setSent()
 }
 
 
+/*! Replaces the contents of \a part, which must be an element of a
+    list returned by makeFetchResponse(), with the next piece of the
+    stored RFC 822 form it stands for, and returns as described in
+    ImapResponse::refill(). Returns Done for all other elements.
+*/
+
+ImapResponse::Refill Fetch::refill( EString * part )
+{
+    List<BlobStreamer>::Iterator i( d->streamers );
+    while ( i && i->part != part )
+        ++i;
+    if ( !i )
+        return ImapResponse::Done;
+    ImapResponse::Refill r = i->refill();
+    if ( r == ImapResponse::Done )
+        d->streamers.take( i );
+    return r;
+}
+
+
+/*! \class BlobStreamer fetch.cpp
+
+    The BlobStreamer class fetches a range of a stored RFC 822 form
+    from the database, blobChunk bytes at a time, so that Fetch can
+    send a large literal without ever holding all of it.
+
+    It fetches one piece ahead of what IMAP has asked for, so the
+    client needn't wait for the database after each piece.
+*/
+
+
+/*! Constructs a BlobStreamer for \a length bytes of the stored form of
+    message \a m, starting at byte \a start. \a u is true if the form
+    that may contain unquoted UTF-8 is wanted. The bytes are sent to
+    \a i, with \a p as placeholder in the response being streamed.
+*/
+
+BlobStreamer::BlobStreamer( IMAP * i, uint m, bool u,
+                            uint start, uint length, EString * p )
+    : EventHandler(),
+      imap( i ), message( m ), utf8( u ),
+      next( start ), end( start + length ), part( p ),
+      q( 0 ), ready( false ), waiting( false )
+{
+    setLog( new Log );
+    fetchNext();
+}
+
+
+/*! Starts fetching the next piece, unless that's already being done
+    or there is nothing more to fetch.
+*/
+
+void BlobStreamer::fetchNext()
+{
+    if ( q || ready || next >= end )
+        return;
+    uint n = end - next;
+    if ( n > blobChunk )
+        n = blobChunk;
+    if ( utf8 )
+        q = new Query( "select case when utf8 is null "
+                       "then substring(data from $2 for $3) "
+                       "else substring(utf8 from $2 for $3) end as chunk "
+                       "from rfc822_blobs where message=$1", this );
+    else
+        q = new Query( "select substring(data from $2 for $3) as chunk "
+                       "from rfc822_blobs where message=$1", this );
+    q->bind( 1, message );
+    q->bind( 2, next + 1 );
+    q->bind( 3, n );
+    q->execute();
+}
+
+
+void BlobStreamer::execute()
+{
+    if ( !q || !q->done() )
+        return;
+
+    uint n = end - next;
+    if ( n > blobChunk )
+        n = blobChunk;
+    Row * r = q->nextRow();
+    if ( !q->failed() && r )
+        chunk = r->getEString( "chunk" );
+    if ( chunk.length() != n ) {
+        // the literal's size has been sent, so there's no way out
+        log( "Could not fetch bytes " + fn( next ) + "-" +
+             fn( next + n - 1 ) + " of the stored form of message " +
+             fn( message ) + ", closing connection", Log::Error );
+        q = 0;
+        next = end;
+        chunk.truncate();
+        imap->close();
+        return;
+    }
+    q = 0;
+    next += n;
+    ready = true;
+    if ( waiting ) {
+        waiting = false;
+        EventLoop::global()->flushSoon( imap );
+    }
+}
+
+
+/*! Replaces the contents of the placeholder with the next piece, if
+    it has arrived, and returns as described in ImapResponse::refill().
+*/
+
+ImapResponse::Refill BlobStreamer::refill()
+{
+    if ( ready ) {
+        *part = chunk;
+        chunk = EString();
+        ready = false;
+        fetchNext();
+        return ImapResponse::More;
+    }
+    if ( !q )
+        return ImapResponse::Done;
+    waiting = true;
+    return ImapResponse::Waiting;
+}
+
+
 /*! This dangerous function makes the Fetch handler forget (part of)
     what it knows about \a uid. If Fetch has processed \a uid to
     completion, then forget() frees up memory for other use. To be
@@ -1820,6 +2112,9 @@ Message * Fetch::message( uint uid ) const
 
 void Fetch::sendFlagQuery()
 {
+    session()->forgetFlags( d->set );
+    d->flagGeneration = session()->flagGeneration();
+
     d->seenDeletedFetcher = new Query(
         "select uid, seen, deleted from mailbox_messages "
         "where mailbox=$1 and uid=any($2)",
@@ -33,7 +33,8 @@ public:
     EString annotation( class User *, uint,
                        const EStringList &, const EStringList & );
 
-    EString makeFetchResponse( Message *, uint, uint );
+    class EStringList * makeFetchResponse( Message *, uint, uint );
+    ImapResponse::Refill refill( EString * );
 
     Message * message( uint ) const;
     void forget( uint );
@@ -67,6 +68,8 @@ class ImapFetchResponse
 public:
     ImapFetchResponse( ImapSession *, Fetch *, uint );
     EString text() const;
+    class EStringList * textParts() const;
+    Refill refill( EString * );
     void setSent();
 
 private:
@@ -500,32 +500,16 @@ void Search::considerCache()
              fn( d->matches.count() ) + " messages",
              Log::Debug );
     }
+    else if ( d->root->match( s, d->matches ) == Selector::Yes ) {
+        log( "Search matched " + fn( d->matches.count() ) + " of " +
+             fn( s->count() ) + " messages using cache",
+             Log::Debug );
+    }
     else {
-        uint max = s->count();
-         // don't consider more than 300 messages - pg does it better
-        if ( max > 300 )
-            needDb = true;
-        uint c = 0;
-        while ( c < max && !needDb ) {
-            c++;
-            uint uid = s->uid( c );
-            switch ( d->root->match( s, uid ) ) {
-            case Selector::Yes:
-                d->matches.add( uid );
-                break;
-            case Selector::No:
-                break;
-            case Selector::Punt:
-                log( "Search must go to database: message " + fn( uid ) +
-                     " could not be tested in RAM",
-                     Log::Debug );
-                needDb = true;
-                d->matches.clear();
-                break;
-            }
-        }
-        log( "Search considered " + fn( c ) + " of " + fn( max ) +
-             " messages using cache", Log::Debug );
+        log( "Search must go to database: Condition could not be "
+             "tested in RAM", Log::Debug );
+        needDb = true;
+        d->matches.clear();
     }
     if ( !needDb )
         d->done = true;
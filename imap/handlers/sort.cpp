@@ -2,9 +2,12 @@
 
 #include "sort.h"
 
+#include "map.h"
 #include "user.h"
 #include "field.h"
 #include "codec.h"
+#include "cache.h"
+#include "query.h"
 #include "mailbox.h"
 #include "imapparser.h"
 #include "imapsession.h"
@@ -14,7 +17,13 @@ class SortData
     : public Garbage
 {
 public:
-    SortData(): Garbage(), s( 0 ), q( 0 ), u( false ) {}
+    SortData()
+        : Garbage(), s( 0 ), q( 0 ), permutation( 0 ), u( false ),
+          started( false ), joined( false ),
+          modseq( 0 ), order( 0 ), count( 0 ),
+          esort( false ), returnMin( false ), returnMax( false ),
+          returnCount( false ), returnAll( false ),
+          partialFirst( 0 ), partialLast( 0 ) {}
 
     enum SortCriterionType {
         Arrival,
@@ -49,23 +58,103 @@ public:
 
     Selector * s;
     Query * q;
+    Query * permutation;
     bool u;
+    bool started;
+    bool joined;
+
+    EString key;
+    int64 modseq;
+    uint * order;
+    uint count;
+    IntegerSet matches;
+
+    bool esort;
+    bool returnMin;
+    bool returnMax;
+    bool returnCount;
+    bool returnAll;
+    uint partialFirst;
+    uint partialLast;
 
     bool usingCriterionType( SortCriterionType );
 
+    EString criteria() const;
+    EString orderBy() const;
+
     void addCondition( EString &, class SortCriterion * );
     void addJoin( EString &, const EString &, const EString &, bool );
+
+    class Permutation
+        : public Garbage
+    {
+    public:
+        Permutation(): modseq( 0 ), uids( 0 ), count( 0 ) {}
+        EString criteria;
+        int64 modseq;
+        uint * uids;
+        uint count;
+    };
+
+    class SortCache
+        : public Cache
+    {
+    public:
+        SortCache(): Cache( 3 ) {}
+        void clear() { c.clear(); }
+
+        Permutation * find( Mailbox * m, const EString & criteria ) {
+            List<Permutation> * l = c.find( m->id() );
+            List<Permutation>::Iterator i( l );
+            while ( i && i->criteria != criteria )
+                ++i;
+            if ( !i || i->modseq != m->nextModSeq() )
+                return 0;
+            return i;
+        }
+
+        void insert( Mailbox * m, Permutation * p ) {
+            List<Permutation> * l = c.find( m->id() );
+            if ( !l ) {
+                l = new List<Permutation>;
+                c.insert( m->id(), l );
+            }
+            List<Permutation>::Iterator i( l );
+            while ( i ) {
+                if ( i->criteria == p->criteria || i->modseq < p->modseq )
+                    l->take( i );
+                else
+                    ++i;
+            }
+            // a client rarely uses more than a few sort orders
+            while ( l->count() >= 4 )
+                l->shift();
+            l->append( p );
+        }
+
+        Map< List<Permutation> > c;
+    };
 };
 
 
+static SortData::SortCache * cache = 0;
+
+
 /*! \class Sort sort.h
 
     The Sort class implements the IMAP SORT extension, which is
-    defined in RFC 5256.
+    defined in RFC 5256, and the ESORT extension from RFC 5267.
 
     This class subclasses Search in order to take advantage of its
-    parser, and operates quite nastily on the Query generated by
-    Selector.
+    parser. The sort keys are read from the sort_keys table, which
+    the Injector fills in.
+
+    Unless annotations are involved, Sort fetches the order of the
+    entire mailbox and keeps that permutation in RAM until the
+    mailbox's nextModSeq() changes. The search itself is then
+    answered from the session where possible, so repeated SORT
+    commands, and ESORT PARTIAL windows in particular, need no
+    sorting in the database.
 */
 
 
@@ -83,8 +172,53 @@ Sort::Sort( bool u )
 
 void Sort::parse()
 {
-    // sort-criteria
     space();
+    if ( present( "return" ) ) {
+        // RFC 5267 section 3, plus PARTIAL from section 4.4
+        d->esort = true;
+        space();
+        require( "(" );
+        bool any = false;
+        while ( ok() && nextChar() != ')' &&
+                nextChar() >= 'A' && nextChar() <= 'z' ) {
+            EString modifier = letters( 3, 7 ).lower();
+            any = true;
+            if ( modifier == "all" ) {
+                d->returnAll = true;
+            }
+            else if ( modifier == "min" ) {
+                d->returnMin = true;
+            }
+            else if ( modifier == "max" ) {
+                d->returnMax = true;
+            }
+            else if ( modifier == "count" ) {
+                d->returnCount = true;
+            }
+            else if ( modifier == "partial" ) {
+                space();
+                d->partialFirst = nzNumber();
+                require( ":" );
+                d->partialLast = nzNumber();
+                if ( d->partialFirst > d->partialLast ) {
+                    uint t = d->partialFirst;
+                    d->partialFirst = d->partialLast;
+                    d->partialLast = t;
+                }
+            }
+            else {
+                error( Bad, "Unknown sort return option: " + modifier );
+            }
+            if ( nextChar() != ')' )
+                space();
+        }
+        require( ")" );
+        if ( !any )
+            d->returnAll = true;
+        space();
+    }
+
+    // sort-criteria
     require( "(" );
     bool x = true;
     while ( x ) {
@@ -179,149 +313,256 @@ void Sort::execute()
     if ( state() != Executing )
         return;
 
-    if ( !d->q ) {
+    if ( !d->started ) {
+        d->started = true;
         d->s->simplify();
-        d->q = d->s->query( imap()->user(), session()->mailbox(),
-                            session(), this, true );
-        EString t = d->q->string();
-        List<SortData::SortCriterion>::Iterator c( d->c );
-        while ( c ) {
-            if ( c->t == SortData::Annotation ) {
-                c->b1 = d->s->placeHolder();
-                d->q->bind( c->b1, c->annotationEntry );
-                if ( c->priv ) {
-                    c->b2 = d->s->placeHolder();
-                    d->q->bind( c->b2, imap()->user()->id() );
-                }
-            }
-            d->addCondition( t, c );
-            ++c;
-        }
-        d->q->setString( t );
-        d->q->execute();
+        if ( d->usingCriterionType( SortData::Annotation ) )
+            sortInDatabase();
+        else
+            sortInRam();
     }
 
-    if ( !d->q->done() )
+    if ( d->permutation && !d->permutation->done() )
+        return;
+    if ( d->q && !d->q->done() )
         return;
 
-    List<uint> * result = new List<uint>;
+    if ( d->permutation && d->permutation->failed() ) {
+        error( No, "Database error: " + d->permutation->error() );
+        return;
+    }
+    if ( d->q && d->q->failed() ) {
+        error( No, "Database error: " + d->q->error() );
+        return;
+    }
+
+    uint * result = 0;
+    uint n = 0;
     Row * r;
-    while ( (r=d->q->nextRow()) != 0 ) {
-        uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
-        *tmp = r->getInt( "uid" );
-        result->append( tmp );
+    if ( d->permutation ) {
+        SortData::Permutation * p = new SortData::Permutation;
+        p->criteria = d->key;
+        p->modseq = d->modseq;
+        p->uids = (uint*)Allocator::alloc( sizeof( uint ) *
+                                           ( d->permutation->rows() + 1 ),
+                                           0 );
+        while ( (r=d->permutation->nextRow()) != 0 )
+            p->uids[p->count++] = r->getInt( "uid" );
+        d->order = p->uids;
+        d->count = p->count;
+        ::cache->insert( session()->mailbox(), p );
+    }
+
+    if ( d->order ) {
+        // the search matches are in d->matches or d->q, and the
+        // order of the entire mailbox in d->order
+        if ( d->q ) {
+            while ( (r=d->q->nextRow()) != 0 )
+                d->matches.add( r->getInt( "uid" ) );
+        }
+        result = (uint*)Allocator::alloc( sizeof( uint ) *
+                                          ( d->matches.count() + 1 ), 0 );
+        uint i = 0;
+        while ( i < d->count && n < d->matches.count() ) {
+            if ( d->matches.contains( d->order[i] ) )
+                result[n++] = d->order[i];
+            i++;
+        }
     }
-    waitFor( new ImapSortResponse( session(), result, d->u ) );
+    else {
+        result = (uint*)Allocator::alloc( sizeof( uint ) *
+                                          ( d->q->rows() + 1 ), 0 );
+        while ( (r=d->q->nextRow()) != 0 )
+            result[n++] = r->getInt( "uid" );
+    }
+
+    ImapSortResponse * response
+        = new ImapSortResponse( session(), result, n, d->u );
+    if ( d->esort )
+        response->setReturnOptions( tag(),
+                                    d->returnMin, d->returnMax,
+                                    d->returnCount, d->returnAll,
+                                    d->partialFirst, d->partialLast );
+    waitFor( response );
     finish();
 }
 
 
-void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
+/*! Finds the sort order for the whole mailbox, either in the cache or
+    by starting a query, and the search matches, either by looking at
+    the session or by starting another query.
+*/
+
+void Sort::sortInRam()
 {
-    switch ( c->t ) {
-    case Arrival:
-        addJoin( t, "join messages marrdt on (marrdt.id=mm.message) ",
-                 "marrdt.idate", c->reverse );
-        break;
-    case Cc:
-        addJoin( t,
-                 "left join address_fields sccaf on "
-                 "(mm.message=sccaf.message and "
-                 " sccaf.part='' and sccaf.number=0 and"
-                 " sccaf.field=" + fn( HeaderField::Cc ) + ") "
-                 "left join addresses scca on (sccaf.address=scca.id) ",
-                 "scca.localpart",
-                 c->reverse );
-        break;
-    case Date:
-        addJoin( t,
-                 "left join date_fields sddf on (mm.message=sddf.message) ",
-                 "sddf.value",
-                 c->reverse );
-        break;
-    case From:
-        addJoin( t,
-                 "left join address_fields sfaf on "
-                 "(mm.message=sfaf.message and "
-                 " sfaf.part='' and sfaf.number=0 and"
-                 " sfaf.field=" + fn( HeaderField::From ) + ") "
-                 "join addresses sfa on (sfaf.address=sfa.id) ",
-                 "sfa.localpart",
-                 c->reverse );
-        break;
-    case DisplayFrom:
-        addJoin( t,
-                 "left join address_fields sdfaf on "
-                 "(mm.message=sdfaf.message and "
-                 " sdfaf.part='' and sdfaf.number=0 and"
-                 " sdfaf.field=" + fn( HeaderField::From ) + ") "
-                 "join addresses sdfa on (sdfaf.address=sdfa.id) ",
-                 "case "
-                 "when sdfa.name='' then sdfa.localpart||'@'||sdfa.domain "
-                 "else sdfa.name "
-                 "end",
-                 c->reverse );
-        break;
-    case DisplayTo:
-        addJoin( t,
-                 "left join address_fields sdtaf on "
-                 "(mm.message=sdtaf.message and "
-                 " sdtaf.part='' and sdtaf.number=0 and"
-                 " sdtaf.field=" + fn( HeaderField::To ) + ") "
-                 "join addresses sdta on (sdtaf.address=sdta.id) ",
-                 "case "
-                 "when sdta.name='' then sdta.localpart||'@'||sdta.domain "
-                 "else sdta.name "
-                 "end",
-                 c->reverse );
-        break;
-    case Size:
-        addJoin( t,
-                 "join messages m on (m.id=mm.message) ",
-                 "m.rfc822size",
-                 c->reverse );
+    ImapSession * s = session();
+    Mailbox * m = s->mailbox();
+
+    if ( !::cache )
+        ::cache = new SortData::SortCache;
+
+    d->key = d->criteria();
+    SortData::Permutation * p = ::cache->find( m, d->key );
+    if ( p ) {
+        log( "Using cached order for " + d->key, Log::Debug );
+        d->order = p->uids;
+        d->count = p->count;
+    }
+    else {
+        // noting the modseq before the query makes a race harmless:
+        // at worst, a fresh permutation is discarded too early.
+        d->modseq = m->nextModSeq();
+        d->permutation =
+            new Query( "select mm.uid from mailbox_messages mm "
+                       "left join sort_keys sk on (sk.message=mm.message) "
+                       "where mm.mailbox=$1 "
+                       "order by " + d->orderBy(), this );
+        d->permutation->bind( 1, m->id() );
+        d->permutation->execute();
+    }
+
+    if ( d->s->match( s, d->matches ) != Selector::Yes ) {
+        d->matches.clear();
+        d->q = d->s->query( imap()->user(), m, s, this, false );
+        d->q->execute();
+    }
+}
+
+
+/*! Starts a single query which searches and sorts in the
+    database. This is used when the sort order depends on
+    annotations, which may be private and may change without the
+    mailbox changing.
+*/
+
+void Sort::sortInDatabase()
+{
+    d->q = d->s->query( imap()->user(), session()->mailbox(),
+                        session(), this, true );
+    EString t = d->q->string();
+    List<SortData::SortCriterion>::Iterator c( d->c );
+    while ( c ) {
+        if ( c->t == SortData::Annotation ) {
+            c->b1 = d->s->placeHolder();
+            d->q->bind( c->b1, c->annotationEntry );
+            if ( c->priv ) {
+                c->b2 = d->s->placeHolder();
+                d->q->bind( c->b2, imap()->user()->id() );
+            }
+        }
+        d->addCondition( t, c );
+        ++c;
+    }
+    d->q->setString( t );
+    d->q->execute();
+}
+
+
+/*! Returns the name of the sort_keys column used for \a t, or 0 for
+    criteria which aren't in sort_keys.
+*/
+
+static const char * sortKeyColumn( SortData::SortCriterionType t )
+{
+    switch ( t ) {
+    case SortData::Arrival:
+        return "sk.arrival";
+    case SortData::Cc:
+        return "sk.cc_mailbox";
+    case SortData::Date:
+        return "sk.sent";
+    case SortData::DisplayFrom:
+        return "sk.display_from";
+    case SortData::DisplayTo:
+        return "sk.display_to";
+    case SortData::From:
+        return "sk.from_mailbox";
+    case SortData::Size:
+        return "sk.size";
+    case SortData::Subject:
+        return "sk.subject";
+    case SortData::To:
+        return "sk.to_mailbox";
+    case SortData::Annotation:
+    case SortData::Unknown:
         break;
-    case Subject:
+    }
+    return 0;
+}
+
+
+/*! Returns a string describing the sort criteria, suitable as cache
+    key.
+*/
+
+EString SortData::criteria() const
+{
+    EString r;
+    List<SortCriterion>::Iterator i( c );
+    while ( i ) {
+        if ( !r.isEmpty() )
+            r.append( " " );
+        if ( i->reverse )
+            r.append( "-" );
+        r.appendNumber( (uint)i->t );
+        ++i;
+    }
+    return r;
+}
+
+
+/*! Returns an SQL order by clause for the sort criteria, using the
+    sort_keys table (as sk) and mailbox_messages (as mm).
+*/
+
+EString SortData::orderBy() const
+{
+    EString r;
+    List<SortCriterion>::Iterator i( c );
+    while ( i ) {
+        const char * column = sortKeyColumn( i->t );
+        if ( column ) {
+            r.append( column );
+            if ( i->reverse )
+                r.append( " desc" );
+            r.append( ", " );
+        }
+        ++i;
+    }
+    r.append( "mm.uid" );
+    return r;
+}
+
+
+void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
+{
+    if ( c->t != Annotation ) {
+        EString join;
+        if ( !joined )
+            join = "left join sort_keys sk on (sk.message=mm.message) ";
+        joined = true;
+        addJoin( t, join, sortKeyColumn( c->t ), c->reverse );
+        return;
+    }
+
+    if ( c->priv )
         addJoin( t,
-                 "left join header_fields sshf on "
-                 "(mm.message=sshf.message and sshf.field=" +
-                 fn( HeaderField::Subject ) + ") ",
-                 "sshf.value",
+                 "left join annotations saa on "
+                 "(mm.mailbox=saa.mailbox and mm.uid=saa.uid and"
+                 " owner=$" + fn( c->b2 ) + " and name="
+                 "(select id from annotation_names where lower(name)=$" +
+                 fn( c->b1 ) + ")) ",
+                 "saa.value",
                  c->reverse );
-        break;
-    case To:
+    else
         addJoin( t,
-                 "left join address_fields staf on "
-                 "(mm.message=staf.message and "
-                 " staf.part='' and staf.number=0 and"
-                 " staf.field=" + fn( HeaderField::To ) + ") "
-                 "left join addresses sta on (staf.address=sta.id) ",
-                 "sta.localpart",
+                 "left join annotations saa on "
+                 "(mm.mailbox=saa.mailbox and mm.uid=saa.uid and"
+                 " owner is null and name="
+                 "(select id from annotation_names where lower(name)=$" +
+                 fn( c->b1 ) + ")) ",
+                 "saa.value",
                  c->reverse );
-        break;
-    case Annotation:
-        if ( c->priv )
-            addJoin( t,
-                     "left join annotations saa on "
-                     "(mm.mailbox=saa.mailbox and mm.uid=saa.uid and"
-                     " owner=$" + fn( c->b2 ) + " and name="
-                     "(select id from annotation_names where lower(name)=$" +
-                     fn( c->b1 ) + ")) ",
-                     "saa.value",
-                     c->reverse );
-        else
-            addJoin( t,
-                     "left join annotations saa on "
-                     "(mm.mailbox=saa.mailbox and mm.uid=saa.uid and"
-                     " owner is null and name="
-                     "(select id from annotation_names where lower(name)=$" +
-                     fn( c->b1 ) + ")) ",
-                     "saa.value",
-                     c->reverse );
-        break;
-    case Unknown:
-        break;
-    }
 }
 
 
@@ -372,39 +613,141 @@ bool SortData::usingCriterionType( SortCriterionType t )
 
 /*! \class ImapSortResponse sort.h
 
-    The ImapSortResponse models the SORT response, and has to make
-    sure old MSNs aren't accidentally included.
+    The ImapSortResponse models the SORT response and the ESEARCH
+    response to an ESORT command, and has to make sure old MSNs
+    aren't accidentally included.
 */
 
 
 
-/*! Constructs a SORT response which will return \a result within \a
-    session, using UIDs if \a uid is true and MSNs if \a uid is false.
+/*! Constructs a SORT response which will return the \a count UIDs in
+    \a result within \a session, using UIDs if \a uid is true and MSNs
+    if \a uid is false.
 */
 
 ImapSortResponse::ImapSortResponse( ImapSession * session,
-                                    List<uint> * result, bool uid )
-    : ImapResponse( session ),r( result ), u( uid )
+                                    const uint * result, uint count,
+                                    bool uid )
+    : ImapResponse( session ), r( result ), n( count ), u( uid ),
+      esort( false ), min( false ), max( false ), all( false ),
+      counted( false ), first( 0 ), last( 0 )
+{
+}
+
+
+/*! Makes this response an ESEARCH response tagged with \a tag
+    instead of a SORT response. \a rmin, \a rmax, \a rcount and \a
+    rall correspond to the result options in RFC 5267. If \a pfirst
+    is nonzero, the \a pfirst'th to \a plast'th results are returned
+    as PARTIAL.
+*/
+
+void ImapSortResponse::setReturnOptions( const EString & tag,
+                                         bool rmin, bool rmax,
+                                         bool rcount, bool rall,
+                                         uint pfirst, uint plast )
+{
+    esort = true;
+    t = tag;
+    min = rmin;
+    max = rmax;
+    counted = rcount;
+    all = rall;
+    first = pfirst;
+    last = plast;
+}
+
+
+// Appends the k numbers in \a v to \a r, comma-separated, using a
+// range wherever the sort order happens to be ascending and
+// consecutive.
+
+static void appendList( EString & r, const uint * v, uint k )
 {
+    uint i = 0;
+    while ( i < k ) {
+        uint j = i;
+        while ( j + 1 < k && v[j+1] == v[j] + 1 )
+            j++;
+        if ( i )
+            r.append( "," );
+        r.appendNumber( v[i] );
+        if ( j > i ) {
+            r.append( ":" );
+            r.appendNumber( v[j] );
+        }
+        i = j + 1;
+    }
 }
 
 
 EString ImapSortResponse::text() const
 {
     Session * s = session();
-    EString result;
-    result.reserve( r->count() * 10 );
-    result.append( "SORT" );
-    List<uint>::Iterator i( r );
-    while ( i ) {
-        uint x = *i;
-        ++i;
+
+    // first translate to MSNs if necessary, dropping the UIDs which
+    // have no MSN any more
+    uint * v = (uint*)Allocator::alloc( sizeof( uint ) * ( n + 1 ), 0 );
+    uint k = 0;
+    uint i = 0;
+    while ( i < n ) {
+        uint x = r[i++];
         if ( !u )
             x = s->msn( x );
-        if ( x ) {
+        if ( x )
+            v[k++] = x;
+    }
+
+    EString result;
+    if ( !esort ) {
+        result.reserve( k * 10 );
+        result.append( "SORT" );
+        i = 0;
+        while ( i < k ) {
             result.append( " " );
-            result.appendNumber( x );
+            result.appendNumber( v[i++] );
+        }
+        return result;
+    }
+
+    result.append( "ESEARCH (tag " );
+    result.append( t.quoted() );
+    result.append( ")" );
+    if ( u )
+        result.append( " uid" );
+    if ( k && min ) {
+        result.append( " min " );
+        result.appendNumber( v[0] );
+    }
+    if ( k && max ) {
+        result.append( " max " );
+        result.appendNumber( v[k-1] );
+    }
+    if ( counted ) {
+        result.append( " count " );
+        result.appendNumber( k );
+    }
+    if ( k && all ) {
+        result.reserve( k * 10 );
+        result.append( " all " );
+        appendList( result, v, k );
+    }
+    if ( first ) {
+        result.append( " partial (" );
+        result.appendNumber( first );
+        result.append( ":" );
+        result.appendNumber( last );
+        result.append( " " );
+        if ( first > k ) {
+            result.append( "nil" );
+        }
+        else {
+            uint end = last;
+            if ( end > k )
+                end = k;
+            appendList( result, v + first - 1, end + 1 - first );
         }
+        result.append( ")" );
     }
     return result;
 }
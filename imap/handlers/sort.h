@@ -15,6 +15,10 @@ public:
     void parse();
     void execute();
 
+private:
+    void sortInRam();
+    void sortInDatabase();
+
 private:
     class SortData * d;
 };
@@ -24,12 +28,21 @@ class ImapSortResponse
     : public ImapResponse
 {
 public:
-    ImapSortResponse( ImapSession *, List<uint> *, bool );
+    ImapSortResponse( ImapSession *, const uint *, uint, bool );
+
+    void setReturnOptions( const EString &, bool, bool, bool, bool,
+                           uint, uint );
+
     EString text() const;
 
 private:
-    List<uint> * r;
+    const uint * r;
+    uint n;
     bool u;
+    bool esort;
+    bool min, max, all, counted;
+    uint first, last;
+    EString t;
 };
 
 
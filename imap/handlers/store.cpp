@@ -603,6 +603,8 @@ void Store::execute()
 
         if ( d->silent )
             d->session->ignoreModSeq( d->modseq );
+        // the session's idea of these messages' flags is out of date
+        d->session->forgetFlags( d->s );
         Mailbox::refreshMailboxes( transaction() );
         transaction()->commit();
     }
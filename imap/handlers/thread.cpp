@@ -12,6 +12,7 @@
 #include "dict.h"
 #include "list.h"
 #include "map.h"
+#include "integerset.h"
 
 
 class ThreadData
@@ -20,7 +21,7 @@ class ThreadData
 public:
     ThreadData(): Garbage(), uid( true ), s( 0 ),
                   session( 0 ),
-                  find( 0 ) {}
+                  find( 0 ), ancestors( 0 ), linked( false ) {}
 
     bool uid;
     enum Algorithm { OrderedSubject, Refs, References };
@@ -29,6 +30,8 @@ public:
 
     ImapSession * session;
     Query * find;
+    Query * ancestors;
+    bool linked;
 
     class Node
         : public Garbage
@@ -36,20 +39,23 @@ public:
     public:
         Node()
             : Garbage(),
-              uid( 0 ), threadRoot( 0 ),
+              uid( 0 ), message( 0 ), parentMessage( 0 ), threadRoot( 0 ),
               idate( 0 ),
-              reported( false ), added( false ),
+              reported( false ), added( false ), matched( false ),
               parent( 0 ) {}
 
         uint uid;
+        uint message;
+        uint parentMessage;
         uint threadRoot;
         UString subject;
         uint idate;
-        EString references;
         EString messageId;
+        EString references;
 
         bool reported;
         bool added;
+        bool matched;
 
         class Node * parent;
         List<Node> children;
@@ -62,11 +68,14 @@ public:
         }
     };
 
-    Dict<Node> nodes;
+    List<Node> nodes;
+    Dict<Node> ids;
+    Map<Node> lineage;
     List<Node> roots;
 
     List<Node> result;
 
+    void link( Node * );
     void splice( List<Node> * );
     void append( EString &, List<Node> *, bool );
 };
@@ -129,6 +138,17 @@ void Thread::parse()
 /*! This reimplementation of Search::execute() does not call
     Search. It does the entire job itself.
 
+    The thread_members table, which the Injector maintains, gives
+    each message's Message-Id and References, so this only has to
+    read one row per matching message. Messages are linked along
+    their References to the other messages in the result, as RFC 5256
+    says, and the messages which aren't in the result become dummy
+    nodes.
+
+    If a message's References don't lead to any message in the
+    result, for example because they're truncated, the parent links
+    in thread_members are followed instead, until they reach a message
+    which is in the result.
 */
 
 void Thread::execute()
@@ -145,37 +165,24 @@ void Thread::execute()
         want->append( "message" );
         want->append( "m.idate" );
         want->append( "m.thread_root" );
-        want->append( "tmid.value as messageid" );
-        want->append( "tref.value as references" );
-        EString ts;
-        if ( d->threadAlg == ThreadData::References ) {
-            want->append( "tsubj.value as subject" );
-            ts = "left join header_fields tsubj on"
-                 " (m.id=tsubj.message and"
-                 " tsubj.field=" + fn( HeaderField::Subject ) +
-                 " and tsubj.part='') ";
-        }
+        want->append( "tm.messageid" );
+        want->append( "tm.refs" );
+        want->append( "tm.parent" );
+        want->append( "tm.subject" );
 
         d->find = d->s->query( imap()->user(),
                                d->session->mailbox(), d->session,
                                this, false, want );
-        EString j = d->find->string();
 
-        // we need to get the References and Message-Id fields as well
-        const char * x = "left join";
-        if ( !j.contains( x ) )
-            x = "where";
-        j.replace( x,
-                   "left join header_fields tref on"
-                   " (m.id=tref.message and"
-                   " tref.field=" + fn( HeaderField::References ) +
-                   " and tref.part='') "
-                   "left join header_fields tmid on"
-                   " (m.id=tmid.message and"
-                   " tmid.field=" + fn( HeaderField::MessageId ) +
-                   " and tmid.part='') " + ts + x );
-
-        d->find->setString( j );
+        // join thread_members right after mailbox_messages, before
+        // any joins the Selector added
+        EString j = d->find->string();
+        EString from( " from mailbox_messages mm" );
+        int i = j.find( from ) + from.length();
+        d->find->setString( j.mid( 0, i ) +
+                            " left join thread_members tm"
+                            " on (tm.message=mm.message)" +
+                            j.mid( i ) );
 
         d->find->execute();
         return;
@@ -185,27 +192,106 @@ void Thread::execute()
         Row * r = d->find->nextRow();
         ThreadData::Node * n = new ThreadData::Node;
         n->uid = r->getInt( "uid" );
+        n->message = r->getInt( "message" );
         n->idate = r->getInt( "idate" );
         if ( !r->isNull( "thread_root" ) )
             n->threadRoot = r->getInt( "thread_root" );
-        if ( !r->isNull( "references" ) )
-            n->references = r->getEString( "references" );
         if ( !r->isNull( "messageid" ) )
             n->messageId = r->getEString( "messageid" );
+        if ( !r->isNull( "refs" ) )
+            n->references = r->getEString( "refs" );
+        if ( !r->isNull( "parent" ) )
+            n->parentMessage = r->getInt( "parent" );
         if ( !r->isNull( "subject" ) )
             n->subject = Message::baseSubject( r->getUString( "subject" ) );
 
         d->result.append( n );
-        if ( !n->messageId.isEmpty() )
-            d->nodes.insert( n->messageId, n );
+        d->nodes.append( n );
+        if ( !n->messageId.isEmpty() && !d->ids.find( n->messageId ) )
+            d->ids.insert( n->messageId, n );
     }
 
     if ( !d->find->done() )
         return;
 
-    List<ThreadData::Node>::Iterator ri( d->result );
+    if ( d->threadAlg != ThreadData::OrderedSubject && !d->linked ) {
+        d->linked = true;
+        IntegerSet missing;
+        List<ThreadData::Node>::Iterator ri( d->result );
+        while ( ri ) {
+            d->link( ri );
+            if ( !ri->matched && ri->parentMessage )
+                missing.add( ri->parentMessage );
+            ++ri;
+        }
+        if ( !missing.isEmpty() ) {
+            d->ancestors =
+                new Query( "with recursive a (message, parent) as ("
+                           "select message, parent from thread_members "
+                           "where message=any($1) "
+                           "union "
+                           "select t.message, t.parent "
+                           "from thread_members t "
+                           "join a on (t.message=a.parent)) "
+                           "select a.message, a.parent, tm.messageid "
+                           "from a "
+                           "join thread_members tm on (a.message=tm.message)",
+                           this );
+            d->ancestors->bind( 1, missing );
+            d->ancestors->execute();
+            return;
+        }
+    }
+
+    while ( d->ancestors && d->ancestors->hasResults() ) {
+        Row * r = d->ancestors->nextRow();
+        ThreadData::Node * a = new ThreadData::Node;
+        a->message = r->getInt( "message" );
+        if ( !r->isNull( "parent" ) )
+            a->parentMessage = r->getInt( "parent" );
+        if ( !r->isNull( "messageid" ) )
+            a->messageId = r->getEString( "messageid" );
+        d->lineage.insert( a->message, a );
+    }
+
+    if ( d->ancestors && !d->ancestors->done() )
+        return;
+
+    if ( d->ancestors ) {
+        // the parent links can reach messages in other mailboxes,
+        // possibly other users', so they're only used to find a
+        // relative in the result
+        List<ThreadData::Node>::Iterator ri( d->result );
+        while ( ri ) {
+            ThreadData::Node * n = ri;
+            ++ri;
+            if ( n->matched || !n->parentMessage )
+                continue;
+            ThreadData::Node * a = d->lineage.find( n->parentMessage );
+            ThreadData::Node * relative = 0;
+            uint steps = 0;
+            while ( a && !relative && steps < d->lineage.count() ) {
+                ThreadData::Node * c = 0;
+                if ( !a->messageId.isEmpty() )
+                    c = d->ids.find( a->messageId );
+                if ( c && c->uid && c != n )
+                    relative = c;
+                else if ( a->parentMessage )
+                    a = d->lineage.find( a->parentMessage );
+                else
+                    a = 0;
+                steps++;
+            }
+            ThreadData::Node * top = n->root();
+            if ( relative && relative->root() != top )
+                top->parent = relative;
+        }
+    }
+
+    List<ThreadData::Node>::Iterator i( d->nodes );
     if ( d->threadAlg == ThreadData::OrderedSubject ) {
         UDict<ThreadData::Node> roots;
+        List<ThreadData::Node>::Iterator ri( d->result );
         while ( ri ) {
             ThreadData::Node * n = ri;
             ++ri;
@@ -218,50 +304,13 @@ void Thread::execute()
         }
     }
     else {
-        while ( ri ) {
-            ThreadData::Node * n = ri;
-            ++ri;
-
-            EStringList l;
-            int lt = 0;
-            while ( lt >= 0 ) {
-                lt = n->references.find( '<', lt );
-                if ( lt >= 0 ) {
-                    int gt = n->references.find( '>', lt );
-                    if ( gt > 0 )
-                        l.append( n->references.mid( lt, gt + 1 - lt ) );
-                    lt = gt;
-                }
-            }
-            l.append( n->messageId );
-
-            EStringList::Iterator s( l );
-            ThreadData::Node * parent = 0;
-            while ( s ) {
-                if ( !s->isEmpty() ) {
-                    ThreadData::Node * n = d->nodes.find( *s );
-                    if ( !n ) {
-                        n = new ThreadData::Node;
-                        n->messageId = *s;
-                        n->threadRoot = n->threadRoot;
-                        d->nodes.insert( *s, n );
-                    }
-                    if ( parent && !n->parent && parent->root() != n )
-                        n->parent = parent;
-                    parent = n;
-                }
-                ++s;
-            };
-        }
-
         // merge big threads where the start has been deleted, or
         // isn't part of the search expression.
-        Dict<ThreadData::Node>::Iterator i( d->nodes );
         Map<ThreadData::Node> roots;
         while ( i ) {
             ThreadData::Node * n = i;
             ++i;
-            if ( !n->parent ) {
+            if ( !n->parent && n->threadRoot ) {
                 ThreadData::Node * found = roots.find( n->threadRoot );
                 if ( !found )
                     roots.insert( n->threadRoot, n );
@@ -272,10 +321,10 @@ void Thread::execute()
 
         // if thread=references is used, we need to jump through extra hoops
         if ( d->threadAlg == ThreadData::References ) {
-            Dict<ThreadData::Node>::Iterator i( d->nodes );
+            i = List<ThreadData::Node>::Iterator( d->nodes );
             UDict<ThreadData::Node> subjects;
             while ( i ) {
-                if ( !i->parent ) {
+                if ( !i->parent && !i->subject.isEmpty() ) {
                     ThreadData::Node * potential = subjects.find( i->subject );
                     if ( potential )
                         i->parent = potential;
@@ -288,7 +337,7 @@ void Thread::execute()
     }
 
     // set up child lists and the root list
-    Dict<ThreadData::Node>::Iterator i( d->nodes );
+    i = List<ThreadData::Node>::Iterator( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
@@ -307,7 +356,7 @@ void Thread::execute()
     // we need to sort root nodes (and children) by idate, so we
     // extend the definition until sorting works: a non-message's
     // idate is the oldest idate of a direct descendant.
-    i = Dict<ThreadData::Node>::Iterator( d->nodes );
+    i = List<ThreadData::Node>::Iterator( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
@@ -356,6 +405,44 @@ EString ThreadResponse::text() const
     return result;
 }
 
+/*! Links \a n to its parent along its References field. Each
+    message-id there is the parent of the next, and the last is the
+    parent of \a n. Message-ids which aren't in the result become
+    dummy nodes. Existing links are kept. Notes in \a n whether any
+    of the message-ids belongs to another message in the result.
+*/
+
+void ThreadData::link( Node * n )
+{
+    Node * parent = 0;
+    int lt = n->references.find( '<' );
+    while ( lt >= 0 ) {
+        int gt = n->references.find( '>', lt );
+        if ( gt < 0 )
+            break;
+        EString id = n->references.mid( lt, gt + 1 - lt );
+        Node * c = ids.find( id );
+        if ( !c ) {
+            c = new Node;
+            c->messageId = id;
+            c->threadRoot = n->threadRoot;
+            ids.insert( id, c );
+            nodes.append( c );
+        }
+        if ( c != n ) {
+            if ( c->uid )
+                n->matched = true;
+            if ( parent && !c->parent && parent->root() != c )
+                c->parent = parent;
+            parent = c;
+        }
+        lt = n->references.find( '<', gt );
+    }
+    if ( parent && !n->parent && parent->root() != n )
+        n->parent = parent;
+}
+
+
 void ThreadData::splice( List<ThreadData::Node> * l )
 {
     List<Node>::Iterator i ( l );
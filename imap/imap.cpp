@@ -9,6 +9,7 @@
 #include "scope.h"
 #include "buffer.h"
 #include "estring.h"
+#include "estringlist.h"
 #include "mailbox.h"
 #include "selector.h"
 #include "eventloop.h"
@@ -39,12 +40,14 @@ public:
         : state( IMAP::NotAuthenticated ), reader( 0 ),
           prefersAbsoluteMailboxes( false ),
           runningCommands( false ), runCommandsAgain( false ),
-          readingLiteral( false ),
+          readingLiteral( false ), discarding( false ),
+          paused( false ), pausedPlus( false ),
           literalSize( 0 ), mailbox( 0 ),
           bytesArrived( 0 ),
           eventMap( new EventMap ),
           lastBadTime( 0 ),
-          nextOkTime( 0 )
+          nextOkTime( 0 ),
+          streamer( 0 ), stream( 0 ), streamed( 0 ), streamWaiting( false )
     {
         uint i = 0;
         while ( i < IMAP::NumClientCapabilities )
@@ -69,6 +72,9 @@ public:
     bool runningCommands;
     bool runCommandsAgain;
     bool readingLiteral;
+    bool discarding;
+    bool paused;
+    bool pausedPlus;
     uint literalSize;
 
     List<Command> commands;
@@ -110,6 +116,12 @@ public:
     };
 
     uint nextOkTime;
+
+    ImapResponse * streamer;
+    EStringList * stream;
+    uint streamed;
+    bool streamWaiting;
+    EString held;
 };
 
 
@@ -262,6 +274,9 @@ void IMAP::parse()
     Scope s;
     Buffer * r = readBuffer();
 
+    if ( d->paused )
+        return;
+
     while ( true ) {
         // We read a line of client input, possibly including literals,
         // and create a Command to deal with it.
@@ -275,31 +290,77 @@ void IMAP::parse()
             if ( !s )
                 return;
 
-            d->str.append( *s );
+            if ( !d->discarding )
+                d->str.append( *s );
 
             if ( endsWithLiteral( s, &n, &plus ) ) {
-                d->str.append( "\r\n" );
-                if ( n <= ImapParser::literalSizeLimit() ) {
+                if ( !d->discarding ) {
+                    d->str.append( "\r\n" );
+                    if ( d->str.length() + n >
+                         ImapParser::literalSizeLimit() ) {
+                        rejectLiteral( n );
+                    }
+                    else if ( queuedInput() + d->str.length() + n >
+                              ImapParser::literalSizeLimit() ) {
+                        // the limit also applies to the input of the
+                        // commands queued before this one, so
+                        // pipelining can't multiply it. we stop
+                        // reading until they've finished.
+                        d->paused = true;
+                        d->pausedPlus = plus;
+                        d->literalSize = n;
+                        log( "Waiting for " + fn( queuedInput() ) +
+                             " bytes of queued input before reading " +
+                             fn( n ) + "-byte literal", Log::Debug );
+                        return;
+                    }
+                }
+                if ( !d->discarding ) {
                     d->readingLiteral = true;
                     d->literalSize = n;
                     if ( !plus )
                         enqueue( "+ reading literal\r\n" );
                 }
+                else if ( plus ) {
+                    // the client sends it anyway, so we skip it
+                    d->readingLiteral = true;
+                    d->literalSize = n;
+                }
             }
 
             // Have we finished reading the entire command?
             if ( !d->readingLiteral ) {
-                addCommand();
+                if ( d->discarding )
+                    d->discarding = false;
+                else
+                    addCommand();
                 d->str.truncate();
             }
         }
         else if ( d->readingLiteral ) {
-            // Have we finished reading a complete literal?
-            if ( r->size() < d->literalSize )
+            // Move what we have of the literal out of the read
+            // buffer, and wait for the rest
+            uint n = r->size();
+            if ( n > d->literalSize )
+                n = d->literalSize;
+            if ( n && !d->discarding ) {
+                // the literal grows towards its announced size as it
+                // arrives, so a client can't make us allocate all of
+                // it before sending anything
+                uint received = d->str.length() + n;
+                if ( received > d->str.capacity() ) {
+                    uint size = received * 2;
+                    uint announced = d->str.length() + d->literalSize + 2;
+                    if ( size > announced )
+                        size = announced;
+                    d->str.reserve( size );
+                }
+                r->extract( &d->str, 0, n );
+            }
+            r->remove( n );
+            d->literalSize -= n;
+            if ( d->literalSize )
                 return;
-
-            d->str.append( r->string( d->literalSize ) );
-            r->remove( d->literalSize );
             d->readingLiteral = false;
         }
         else if ( d->reader ) {
@@ -313,6 +374,83 @@ void IMAP::parse()
 }
 
 
+/*! Rejects the command being read, because its next literal, which
+    is \a n bytes long, would take its input past the literal size
+    limit. The rest of the command is discarded as it arrives, so the
+    input held for a command never occupies more RAM than the limit.
+*/
+
+void IMAP::rejectLiteral( uint n )
+{
+    EString tag = d->str.section( " ", 1 );
+    if ( tag.isEmpty() || tag.contains( '\r' ) )
+        tag = "*";
+    uint size = d->str.length() + n;
+    log( "Rejecting command with " + fn( size ) + "-byte input (limit is " +
+         fn( ImapParser::literalSizeLimit() ) + ")", Log::Info );
+    enqueue( tag + " NO [TOOBIG] Command too large: " +
+             EString::humanNumber( size ) + " (limit is " +
+             EString::humanNumber( ImapParser::literalSizeLimit() ) +
+             ")\r\n" );
+    d->str.truncate();
+    d->discarding = true;
+}
+
+
+/*! Reads from the socket, unless parse() is waiting for earlier
+    commands to finish before it reads a literal. In that case the
+    client's data is left in the socket, so that TCP flow control
+    slows the client down instead of the server buffering it.
+*/
+
+void IMAP::read()
+{
+    if ( d->paused )
+        return;
+    Connection::read();
+}
+
+
+/*! Resumes reading the literal parse() is waiting for, if the commands
+    queued before it have finished enough of their work that the
+    input held for the connection stays within the literal size limit.
+*/
+
+void IMAP::resumeInput()
+{
+    if ( !d->paused ||
+         queuedInput() + d->str.length() + d->literalSize >
+         ImapParser::literalSizeLimit() )
+        return;
+    d->paused = false;
+    d->readingLiteral = true;
+    if ( !d->pausedPlus )
+        enqueue( "+ reading literal\r\n" );
+    // the socket may have become readable meanwhile, and the
+    // EventLoop won't tell us again
+    EventLoop::global()->readSoon( this );
+}
+
+
+/*! Returns the number of input bytes held by the commands that have
+    been read but haven't finished yet.
+*/
+
+uint IMAP::queuedInput() const
+{
+    uint n = 0;
+    List<Command>::Iterator i( d->commands );
+    while ( i ) {
+        if ( ( i->state() == Command::Unparsed ||
+               i->state() == Command::Blocked ||
+               i->state() == Command::Executing ) && i->parser() )
+            n += i->parser()->input().length();
+        ++i;
+    }
+    return n;
+}
+
+
 /*! This function parses enough of the command line to create a Command,
     and then uses it to parse the rest of the input.
 */
@@ -630,6 +768,7 @@ void IMAP::runCommands()
         else
             ++i;
     }
+    resumeInput();
     if ( d->commands.isEmpty() ) {
         if ( EventLoop::global()->inShutdown() &&
              Connection::state() == Connected )
@@ -837,6 +976,9 @@ void IMAP::respond( class ImapResponse * response )
 
 void IMAP::emitResponses()
 {
+    if ( d->stream )
+        return;
+
     if ( clientHasBug( NoUnsolicitedResponses ) && commands()->isEmpty() )
         return;
 
@@ -881,14 +1023,31 @@ void IMAP::emitResponses()
             r->setSent();
         }
         else if ( !r->sent() && ( can || !r->changesMsn() ) ) {
-            EString t = r->text();
-            if ( !t.isEmpty() ) {
-                w->append( "* ", 2 );
-                w->append( t );
-                w->append( "\r\n", 2 );
-                n++;
+            EStringList * l = r->textParts();
+            if ( l ) {
+                if ( !l->isEmpty() ) {
+                    w->append( "* ", 2 );
+                    d->streamer = r;
+                    d->stream = l;
+                    d->streamed = 0;
+                    n++;
+                    if ( !stream() )
+                        break;
+                }
+                else {
+                    r->setSent();
+                }
+            }
+            else {
+                EString t = r->text();
+                if ( !t.isEmpty() ) {
+                    w->append( "* ", 2 );
+                    w->appendShared( t );
+                    w->append( "\r\n", 2 );
+                    n++;
+                }
+                r->setSent();
             }
-            r->setSent();
             any = true;
         }
         if ( r->sent() )
@@ -908,6 +1067,148 @@ void IMAP::emitResponses()
 }
 
 
+// Output is taken from a streaming response until this much is
+// pending (written to the writeBuffer() or being compressed), and in
+// pieces of at most streamChunk bytes.
+
+static const uint streamLimit = 65536;
+static const uint streamChunk = 16384;
+
+
+/*! Appends as much of the response being streamed as the
+    writeBuffer() will take now, and returns true if that was the
+    last of it. When it was, the response is marked as sent, and
+    anything enqueue() held back meanwhile is appended.
+
+    A streamed response is written as the client reads it, rather
+    than all at once, and its pieces are appended with
+    Buffer::appendShared(), so large literals aren't copied into the
+    writeBuffer() at all. When a piece has been written, the response
+    may refill() it, e.g. with the next part of a literal it fetches
+    from the database as the client reads.
+*/
+
+bool IMAP::stream()
+{
+    Buffer * w = writeBuffer();
+    d->streamWaiting = false;
+    while ( d->stream && Connection::pendingOutput() < streamLimit ) {
+        EString * s = d->stream->firstElement();
+        if ( s && d->streamed < s->length() ) {
+            uint n = s->length() - d->streamed;
+            if ( n > streamChunk )
+                n = streamChunk;
+            w->appendShared( s->mid( d->streamed, n ) );
+            d->streamed += n;
+            continue;
+        }
+        if ( s ) {
+            ImapResponse::Refill r = d->streamer->refill( s );
+            if ( r == ImapResponse::Waiting ) {
+                d->streamWaiting = true;
+                return false;
+            }
+            d->streamed = 0;
+            if ( r == ImapResponse::More )
+                continue;
+        }
+        d->stream->shift();
+        if ( d->stream->isEmpty() ) {
+            w->append( "\r\n", 2 );
+            w->append( d->held );
+            d->held.truncate();
+            d->stream = 0;
+            d->streamer->setSent();
+            d->streamer = 0;
+        }
+    }
+    return !d->stream;
+}
+
+
+/*! Returns true if a response is being written as the client reads
+    it, and false otherwise. While this is true, other output is held
+    back.
+*/
+
+bool IMAP::streaming() const
+{
+    return d->stream != 0;
+}
+
+
+/*! Appends \a s to the writeBuffer(), or holds it back until the
+    response currently being streamed has been written.
+*/
+
+void IMAP::enqueue( const EString & s )
+{
+    if ( d->stream )
+        d->held.append( s );
+    else
+        Connection::enqueue( s );
+}
+
+
+/*! Writes pending output, and then refills the writeBuffer() from
+    the response being streamed, if any, and writes that too. When
+    the last of that has been written, the responses and commands
+    which had to wait for it may proceed.
+
+    Refilling stops when output remains pending, since the EventLoop
+    calls write() again when the socket can take more, or when a
+    Compressor thread is done.
+*/
+
+void IMAP::write()
+{
+    Connection::write();
+    while ( d->stream ) {
+        bool last = stream();
+        Connection::write();
+        if ( last ) {
+            emitResponses();
+            unblockCommands();
+            Connection::write();
+            return;
+        }
+        if ( Connection::pendingOutput() || d->streamWaiting )
+            return;
+    }
+}
+
+
+/*! Returns true if there is output to write, including any part of
+    a streamed response not yet in the writeBuffer().
+*/
+
+bool IMAP::canWrite()
+{
+    if ( d->stream )
+        return true;
+    return Connection::canWrite();
+}
+
+
+/*! Returns the number of bytes pending, including the part of a
+    streamed response not yet in the writeBuffer() and any output
+    held back meanwhile.
+*/
+
+uint IMAP::pendingOutput()
+{
+    uint n = Connection::pendingOutput();
+    if ( !d->stream )
+        return n;
+    EStringList::Iterator i( d->stream );
+    while ( i ) {
+        n += i->length();
+        ++i;
+    }
+    return n - d->streamed + d->held.length();
+}
+
+
 /*! Records that \a m is a (possibly) active mailbox group. */
 
 void IMAP::addMailboxGroup( MailboxGroup * m )
@@ -53,6 +53,13 @@ public:
 
     void respond( class ImapResponse * );
     void emitResponses();
+    bool streaming() const;
+
+    void enqueue( const EString & );
+    void read();
+    void write();
+    bool canWrite();
+    uint pendingOutput();
 
     void addMailboxGroup( MailboxGroup * );
     void removeMailboxGroup( MailboxGroup * );
@@ -70,8 +77,12 @@ private:
     class IMAPData *d;
 
     void addCommand();
+    void rejectLiteral( uint );
+    uint queuedInput() const;
+    void resumeInput();
     void runCommands();
     void run( Command * );
+    bool stream();
 };
 
 
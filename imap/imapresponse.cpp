@@ -4,6 +4,7 @@
 
 #include "imapsession.h"
 #include "imap.h"
+#include "estringlist.h"
 
 
 
@@ -145,6 +146,43 @@ EString ImapResponse::text() const
 }
 
 
+/*! Returns the text of the response as a list of strings which are
+    to be sent one after another, or a null pointer if text() should
+    be used instead. The default implementation returns a null pointer.
+
+    IMAP writes the strings bit by bit as the client reads, so a
+    subclass whose response contains large literals can reimplement
+    this to avoid building (and buffering) the entire response at
+    once. As for text(), an empty list means that the response
+    should be discarded.
+*/
+
+EStringList * ImapResponse::textParts() const
+{
+    return 0;
+}
+
+
+/*! This virtual function is called by IMAP when it has written all
+    of \a part, which is one of the strings returned by textParts().
+    A subclass can use it to produce the response piece by piece.
+
+    It returns Done if \a part is finished, More if it has replaced
+    the contents of \a part with more text to be written, and
+    Waiting if there will be more, but not just yet. In the last
+    case, the subclass must call EventLoop::flushSoon() for imap()
+    when there is more, so that IMAP::write() calls refill() again.
+
+    The default implementation returns Done.
+*/
+
+ImapResponse::Refill ImapResponse::refill( EString * part )
+{
+    (void)part;
+    return Done;
+}
+
+
 /*! Returns true if this response has meaning, and false if it may be
     discarded.
 
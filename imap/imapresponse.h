@@ -20,6 +20,10 @@ public:
     virtual void setSent();
 
     virtual EString text() const;
+    virtual class EStringList * textParts() const;
+
+    enum Refill { Done, More, Waiting };
+    virtual Refill refill( EString * );
 
     virtual bool meaningful() const;
     bool changesMsn() const;
@@ -46,6 +46,7 @@ struct MailboxSet
     IntegerSet a;
     IntegerSet h;
     IntegerSet b;
+    IntegerSet w;
     IntegerSet i;
 };
 
@@ -284,10 +285,15 @@ void ImapUrlFetcher::execute()
                     sets.append( s );
                 }
 
-                if ( !it->section || it->section->needsHeader )
-                    s->h.add( uid, uid );
-                if ( !it->section || it->section->needsBody )
-                    s->b.add( uid, uid );
+                if ( !it->section ) {
+                    s->w.add( uid, uid );
+                }
+                else {
+                    if ( it->section->needsHeader )
+                        s->h.add( uid, uid );
+                    if ( it->section->needsBody )
+                        s->b.add( uid, uid );
+                }
             }
 
             ++it;
@@ -295,21 +301,24 @@ void ImapUrlFetcher::execute()
 
         d->state = 4;
 
+        // three passes: messages which need headers, bodies and the
+        // entire RFC 822 form respectively
         List<Message> * al = new List<Message>;
         List<Message> * hl = new List<Message>;
-        List<Message> * bl = 0;
-        bool h = true;
+        List<Message> * bl = new List<Message>;
+        List<Message> * wl = new List<Message>;
         bool needIds = false;
-        while ( !bl ) {
-            if ( !h )
-                bl = new List<Message>;
+        uint pass = 0;
+        while ( pass < 3 ) {
             List<MailboxSet>::Iterator ms( sets );
             while ( ms ) {
                 IntegerSet s;
-                if ( h )
+                if ( pass == 0 )
                     s = ms->h;
-                else
+                else if ( pass == 1 )
                     s = ms->b;
+                else
+                    s = ms->w;
                 while ( !s.isEmpty() ) {
                     uint uid = s.smallest();
                     s.remove( uid );
@@ -318,16 +327,20 @@ void ImapUrlFetcher::execute()
                         ms->i.add( uid );
                         needIds = true;
                     }
-                    if ( h ) {
+                    if ( pass == 0 ) {
                         if ( !m->hasHeaders() )
                             hl->append( m );
                         if ( !m->hasAddresses() )
                             al->append( m );
                     }
-                    else {
-                        if ( m->hasBodies() )
+                    else if ( pass == 1 ) {
+                        if ( !m->hasBodies() )
                             bl->append( m );
                     }
+                    else {
+                        if ( !m->hasRfc822() )
+                            wl->append( m );
+                    }
                     List<UrlLink>::Iterator it( d->urls );
                     while ( it ) {
                         if ( it->mailbox == ms->mailbox &&
@@ -338,7 +351,7 @@ void ImapUrlFetcher::execute()
                 }
                 ++ms;
             }
-            h = false;
+            pass++;
         }
         if ( !al->isEmpty() ) {
             Fetcher * f = new Fetcher( al, this, 0 );
@@ -346,15 +359,20 @@ void ImapUrlFetcher::execute()
             d->fetchers->append( f );
         }
         if ( !hl->isEmpty() ) {
-            Fetcher * f = new Fetcher( al, this, 0 );
+            Fetcher * f = new Fetcher( hl, this, 0 );
             f->fetch( Fetcher::OtherHeader );
             d->fetchers->append( f );
         }
         if ( !bl->isEmpty() ) {
-            Fetcher * f = new Fetcher( al, this, 0 );
+            Fetcher * f = new Fetcher( bl, this, 0 );
             f->fetch( Fetcher::Body );
             d->fetchers->append( f );
         }
+        if ( !wl->isEmpty() ) {
+            Fetcher * f = new Fetcher( wl, this, 0 );
+            f->fetch( Fetcher::Rfc822 );
+            d->fetchers->append( f );
+        }
         if ( needIds ) {
             uint n = 1;
             d->findIds = new Query( "", this );
@@ -307,6 +307,9 @@ EString Bodypart::asText( bool avoidUtf8 ) const
     the correct \a parent. \a divider does not contain the leading or
     trailing hyphens. \a digest is true for multipart/digest and false
     for other types.
+
+    The first bodypart found is numbered \a first (1 by default), so
+    that a caller can parse a multipart a few bodyparts at a time.
 */
 
 void Bodypart::parseMultipart( uint i, uint end,
@@ -314,11 +317,12 @@ void Bodypart::parseMultipart( uint i, uint end,
                                const EString & divider,
                                bool digest,
                                List< Bodypart > * children,
-                               Multipart * parent )
+                               Multipart * parent,
+                               uint first )
 {
     uint start = 0;
     bool last = false;
-    uint pn = 1;
+    uint pn = first;
     while ( !last && i <= end ) {
         if ( i >= end ||
              ( rfc2822[i] == '-' && rfc2822[i+1] == '-' &&
@@ -3,6 +3,7 @@
 #include "fetcher.h"
 
 #include "addressfield.h"
+#include "configuration.h"
 #include "transaction.h"
 #include "integerset.h"
 #include "allocator.h"
@@ -16,12 +17,11 @@
 #include "query.h"
 #include "scope.h"
 #include "timer.h"
+#include "graph.h"
 #include "utf.h"
 #include "map.h"
 #include "log.h"
 
-#include <time.h> // time()
-
 
 enum State { NotStarted, Fetching, Done };
 
@@ -39,10 +39,16 @@ public:
           maxBatchSize( 32768 ),
           batchSize( 0 ),
           uniqueDatabaseIds( true ),
-          lastBatchStarted( 0 ),
+          batchStarted( 0 ), batchLatency( 0 ),
+          batchCount( 0 ), batchBytes( 0 ),
+          drainChecked( 0 ), drainPending( 0 ), drainAdded( 0 ),
+          drainRate( 0 ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
-          partnumbers( 0 ),
+          partnumbers( 0 ), rfc822( 0 ),
+          fallingBack( false ),
+          fallbackAddresses( 0 ), fallbackHeader( 0 ), fallbackBody( 0 ),
+          rfc822Limit( 0 ),
           throttler( 0 )
     {}
 
@@ -57,7 +63,19 @@ public:
     uint maxBatchSize;
     uint batchSize;
     bool uniqueDatabaseIds;
-    uint lastBatchStarted;
+
+    // when the current batch was started (0 when none is running),
+    // and what the last batch cost
+    int64 batchStarted;
+    uint batchLatency;
+    uint batchCount;
+    uint batchBytes;
+
+    // how fast the client reads, in bytes per second
+    int64 drainChecked;
+    uint drainPending;
+    uint drainAdded;
+    uint drainRate;
 
     class Decoder
         : public EventHandler
@@ -82,6 +100,23 @@ public:
     Decoder * body;
     Decoder * trivia;
     Decoder * partnumbers;
+    Decoder * rfc822;
+
+    // while fallingBack, the fallback decoders fetch the parts of
+    // the messages in fallback, which have no stored RFC 822 form
+    bool fallingBack;
+    IntegerSet fallback;
+    Decoder * fallbackAddresses;
+    Decoder * fallbackHeader;
+    Decoder * fallbackBody;
+
+    // stored RFC 822 forms larger than this aren't fetched, only
+    // their sizes (0 means no limit)
+    uint rfc822Limit;
+
+    bool hasStoredSize( Message * m ) const {
+        return rfc822Limit && m->storedRfc822Size( true );
+    }
 
     class TriviaDecoder
         : public Decoder
@@ -134,7 +169,61 @@ public:
         bool isDone( Message * ) const;
     };
 
+    class Rfc822Decoder
+        : public Decoder
+    {
+    public:
+        Rfc822Decoder( FetcherData * fd ): Decoder( fd ) {}
+        void decode( Message *, List<Row> * );
+        void setDone( Message * );
+        bool isDone( Message * ) const;
+    };
+
     Connection * throttler;
+
+    void observeDrain( uint );
+    uint outputLimit() const;
+};
+
+
+static GraphableDataSet * batchSizes = 0;
+static GraphableDataSet * batchLatencies = 0;
+static GraphableNumber * drainRates = 0;
+
+
+// Each batch should take about this many milliseconds, so that the
+// first response is sent quickly and the client is kept busy.
+
+static const uint targetLatency = 500;
+
+
+// True unless rfc822_blobs is known to be empty, in which case Rfc822
+// fetches needn't look there at all.
+
+static bool blobsStored = true;
+static bool blobsChecked = false;
+
+
+class BlobDetector
+    : public EventHandler
+{
+public:
+    BlobDetector(): q( 0 ) {
+        ::blobsChecked = true;
+        setLog( new Log );
+        q = new Query( "select message from rfc822_blobs limit 1", this );
+        q->execute();
+    }
+    void execute() {
+        if ( !q->done() || q->failed() )
+            return;
+        ::blobsStored = q->hasResults();
+        if ( !::blobsStored )
+            log( "No stored RFC 822 forms; assembling all messages",
+                 Log::Debug );
+    }
+
+    Query * q;
 };
 
 
@@ -151,6 +240,14 @@ public:
     an SQL select for them. Typically the select ends with
     "mailbox=$71 and uid in any($72). When the Fetcher isn't useful
     any more, its owner drops it on the floor.
+
+    If asked to fetch Rfc822, the Fetcher first looks for the stored
+    RFC 822 form of each message (see the store-rfc822 configuration
+    variable), and then fetches the addresses, header fields and
+    bodies of the messages which have none, so that
+    Message::rfc822() can assemble those. If store-rfc822 is off and
+    setup() found no stored forms, Rfc822 fetches the addresses,
+    header fields and bodies directly.
 */
 
 
@@ -282,6 +379,10 @@ void Fetcher::start()
         n++;
         what.append( "bytes/lines" );
     }
+    if ( d->rfc822 ) {
+        n++;
+        what.append( "rfc822" );
+    }
 
     if ( n < 1 || d->messages.isEmpty() ) {
         // nothing to do.
@@ -293,14 +394,17 @@ void Fetcher::start()
          what.join( " " ) );
 
     // we'll use two steps. first, we find a good size for the first
-    // batch.
-    d->batchSize = 4096;
+    // batch. it's small, so the first response is sent quickly;
+    // prepareBatch() grows the later ones.
+    d->batchSize = 256;
     if ( d->body )
         d->batchSize = d->batchSize / 2;
     if ( d->otherheader )
         d->batchSize = d->batchSize * 2 / 3;
     if ( d->addresses )
         d->batchSize = d->batchSize * 3 / 4;
+    if ( d->rfc822 && !d->body )
+        d->batchSize = d->batchSize / 2;
 
     d->state = Fetching;
     prepareBatch();
@@ -308,6 +412,27 @@ void Fetcher::start()
 }
 
 
+// Returns an estimate of the number of bytes fetched for \a m, which
+// is also about what the client will be sent.
+
+static uint messageBytes( Message * m )
+{
+    uint n = 64;
+    if ( m->hasHeaders() && m->header() )
+        n += m->header()->fields()->count() * 80;
+    if ( m->hasRfc822() && !m->hasBodies() )
+        n += m->rfc822( false ).length();
+    if ( m->hasBodies() ) {
+        List<Bodypart>::Iterator i( m->allBodyparts() );
+        while ( i ) {
+            n += i->data().length() + i->text().length();
+            ++i;
+        }
+    }
+    return n;
+}
+
+
 /*! Checks whether all queries and decoders are done. When the
     decoders are, then the Fetcher may or may not be. Perhaps it's
     time to start another batch, perhaps it's time to notify the
@@ -318,16 +443,25 @@ void Fetcher::start()
 void Fetcher::waitForEnd()
 {
     List<FetcherData::Decoder> decoders;
-    if ( d->addresses )
-        decoders.append( d->addresses );
-    if ( d->otherheader )
-        decoders.append( d->otherheader );
-    if ( d->body )
-        decoders.append( d->body );
-    if ( d->trivia )
-        decoders.append( d->trivia );
-    if ( d->partnumbers )
-        decoders.append( d->partnumbers );
+    if ( d->fallingBack ) {
+        decoders.append( d->fallbackAddresses );
+        decoders.append( d->fallbackHeader );
+        decoders.append( d->fallbackBody );
+    }
+    else {
+        if ( d->addresses )
+            decoders.append( d->addresses );
+        if ( d->otherheader )
+            decoders.append( d->otherheader );
+        if ( d->body )
+            decoders.append( d->body );
+        if ( d->trivia )
+            decoders.append( d->trivia );
+        if ( d->partnumbers )
+            decoders.append( d->partnumbers );
+        if ( d->rfc822 )
+            decoders.append( d->rfc822 );
+    }
 
     List<FetcherData::Decoder>::Iterator i( decoders );
     while ( i ) {
@@ -344,6 +478,10 @@ void Fetcher::waitForEnd()
             Message * m = li;
             ++li;
 
+            if ( d->fallingBack &&
+                 !d->fallback.contains( m->databaseId() ) )
+                continue;
+
             List<FetcherData::Decoder>::Iterator di( decoders );
             while ( di ) {
                 di->setDone( m );
@@ -352,6 +490,60 @@ void Fetcher::waitForEnd()
         }
     }
 
+    if ( d->fallingBack ) {
+        d->fallingBack = false;
+        d->fallback.clear();
+    }
+    else if ( d->rfc822 ) {
+        // which messages had no stored RFC 822 form?
+        Map< List<Message> >::Iterator fi( d->batch );
+        while ( fi ) {
+            List<Message>::Iterator li( *fi );
+            ++fi;
+            while ( li ) {
+                if ( !li->hasRfc822() && !d->hasStoredSize( li ) &&
+                     li->databaseId() )
+                    d->fallback.add( li->databaseId() );
+                ++li;
+            }
+        }
+        if ( !d->fallback.isEmpty() ) {
+            log( "Assembling " + fn( d->fallback.count() ) +
+                 " messages without stored RFC 822 form", Log::Debug );
+            if ( !d->fallbackAddresses ) {
+                d->fallbackAddresses = new FetcherData::AddressDecoder( d );
+                d->fallbackHeader = new FetcherData::HeaderDecoder( d );
+                d->fallbackBody = new FetcherData::BodyDecoder( d );
+            }
+            d->fallingBack = true;
+            makeQueries();
+            return;
+        }
+    }
+
+    uint added = 0;
+    if ( d->batchStarted ) {
+        d->batchLatency = (uint)( Timer::now() - d->batchStarted );
+        d->batchStarted = 0;
+        d->batchCount = 0;
+        d->batchBytes = 0;
+        Map< List<Message> >::Iterator mi( d->batch );
+        while ( mi ) {
+            List<Message>::Iterator li( *mi );
+            ++mi;
+            while ( li ) {
+                d->batchCount++;
+                d->batchBytes += messageBytes( li );
+                ++li;
+            }
+        }
+        if ( !batchLatencies )
+            batchLatencies = new GraphableDataSet( "fetcher-batch-ms" );
+        batchLatencies->addNumber( d->batchLatency );
+        added = d->batchBytes;
+    }
+    d->observeDrain( added );
+
     if ( d->messages.isEmpty() ) {
         d->state = Done;
         if ( d->transaction )
@@ -362,11 +554,22 @@ void Fetcher::waitForEnd()
         d->throttler = 0;
     }
     else if ( d->throttler &&
-              d->throttler->writeBuffer() &&
-              d->throttler->writeBuffer()->size() > 1024*1024 ) {
-        (void)new Timer( this, 2 );
+              d->throttler->pendingOutput() > d->outputLimit() ) {
+        // wait roughly until the client has read the excess, but
+        // look again soon if we don't know how fast it reads
+        uint excess = d->throttler->pendingOutput() - d->outputLimit();
+        int64 delay = 250;
+        if ( d->drainRate )
+            delay = (int64)excess * 1000 / d->drainRate;
+        if ( delay < 10 )
+            delay = 10;
+        if ( delay > 2000 )
+            delay = 2000;
+        Timer * t = new Timer( this, 0 );
+        t->setTimeout( Timer::now() + delay );
     }
     else {
+        // the next batch is fetched while the owner writes this one
         prepareBatch();
         makeQueries();
     }
@@ -375,43 +578,91 @@ void Fetcher::waitForEnd()
 }
 
 
+/*! Notes how much output the throttling Connection has pending now,
+    and updates the estimate of how fast the client reads. \a added
+    is the number of bytes about to be added to that output.
+*/
+
+void FetcherData::observeDrain( uint added )
+{
+    if ( !throttler )
+        return;
+    int64 now = Timer::now();
+    uint pending = throttler->pendingOutput();
+    if ( drainChecked && now > drainChecked ) {
+        int64 drained = (int64)drainPending + drainAdded - pending;
+        if ( drained < 0 )
+            drained = 0;
+        uint rate = (uint)( drained * 1000 / ( now - drainChecked ) );
+        if ( drainRate )
+            drainRate = (uint)( ( 3 * (int64)drainRate + rate ) / 4 );
+        else
+            drainRate = rate;
+        if ( !drainRates )
+            drainRates = new GraphableNumber( "fetcher-drain-rate" );
+        drainRates->setValue( drainRate );
+    }
+    drainChecked = now;
+    drainPending = pending;
+    drainAdded = added;
+}
+
+
+/*! Returns the amount of pending output beyond which the Fetcher
+    stops fetching, which is about what the client reads in twice the
+    target latency. If the client's speed isn't known yet, 1MB.
+*/
+
+uint FetcherData::outputLimit() const
+{
+    if ( !drainRate )
+        return 1024 * 1024;
+    int64 l = (int64)drainRate * targetLatency * 2 / 1000;
+    if ( l < 256 * 1024 )
+        l = 256 * 1024;
+    if ( l > 16 * 1024 * 1024 )
+        l = 16 * 1024 * 1024;
+    return (uint)l;
+}
+
+
 /*! Messages are fetched in batches, so that we can deliver some rows
-    early on. This function adjusts the size of the batches so we'll
-    get about one batch every 6 seconds, and updates the tables so we
-    have a batch ready for reading.
+    early on. This function adjusts the size of the batches so that
+    each takes about half a second to fetch and, if the client's
+    speed is known, so that each holds about as much as the client
+    reads in that time. Then it updates the tables so we have a batch
+    ready for reading.
 */
 
 
 void Fetcher::prepareBatch()
 {
-    uint now = (uint)time( 0 );
-    if ( d->lastBatchStarted ) {
+    if ( d->batchCount ) {
         uint prevBatchSize = d->batchSize;
-        if ( now == d->lastBatchStarted ) {
-            // if we took zero time, let's do a small batch size
-            // increase, because that's suspiciously fast.
-            d->batchSize = d->batchSize * 2;
-        }
-        else if ( now < d->lastBatchStarted ) {
-            // if time went backwards we're very, very careful.
-            d->batchSize = 128;
-        }
-        else {
-            // we adjust the batch size so the next batch could take
-            // something in the approximate region of 6 seconds.
-            uint diff = now - d->lastBatchStarted;
-            d->batchSize = d->batchSize * 6 / diff;
-        }
+        uint ms = d->batchLatency;
+        if ( ms < 1 )
+            ms = 1;
+
+        // aim for the target latency, assuming the same rate
+        d->batchSize = (uint)( (int64)d->batchCount * targetLatency / ms );
 
         // the batch size can't increase too much
-        if ( d->batchSize > prevBatchSize * 3 )
-            d->batchSize = prevBatchSize * 3;
-        if ( d->batchSize > prevBatchSize + 2000 )
-            d->batchSize = prevBatchSize + 2000;
+        if ( d->batchSize > prevBatchSize * 4 )
+            d->batchSize = prevBatchSize * 4;
+
+        // and a batch shouldn't hold much more than what the client
+        // reads in the same time, which is more than enough to keep
+        // it busy while the next batch is being fetched
+        if ( d->batchBytes ) {
+            uint perMessage = d->batchBytes / d->batchCount + 1;
+            uint bytes = d->outputLimit();
+            if ( d->batchSize > bytes / perMessage )
+                d->batchSize = bytes / perMessage;
+        }
 
         // and we generally don't want it to be too large or small
-        if ( d->batchSize < 128 )
-            d->batchSize = 128;
+        if ( d->batchSize < 16 )
+            d->batchSize = 16;
         if ( d->batchSize > d->maxBatchSize )
             d->batchSize = d->maxBatchSize;
 
@@ -427,18 +678,24 @@ void Fetcher::prepareBatch()
         uint perMessage = 40 * 1024;
         if ( d->transaction || Database::numHandles() < 2 )
             perMessage = 80 * 1024;
-        uint batchSizeLimit = ( limit - already ) / perMessage;
+        uint batchSizeLimit = 32;
+        if ( limit > already )
+            batchSizeLimit = ( limit - already ) / perMessage;
         if ( batchSizeLimit < 32 )
             batchSizeLimit = 32; // just sanity, shouldn't actually hit
         if ( d->batchSize > batchSizeLimit )
             d->batchSize = batchSizeLimit;
 
         if ( prevBatchSize != d->batchSize )
-            log( "Batch time was " + fn ( now - d->lastBatchStarted ) +
-                 " for " + fn( prevBatchSize ) + " messages, adjusting to " +
-                 fn( d->batchSize ), Log::Debug );
+            log( "Batch time was " + fn( d->batchLatency ) + "ms for " +
+                 fn( d->batchCount ) + " messages (" +
+                 EString::humanNumber( d->batchBytes ) +
+                 "), adjusting to " + fn( d->batchSize ), Log::Debug );
     }
-    d->lastBatchStarted = now;
+    d->batchStarted = Timer::now();
+    if ( !batchSizes )
+        batchSizes = new GraphableDataSet( "fetcher-batch-size" );
+    batchSizes->addNumber( d->batchSize );
 
     // Find out which messages we're going to fetch, and fill in the
     // batch array so we can tie responses to the Message objects.
@@ -496,7 +753,14 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
                 if ( m->hasTrivia() )
                     need = false;
                 break;
+            case Rfc822:
+                if ( m->hasRfc822() || d->hasStoredSize( m ) )
+                    need = false;
+                break;
             }
+            if ( d->fallingBack &&
+                 !d->fallback.contains( m->databaseId() ) )
+                need = false;
             if ( need && m->databaseId() )
                 l.add( m->databaseId() );
         }
@@ -505,6 +769,57 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
 }
 
 
+// Returns a new Query to fetch data of type \a t for \a owner. The
+// caller binds the message IDs to $1.
+
+static Query * fetchQuery( Fetcher::Type t, EventHandler * owner )
+{
+    switch ( t ) {
+    case Fetcher::Addresses:
+        return new Query( "select af.message, "
+                          "af.part, af.position, af.field, af.number, "
+                          "a.name, a.localpart::text, a.domain::text "
+                          "from address_fields af "
+                          "join addresses a on (af.address=a.id) "
+                          "where af.message=any($1) "
+                          "order by af.message, af.part, af.field, "
+                          "af.number",
+                          owner );
+    case Fetcher::OtherHeader:
+        return new Query( "select hf.message, hf.part, hf.position, "
+                          "fn.name, hf.value from header_fields hf "
+                          "join field_names fn on (hf.field=fn.id) "
+                          "where hf.message=any($1) "
+                          "order by hf.message, hf.part",
+                          owner );
+    case Fetcher::Body:
+        return new Query( "select pn.message, pn.part, bp.text, bp.data, "
+                          "bp.bytes as rawbytes, pn.bytes, pn.lines "
+                          "from part_numbers pn "
+                          "left join bodyparts bp on (pn.bodypart=bp.id) "
+                          "where pn.message=any($1) "
+                          "order by pn.message, pn.part",
+                          owner );
+    case Fetcher::PartNumbers:
+        return new Query( "select message, part, bytes, lines "
+                          "from part_numbers where message=any($1) "
+                          "order by message, part",
+                          owner );
+    case Fetcher::Trivia:
+        // don't need to order this - just one row per message
+        return new Query( "select id as message, idate, rfc822size, "
+                          "thread_root "
+                          "from messages where id=any($1)", owner );
+    case Fetcher::Rfc822:
+        // one row per message, too
+        return new Query( "select message, data, utf8 "
+                          "from rfc822_blobs where message=any($1)",
+                          owner );
+    }
+    return 0;
+}
+
+
 /*! Issues the necessary selects to retrieve data and feed the
     decoders. This function does some optimisation of the generated
     SQL.
@@ -512,73 +827,89 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
 
 void Fetcher::makeQueries()
 {
-    EStringList wanted;
-    wanted.append( "mailbox" );
-    wanted.append( "uid" );
-    wanted.append( "message" );
-
     Query * q = 0;
-    EString r;
+
+    if ( d->fallingBack ) {
+        q = fetchQuery( Addresses, d->fallbackAddresses );
+        bindIds( q, 1, Addresses );
+        submit( q );
+        d->fallbackAddresses->q = q;
+
+        q = fetchQuery( OtherHeader, d->fallbackHeader );
+        bindIds( q, 1, OtherHeader );
+        submit( q );
+        d->fallbackHeader->q = q;
+
+        q = fetchQuery( Body, d->fallbackBody );
+        bindIds( q, 1, Body );
+        submit( q );
+        d->fallbackBody->q = q;
+
+        if ( d->transaction )
+            d->transaction->execute();
+        return;
+    }
 
     if ( d->partnumbers && !d->body ) {
         // body (below) will handle this as a side effect
-        q = new Query( "select message, part, bytes, lines "
-                       "from part_numbers where message=any($1) "
-                       "order by message, part",
-                       d->partnumbers );
+        q = fetchQuery( PartNumbers, d->partnumbers );
         bindIds( q, 1, PartNumbers );
         submit( q );
         d->partnumbers->q = q;
     }
 
     if ( d->trivia ) {
-        // don't need to order this - just one row per message
-        q = new Query( "select id as message, idate, rfc822size, thread_root "
-                       "from messages where id=any($1)", d->trivia );
+        q = fetchQuery( Trivia, d->trivia );
         bindIds( q, 1, Trivia );
         submit( q );
         d->trivia->q = q;
     }
 
     if ( d->addresses ) {
-        q = new Query( "select af.message, "
-                       "af.part, af.position, af.field, af.number, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from address_fields af "
-                       "join addresses a on (af.address=a.id) "
-                       "where af.message=any($1) "
-                       "order by af.message, af.part, af.field, af.number",
-                       d->addresses );
+        q = fetchQuery( Addresses, d->addresses );
         bindIds( q, 1, Addresses );
         submit( q );
         d->addresses->q = q;
     }
 
     if ( d->otherheader ) {
-        q = new Query( "select hf.message, hf.part, hf.position, "
-                       "fn.name, hf.value from header_fields hf "
-                       "join field_names fn on (hf.field=fn.id) "
-                       "where hf.message=any($1) "
-                       "order by hf.message, hf.part",
-                       d->otherheader );
+        q = fetchQuery( OtherHeader, d->otherheader );
         bindIds( q, 1, OtherHeader );
         submit( q );
         d->otherheader->q = q;
     }
 
     if ( d->body ) {
-        q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
-                       "bp.bytes as rawbytes, pn.bytes, pn.lines "
-                       "from part_numbers pn "
-                       "left join bodyparts bp on (pn.bodypart=bp.id) "
-                       "where pn.message=any($1) "
-                       "order by pn.message, pn.part",
-                       d->body );
+        q = fetchQuery( Body, d->body );
         bindIds( q, 1, Body );
         submit( q );
         d->body->q = q;
     }
 
+    if ( d->rfc822 && d->rfc822Limit ) {
+        // large forms without NULs can be sent piece by piece, so
+        // only their sizes are fetched
+        q = new Query( "select message, "
+                       "case when big then null else data end as data, "
+                       "case when big then null else utf8 end as utf8, "
+                       "bytes, utf8_bytes as utf8bytes "
+                       "from (select message, data, utf8, bytes, "
+                       "utf8_bytes, greatest(bytes,utf8_bytes)>$2 "
+                       "and not has_nul as big "
+                       "from rfc822_blobs where message=any($1)) b",
+                       d->rfc822 );
+        bindIds( q, 1, Rfc822 );
+        q->bind( 2, d->rfc822Limit );
+        submit( q );
+        d->rfc822->q = q;
+    }
+    else if ( d->rfc822 ) {
+        q = fetchQuery( Rfc822, d->rfc822 );
+        bindIds( q, 1, Rfc822 );
+        submit( q );
+        d->rfc822->q = q;
+    }
+
     if ( d->transaction )
         d->transaction->execute();
 }
@@ -846,6 +1177,49 @@ bool FetcherData::TriviaDecoder::isDone( Message * m ) const
 }
 
 
+void FetcherData::Rfc822Decoder::decode( Message * m , List<Row> * rows )
+{
+    Row * r = rows->firstElement();
+    if ( r->isNull( "data" ) ) {
+        m->setStoredRfc822Size( r->getInt( "bytes" ),
+                                r->getInt( "utf8bytes" ) );
+        return;
+    }
+    EString data = r->getEString( "data" );
+    if ( r->isNull( "utf8" ) )
+        m->setRfc822( data, data );
+    else
+        m->setRfc822( data, r->getEString( "utf8" ) );
+}
+
+
+void FetcherData::Rfc822Decoder::setDone( Message * )
+{
+    // messages without a stored form are assembled later
+}
+
+
+bool FetcherData::Rfc822Decoder::isDone( Message * m ) const
+{
+    return m->hasRfc822() || d->hasStoredSize( m );
+}
+
+
+/*! Checks once whether any message has a stored RFC 822 form, unless
+    store-rfc822 is on. fetch() calls setup() when it's needed, so
+    Fetcher can be used without calling it first. Until the check is
+    done, Rfc822 fetches look for stored forms.
+*/
+
+void Fetcher::setup()
+{
+    if ( Configuration::toggle( Configuration::StoreRfc822 ) )
+        ::blobsChecked = true;
+    if ( !::blobsChecked )
+        (void)new BlobDetector;
+}
+
+
 /*! Instructs this Fetcher to fetch data of type \a t. */
 
 void Fetcher::fetch( Type t )
@@ -873,10 +1247,33 @@ void Fetcher::fetch( Type t )
         if ( !d->partnumbers )
             d->partnumbers = new FetcherData::PartNumberDecoder( d );
         break;
+    case Rfc822:
+        setup();
+        if ( !::blobsStored ) {
+            fetch( Addresses );
+            fetch( OtherHeader );
+            fetch( Body );
+        }
+        else if ( !d->rfc822 ) {
+            d->rfc822 = new FetcherData::Rfc822Decoder( d );
+        }
+        break;
     }
 }
 
 
+/*! Instructs this Fetcher to fetch only the sizes of stored RFC 822
+    forms larger than \a n bytes (see Message::setStoredRfc822Size()),
+    instead of the forms themselves. Forms containing NUL bytes are
+    always fetched. The default, 0, is to fetch all forms.
+*/
+
+void Fetcher::setRfc822Limit( uint n )
+{
+    d->rfc822Limit = n;
+}
+
+
 /*! Returns true if this Fetcher will fetch (or is fetching) data of
     type \a t. Returns false until fetch() has been called for \a t.
 */
@@ -899,6 +1296,9 @@ bool Fetcher::fetching( Type t ) const
     case PartNumbers:
         return d->partnumbers != 0;
         break;
+    case Rfc822:
+        return d->rfc822 != 0;
+        break;
     }
     return false; // not reached
 }
@@ -29,7 +29,8 @@ public:
         OtherHeader,
         Body,
         PartNumbers,
-        Trivia
+        Trivia,
+        Rfc822
     };
 
     void addMessage( Message * );
@@ -37,6 +38,7 @@ public:
 
     void fetch( Type );
     bool fetching( Type ) const;
+    void setRfc822Limit( uint );
 
     void execute();
 
@@ -44,6 +46,8 @@ public:
 
     void setTransaction( class Transaction * );
 
+    static void setup();
+
 private:
     class FetcherData * d;
 
@@ -23,12 +23,16 @@
 #include "session.h"
 #include "scope.h"
 #include "graph.h"
+#include "trigrams.h"
+#include "integerset.h"
 #include "html.h"
 #include "md5.h"
 #include "utf.h"
 #include "log.h"
 #include "dsn.h"
 
+#include <time.h>
+
 
 static GraphableCounter * successes;
 static GraphableCounter * failures;
@@ -38,7 +42,7 @@ struct BodypartRow
     : public Garbage
 {
     BodypartRow()
-        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 )
+        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 ), created( false )
     {}
 
     uint id;
@@ -46,6 +50,7 @@ struct BodypartRow
     EString * text;
     EString * data;
     uint bytes;
+    bool created;
     List<Bodypart> bodyparts;
 };
 
@@ -77,7 +82,7 @@ public:
           mailboxesCreated( 0 ),
           fieldNameCreator( 0 ), flagCreator( 0 ), annotationNameCreator( 0 ),
           lockUidnext( 0 ), select( 0 ), insert( 0 ),
-          substate( 0 ), subtransaction( 0 ),
+          substate( 0 ), subtransaction( 0 ), spooled( 0 ),
           findParents( 0 ), findReferences( 0 ),
           findBlah( 0 ), findMessagesInOutlookThreads( 0 ),
           threads( 0 )
@@ -138,6 +143,7 @@ public:
 
     Dict<BodypartRow> hashes;
     List<BodypartRow> bodyparts;
+    Query * spooled;
 
     // for convertInReplyTo()
     Dict< List<Message> > outlooks;
@@ -1125,12 +1131,47 @@ void Injector::insertBodyparts()
     do {
         last = d->substate;
 
+        if ( d->substate == 0 && !d->spooled ) {
+            // Bodyparts stored in advance by a BodypartSpooler have no
+            // part_numbers yet. aox vacuum leaves new ones alone, but
+            // one may have reused an old, unused row, so we check that
+            // each still exists and store the rest again.
+            IntegerSet ids;
+            List<Injectee>::Iterator it( d->messages );
+            while ( it ) {
+                List<Bodypart>::Iterator bi( it->allBodyparts() );
+                while ( bi ) {
+                    if ( bi->id() )
+                        ids.add( bi->id() );
+                    ++bi;
+                }
+                ++it;
+            }
+            if ( !ids.isEmpty() ) {
+                d->spooled = new Query( "select id from bodyparts "
+                                        "where id=any($1)", this );
+                d->spooled->bind( 1, ids );
+                d->transaction->enqueue( d->spooled );
+                d->transaction->execute();
+            }
+        }
+
         if ( d->substate == 0 ) {
+            IntegerSet stored;
+            if ( d->spooled ) {
+                if ( !d->spooled->done() )
+                    return;
+                while ( d->spooled->hasResults() )
+                    stored.add( d->spooled->nextRow()->getInt( "id" ) );
+            }
+
             List<Injectee>::Iterator it( d->messages );
             while ( it ) {
                 Message * m = it;
                 List<Bodypart>::Iterator bi( m->allBodyparts() );
                 while ( bi ) {
+                    if ( bi->id() && !stored.contains( bi->id() ) )
+                        bi->setId( 0 );
                     addBodypartRow( bi );
                     ++bi;
                 }
@@ -1221,7 +1262,7 @@ void Injector::insertBodyparts()
                 d->substate++;
                 d->subtransaction->commit();
                 d->select =
-                    new Query( "select bid from bp order by i", this );
+                    new Query( "select bid,n from bp order by i", this );
                 d->transaction->enqueue( d->select );
                 d->transaction->enqueue( new Query( "drop table bp", 0 ) );
                 d->transaction->execute();
@@ -1237,6 +1278,8 @@ void Injector::insertBodyparts()
                 BodypartRow * br = bi;
                 Row * r = d->select->nextRow();
                 uint id = r->getInt( "bid" );
+                br->id = id;
+                br->created = r->getBoolean( "n" );
 
                 List<Bodypart>::Iterator it( br->bodyparts );
                 while ( it ) {
@@ -1253,6 +1296,7 @@ void Injector::insertBodyparts()
 
     d->select = 0;
     d->insert = 0;
+    d->spooled = 0;
     next();
 }
 
@@ -1270,9 +1314,11 @@ Query * Injector::selectNextvals( const EString & sequence, uint num )
 }
 
 
-/*! Adds \a b to the list of bodyparts if it's not there already. */
+// Returns a BodypartRow describing what the bodyparts table stores
+// for \a b, or a null pointer if nothing needs to be stored. The row's
+// bodyparts list is left empty.
 
-void Injector::addBodypartRow( Bodypart * b )
+static BodypartRow * bodypartRow( Bodypart * b )
 {
     bool storeText = false;
     bool storeData = false;
@@ -1299,12 +1345,11 @@ void Injector::addBodypartRow( Bodypart * b )
     }
 
     if ( !( storeText || storeData ) )
-        return;
+        return 0;
 
     // Yes. What exactly do we need to store?
 
     EString * s;
-    EString hash;
     EString * text = 0;
     EString * data = 0;
     PgUtf8Codec u;
@@ -1326,28 +1371,209 @@ void Injector::addBodypartRow( Bodypart * b )
     else {
         data = s = new EString( b->data() );
     }
-    hash = MD5::hash( *s ).hex();
+
+    BodypartRow * br = new BodypartRow;
+    br->hash = MD5::hash( *s ).hex();
+    br->text = text;
+    br->data = data;
+    br->bytes = b->numBytes();
+    return br;
+}
+
+
+/*! Adds \a b to the list of bodyparts if it's not there already.
+    Does nothing if \a b already has an id, as it does when a
+    BodypartSpooler stored it while the message was arriving. */
+
+void Injector::addBodypartRow( Bodypart * b )
+{
+    if ( b->id() )
+        return;
+
+    BodypartRow * row = bodypartRow( b );
+    if ( !row )
+        return;
 
     // And where does it fit in the list of bodyparts we know already?
     // Either we've seen it before (in which case we add it to the list
     // of bodyparts in the appropriate BodypartRow entry), or we haven't
     // (in which case we add a new BodypartRow).
 
-    BodypartRow * br = d->hashes.find( hash );
+    BodypartRow * br = d->hashes.find( row->hash );
 
     if ( !br ) {
-        br = new BodypartRow;
-        br->hash = hash;
-        br->text = text;
-        br->data = data;
-        br->bytes = b->numBytes();
-        d->hashes.insert( hash, br );
+        br = row;
+        d->hashes.insert( br->hash, br );
         d->bodyparts.append( br );
     }
     br->bodyparts.append( b );
 }
 
 
+class BodypartSpoolerData
+    : public Garbage
+{
+public:
+    BodypartSpoolerData(): owner( 0 ) {}
+
+    struct Spool
+        : public Garbage
+    {
+        Spool( BodypartRow * r, Query * q )
+            : Garbage(), row( r ), query( q ) {}
+
+        BodypartRow * row;
+        Query * query;
+    };
+
+    EventHandler * owner;
+    Dict<BodypartRow> hashes;
+    List<Spool> spools;
+};
+
+
+/*! \class BodypartSpooler injector.h
+    Stores bodyparts in the database before the rest of their message.
+
+    SmtpData uses this to store each bodypart as soon as it has been
+    received, so that a large message needn't be kept whole until
+    injection. The caller add()s each Bodypart; BodypartSpooler hashes
+    it, stores it in the bodyparts table unless an identical row is
+    there already, and sets the Bodypart's id. The Injector only links
+    to bodyparts that have an id.
+
+    Each bodypart is stored using a single statement, so a bodypart
+    and its trigrams are stored together or not at all. New rows are
+    marked with bodyparts.spooled_at, and aox vacuum leaves them alone
+    for a day even though no part_numbers refer to them. If the
+    message is never injected, vacuum removes them after that. If a
+    statement fails, the bodypart keeps id 0 and the Injector stores
+    it in the usual way, as it does with any that vacuum removed.
+*/
+
+
+/*! Constructs an empty BodypartSpooler, which notifies \a owner
+    whenever it is done() with all bodyparts added so far. */
+
+BodypartSpooler::BodypartSpooler( EventHandler * owner )
+    : d( new BodypartSpoolerData )
+{
+    d->owner = owner;
+}
+
+
+/*! Starts storing \a b and all its descendants, except those that
+    have no stored form (such as multipart containers). */
+
+void BodypartSpooler::add( Bodypart * b )
+{
+    List<Bodypart>::Iterator it( b->children() );
+    while ( it ) {
+        add( it );
+        ++it;
+    }
+
+    if ( b->id() )
+        return;
+
+    BodypartRow * row = bodypartRow( b );
+    if ( !row )
+        return;
+
+    BodypartRow * br = d->hashes.find( row->hash );
+    if ( br ) {
+        if ( br->id )
+            b->setId( br->id );
+        else
+            br->bodyparts.append( b );
+        return;
+    }
+
+    br = row;
+    br->bodyparts.append( b );
+    d->hashes.insert( br->hash, br );
+
+    IntegerSet t;
+    if ( br->text )
+        Trigrams::add( t, *br->text );
+
+    Query * q =
+        new Query( "with old as ("
+                   "select id from bodyparts where hash=$2::text "
+                   "and not text is distinct from $3::text "
+                   "and not data is distinct from $4::bytea limit 1"
+                   "), new as ("
+                   "insert into bodyparts "
+                   "(id,bytes,hash,text,data,spooled_at) "
+                   "select nextval('bodypart_ids')::int,"
+                   "$1::int,$2::text,$3::text,$4::bytea,"
+                   "current_timestamp "
+                   "where not exists (select id from old) "
+                   "returning id"
+                   "), trigrams as ("
+                   "insert into bodypart_trigrams (bodypart,trigrams) "
+                   "select new.id,$5::int[] from new "
+                   "where array_length($5::int[],1)>0"
+                   ") "
+                   "select id from old union all select id from new",
+                   this );
+    q->bind( 1, br->bytes );
+    q->bind( 2, br->hash );
+    if ( br->text )
+        q->bind( 3, *br->text );
+    else
+        q->bindNull( 3 );
+    if ( br->data )
+        q->bind( 4, *br->data, Query::Binary );
+    else
+        q->bindNull( 4 );
+    q->bind( 5, t );
+    q->execute();
+
+    // the query has its own copy of the stored form, so the row
+    // needn't keep one while the rest of the message arrives.
+    br->text = 0;
+    br->data = 0;
+
+    d->spools.append( new BodypartSpoolerData::Spool( br, q ) );
+}
+
+
+/*! Sets the ids of the bodyparts whose statements have completed, and
+    notifies the owner once all have. */
+
+void BodypartSpooler::execute()
+{
+    bool any = false;
+    while ( !d->spools.isEmpty() &&
+            d->spools.firstElement()->query->done() ) {
+        BodypartSpoolerData::Spool * s = d->spools.shift();
+        Row * r = s->query->nextRow();
+        if ( r ) {
+            s->row->id = r->getInt( "id" );
+            List<Bodypart>::Iterator it( s->row->bodyparts );
+            while ( it ) {
+                it->setId( s->row->id );
+                ++it;
+            }
+        }
+        any = true;
+    }
+
+    if ( any && d->spools.isEmpty() && d->owner )
+        d->owner->notify();
+}
+
+
+/*! Returns true if all bodyparts add()ed so far have been stored (or
+    have failed to be stored), and false if any are still pending. */
+
+bool BodypartSpooler::done() const
+{
+    return d->spools.isEmpty();
+}
+
+
 /*! This function inserts rows into the messages table for each Message
     in d->messages, and updates the objects with the newly-created ids.
     It expects to be called repeatedly until it returns true, which it
@@ -1550,23 +1776,68 @@ void Injector::insertMessages()
     Query * qw =
         new Query( "copy unparsed_messages (bodypart) "
                    "from stdin with binary", 0 );
+    Query * qt =
+        new Query( "copy bodypart_trigrams (bodypart,trigrams) "
+                   "from stdin with binary", 0 );
+    Query * qg =
+        new Query( "copy header_trigrams (message,trigrams) "
+                   "from stdin with binary", 0 );
+    Query * qr =
+        new Query( "copy thread_members "
+                   "(message,messageid,parentid,refs,subject) "
+                   "from stdin with binary", 0 );
+    Query * qk =
+        new Query( "copy sort_keys "
+                   "(message,arrival,sent,size,subject,"
+                   "from_mailbox,to_mailbox,cc_mailbox,"
+                   "display_from,display_to) "
+                   "from stdin with binary", 0 );
+    Query * qb =
+        new Query( "copy rfc822_blobs "
+                   "(message,bytes,utf8_bytes,has_nul,data,utf8) "
+                   "from stdin with binary", 0 );
+    bool storeRfc822 = Configuration::toggle( Configuration::StoreRfc822 );
+    IntegerSet threaded;
 
     uint flags = 0;
     uint wrapped = 0;
     uint mailboxes = 0;
     uint annotations = 0;
+    uint trigrams = 0;
 
     List<Injectee>::Iterator it( d->messages );
     while ( it ) {
         Message * m = it;
         uint mid = m->databaseId();
+        IntegerSet t;
+
+        addThreadMember( qr, mid, m->header() );
+        threaded.add( mid );
+        addSortKey( qk, m );
+        if ( storeRfc822 ) {
+            EString ascii = m->rfc822( true );
+            EString utf8 = m->rfc822( false );
+            // Fetch streams large forms in ranges unless they
+            // contain NULs, which need literal8
+            bool nul = ascii.find( '\0' ) >= 0 || utf8.find( '\0' ) >= 0;
+            qb->bind( 1, mid );
+            qb->bind( 2, ascii.length() );
+            qb->bind( 3, utf8.length() );
+            qb->bind( 4, nul );
+            qb->bind( 5, ascii );
+            if ( utf8 == ascii )
+                qb->bindNull( 6 );
+            else
+                qb->bind( 6, utf8 );
+            qb->submitLine();
+        }
 
         // The top-level RFC 822 header fields are linked to a special
         // part named "" that does not correspond to any entry in the
         // bodyparts table.
 
         addPartNumber( qp, mid, "" );
-        addHeader( qh, qa, qd, mid, "", m->header() );
+        addHeader( qh, qa, qd, mid, "", m->header(), t );
 
         // Since the MIME header fields belonging to the first-child of
         // a single-part Message are appended to the RFC 822 header, we
@@ -1593,7 +1864,7 @@ void Injector::insertMessages()
 
             addPartNumber( qp, mid, pn, b );
             if ( !skip )
-                addHeader( qh, qa, qd, mid, pn, b->header() );
+                addHeader( qh, qa, qd, mid, pn, b->header(), t );
             else
                 skip = false;
 
@@ -1602,7 +1873,8 @@ void Injector::insertMessages()
             if ( b->message() ) {
                 EString rpn( pn + ".rfc822" );
                 addPartNumber( qp, mid, rpn, b );
-                addHeader( qh, qa, qd, mid, rpn, b->message()->header() );
+                addHeader( qh, qa, qd, mid, rpn, b->message()->header(),
+                           t );
             }
 
             // If the message we're injecting is a wrapper around a
@@ -1620,9 +1892,36 @@ void Injector::insertMessages()
             m->children()->prepend( bp );
         }
 
+        if ( !t.isEmpty() ) {
+            qg->bind( 1, mid );
+            qg->bind( 2, t );
+            qg->submitLine();
+            trigrams++;
+        }
+
         ++it;
     }
 
+    // Only the bodyparts we created need trigrams; the others have
+    // them already.
+
+    uint bodypartTrigrams = 0;
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi ) {
+        BodypartRow * br = bi;
+        if ( br->created && br->text ) {
+            IntegerSet t;
+            Trigrams::add( t, *br->text );
+            if ( !t.isEmpty() ) {
+                qt->bind( 1, br->id );
+                qt->bind( 2, t );
+                qt->submitLine();
+                bodypartTrigrams++;
+            }
+        }
+        ++bi;
+    }
+
     List<Injectee>::Iterator imi( d->injectables );
     while ( imi ) {
         Injectee * m = imi;
@@ -1656,6 +1955,166 @@ void Injector::insertMessages()
         d->transaction->enqueue( qn );
     if ( wrapped )
         d->transaction->enqueue( qw );
+    if ( trigrams )
+        d->transaction->enqueue( qg );
+    if ( bodypartTrigrams )
+        d->transaction->enqueue( qt );
+    if ( !d->messages.isEmpty() ) {
+        d->transaction->enqueue( qk );
+        if ( storeRfc822 )
+            d->transaction->enqueue( qb );
+    }
+
+    if ( !threaded.isEmpty() ) {
+        // link the new messages to their parents, and earlier
+        // messages to any parents which have just arrived. these are
+        // two queries so that each can start from an index.
+        Query * children =
+            new Query( "update thread_members c set parent=p.message "
+                       "from thread_members p "
+                       "where c.message=any($1) and c.parent is null "
+                       "and p.messageid=c.parentid "
+                       "and p.message!=c.message", 0 );
+        children->bind( 1, threaded );
+        Query * parents =
+            new Query( "update thread_members c set parent=p.message "
+                       "from thread_members p "
+                       "where p.message=any($1) and c.parent is null "
+                       "and c.parentid=p.messageid "
+                       "and c.message!=p.message", 0 );
+        parents->bind( 1, threaded );
+        d->transaction->enqueue( qr );
+        d->transaction->enqueue( children );
+        d->transaction->enqueue( parents );
+    }
+}
+
+
+/*! Adds a thread_members row for the message with id \a mid and
+    header \a h to \a q. The parent is filled in by insertMessages(),
+    since it may be in the database already, part of this injection or
+    still to come.
+*/
+
+void Injector::addThreadMember( Query * q, uint mid, Header * h )
+{
+    q->bind( 1, mid );
+
+    EString id = h->messageId();
+    if ( id.isEmpty() )
+        q->bindNull( 2 );
+    else
+        q->bind( 2, id );
+
+    EString parent;
+    EString refs;
+    HeaderField * r = h->field( HeaderField::References );
+    if ( r ) {
+        refs = r->rfc822( false );
+        int lt = refs.length();
+        while ( lt > 0 && refs[lt-1] != '<' )
+            lt--;
+        int gt = refs.find( '>', lt );
+        if ( lt > 0 && gt > lt )
+            parent = refs.mid( lt - 1, gt + 2 - lt );
+    }
+    if ( parent.isEmpty() )
+        q->bindNull( 3 );
+    else
+        q->bind( 3, parent );
+
+    if ( refs.isEmpty() )
+        q->bindNull( 4 );
+    else
+        q->bind( 4, refs );
+
+    HeaderField * s = h->field( HeaderField::Subject );
+    if ( s )
+        q->bind( 5, s->value() );
+    else
+        q->bindNull( 5 );
+
+    q->submitLine();
+}
+
+
+/*! Returns the sort key for the mailbox of the first address in
+    the \a t field of \a h, or the display name/address if \a display
+    is true. Returns an empty string if there is no such address.
+*/
+
+static UString addressKey( Header * h, HeaderField::Type t, bool display )
+{
+    UString r;
+    List<Address> * l = h->addresses( t );
+    if ( !l || l->isEmpty() )
+        return r;
+    Address * a = l->first();
+    if ( display && !a->uname().isEmpty() ) {
+        r = a->uname();
+    }
+    else {
+        r = a->localpart();
+        if ( display ) {
+            r.append( "@" );
+            r.append( a->domain() );
+        }
+    }
+    return r.titlecased();
+}
+
+
+/*! Returns \a date as seconds since the epoch. Unlike
+    Date::unixTime(), this works for dates before 1970 and after 2038.
+*/
+
+static int64 sortTime( Date * date )
+{
+    struct tm t;
+    t.tm_mday = date->day();
+    t.tm_mon = date->month() - 1;
+    t.tm_year = date->year() - 1900;
+    t.tm_hour = date->hour();
+    t.tm_min = date->minute();
+    t.tm_sec = date->second();
+    t.tm_isdst = 0;
+    return (int64)timegm( &t ) - date->offset() * 60;
+}
+
+
+/*! Adds a sort_keys row for \a m to \a q. The text keys are
+    titlecased so that SORT can compare them as they are, and
+    missing keys are stored as empty strings, which sort first as
+    RFC 5256 requires.
+*/
+
+void Injector::addSortKey( Query * q, Message * m )
+{
+    Header * h = m->header();
+    uint arrival = internalDate( m );
+
+    q->bind( 1, m->databaseId() );
+    q->bind( 2, (int64)arrival );
+    Date * date = h->date();
+    if ( date && date->valid() )
+        q->bind( 3, sortTime( date ) );
+    else
+        q->bind( 3, (int64)arrival );
+    q->bind( 4, m->rfc822Size() );
+
+    HeaderField * s = h->field( HeaderField::Subject );
+    if ( s )
+        q->bind( 5, Message::baseSubject( s->value() ) );
+    else
+        q->bind( 5, "" );
+
+    q->bind( 6, addressKey( h, HeaderField::From, false ) );
+    q->bind( 7, addressKey( h, HeaderField::To, false ) );
+    q->bind( 8, addressKey( h, HeaderField::Cc, false ) );
+    q->bind( 9, addressKey( h, HeaderField::From, true ) );
+    q->bind( 10, addressKey( h, HeaderField::To, true ) );
+
+    q->submitLine();
 }
 
 
@@ -1690,12 +2149,15 @@ void Injector::addPartNumber( Query * q, uint mid, const EString &part,
 
 /*! Add each field from the header \a h (belonging to the given \a part
     of the message with id \a mid) to one of the queries \a qh, \a qa,
-    or \a qd, depending on their type.
+    or \a qd, depending on their type. The trigrams of the fields
+    added to \a qh are added to \a trigrams.
 */
 
 void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
-                          const EString & part, Header * h )
+                          const EString & part, Header * h,
+                          IntegerSet & trigrams )
 {
+    PgUtf8Codec u;
     List< HeaderField >::Iterator it( h->fields() );
     while ( it ) {
         HeaderField * hf = it;
@@ -1729,6 +2191,7 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
             qh->bind( 4, t );
             qh->bind( 5, hf->value() );
             qh->submitLine();
+            Trigrams::add( trigrams, u.fromUnicode( hf->value() ) );
 
             if ( part.isEmpty() && hf->type() == HeaderField::Date ) {
                 DateField * df = (DateField *)hf;
@@ -87,7 +87,10 @@ private:
     void insertMessages();
     void insertDeliveries();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
-    void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
+    void addHeader( Query *, Query *, Query *, uint, const EString &, Header *,
+                    class IntegerSet & );
+    void addThreadMember( Query *, uint, Header * );
+    void addSortKey( Query *, Message * );
     void addMailbox( Query *, Injectee *, Mailbox * );
     uint addFlags( Query *, Injectee *, Mailbox * );
     uint addAnnotations( Query *, Injectee *, Mailbox * );
@@ -98,5 +101,20 @@ private:
 };
 
 
+class BodypartSpooler
+    : public EventHandler
+{
+public:
+    BodypartSpooler( EventHandler * );
+
+    void add( Bodypart * );
+    void execute();
+
+    bool done() const;
+
+private:
+    class BodypartSpoolerData * d;
+};
+
 
 #endif
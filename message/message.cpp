@@ -28,7 +28,9 @@ public:
         : databaseId( 0 ), threadId( 0 ),
           wrapped( false ), rfc822Size( 0 ), internalDate( 0 ),
           hasHeaders( false ), hasAddresses( false ), hasBodies( false ),
-          hasTrivia( false ), hasBytesAndLines( false ), hasPGPsignedPart( false )
+          hasTrivia( false ), hasBytesAndLines( false ), hasPGPsignedPart( false ),
+          hasWireForm( false ),
+          storedSize( 0 ), storedUtf8Size( 0 )
     {}
 
     EString error;
@@ -46,7 +48,14 @@ public:
     bool hasTrivia : 1;
     bool hasBytesAndLines : 1;
     bool hasPGPsignedPart : 1;
+    bool hasWireForm : 1;
     EString rawSignedMessageBody;
+
+    EString wire;
+    EString wireUtf8;
+
+    uint storedSize;
+    uint storedUtf8Size;
 };
 
 
@@ -89,11 +98,23 @@ void Message::parse( const EString & rfc2822 )
     children()->clear();
 
     setHeader( parseHeader( i, rfc2822.length(), rfc2822, Header::Rfc2822 ) );
+    parseBody( i, rfc2822 );
+}
+
+
+/*! Parses the part of \a rfc2822 from index \a i to the end as the
+    body belonging to header(), which must already have been set.
+
+    parse() uses this once it has parsed the header. SmtpData uses it
+    directly, so that the header fields it prepends need not be
+    prepended to the entire message text.
+*/
+
+void Message::parseBody( uint i, const EString & rfc2822 )
+{
     header()->repair();
     header()->repair( this, rfc2822.mid( i ) );
 
-    setRawSignedMessageBody( rfc2822.mid( i, rfc2822.length() - i ) );
-    uint rawLength = rfc2822.length() - i;
     ContentType * ct = header()->contentType();
     if ( ct && ct->type() == "multipart" ) {
         if ( ct->subtype() == "signed" )
@@ -109,6 +130,21 @@ void Message::parse( const EString & rfc2822 )
         children()->append( bp );
     }
 
+    finishParsing( rfc2822.mid( i ) );
+}
+
+
+/*! Finishes parsing once header() and children() have been set up,
+    either by parseBody() or by a caller that has parsed the bodyparts
+    one by one. \a body is the raw text of the body; it is only used
+    if the message turns out to be PGP-signed, and may be empty
+    otherwise.
+*/
+
+void Message::finishParsing( const EString & body )
+{
+    setRawSignedMessageBody( body );
+
     fix8BitHeaderFields();
     header()->simplify();
 
@@ -129,7 +165,7 @@ void Message::parse( const EString & rfc2822 )
     } else { // add raw body as first bodypart
         Bodypart * bpt = new Bodypart( 0, this );
         bpt->setData( d->rawSignedMessageBody );
-        bpt->setNumBytes( rawLength );
+        bpt->setNumBytes( body.length() );
         bpt->setParent( this );
         children()->prepend( bpt );
     }
@@ -292,10 +328,16 @@ EString Message::error() const
 
     If \a avoidUtf8 is true, this function loses information rather
     than including UTF-8 in the result.
+
+    If the stored form has been fetched (see setRfc822()), it is
+    returned as-is.
 */
 
 EString Message::rfc822( bool avoidUtf8 ) const
 {
+    if ( d->hasWireForm )
+        return avoidUtf8 ? d->wire : d->wireUtf8;
+
     EString r;
     if ( d->rfc822Size )
         r.reserve( d->rfc822Size );
@@ -546,6 +588,60 @@ void Message::setBodiesFetched()
 }
 
 
+/*! Records that the message's RFC 822 form is \a ascii, or \a utf8
+    if unquoted UTF-8 is acceptable, so that rfc822() can return it
+    without assembling the message from its parts. The Fetcher does
+    this for messages with a stored wire form.
+*/
+
+void Message::setRfc822( const EString & ascii, const EString & utf8 )
+{
+    d->wire = ascii;
+    d->wireUtf8 = utf8;
+    d->hasWireForm = true;
+}
+
+
+/*! Records that the stored RFC 822 form of this message is \a ascii
+    bytes long, and \a utf8 bytes long in the form that may contain
+    unquoted UTF-8, without fetching it. Fetcher does this for large
+    forms when asked to, so that the IMAP FETCH handler can send them
+    from the database piece by piece.
+
+    This doesn't make hasRfc822() return true.
+*/
+
+void Message::setStoredRfc822Size( uint ascii, uint utf8 )
+{
+    d->storedSize = ascii;
+    d->storedUtf8Size = utf8;
+}
+
+
+/*! Returns the size of the stored RFC 822 form recorded by
+    setStoredRfc822Size(), in the form without UTF-8 if \a avoidUtf8
+    is true, or 0 if none has been recorded.
+*/
+
+uint Message::storedRfc822Size( bool avoidUtf8 ) const
+{
+    return avoidUtf8 ? d->storedSize : d->storedUtf8Size;
+}
+
+
+/*! Returns true if rfc822() can return the entire message, either
+    because setRfc822() has been called or because the addresses,
+    other header fields and bodies have all been fetched.
+*/
+
+bool Message::hasRfc822() const
+{
+    if ( d->hasWireForm )
+        return true;
+    return d->hasAddresses && d->hasHeaders && d->hasBodies;
+}
+
+
 /*! Returns true if this message knows its internalDate() and
     rfc822Size(), and false if not.
 */
@@ -21,6 +21,8 @@ public:
     Message();
 
     void parse( const EString & );
+    void parseBody( uint, const EString & );
+    void finishParsing( const EString & );
 
     bool valid() const;
     EString error() const;
@@ -60,6 +62,10 @@ public:
     void setBodiesFetched();
     bool hasBytesAndLines() const;
     void setBytesAndLinesFetched();
+    bool hasRfc822() const;
+    void setRfc822( const EString &, const EString & );
+    void setStoredRfc822Size( uint, uint );
+    uint storedRfc822Size( bool ) const;
     bool hasPGPsignedPart() const;
     void setPGPsignedPart( bool );
 
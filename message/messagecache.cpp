@@ -2,32 +2,84 @@
 
 #include "messagecache.h"
 
+#include "configuration.h"
+#include "bodypart.h"
 #include "message.h"
 #include "mailbox.h"
 #include "server.h"
+#include "graph.h"
 #include "map.h"
 
-#include <time.h> // time(0)
-
 
 static class MessageCache * c = 0;
 
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+static GraphableCounter * evictions = 0;
+static GraphableNumber * headerBytes = 0;
+static GraphableNumber * bodyBytes = 0;
+static GraphableNumber * entries = 0;
+
 
 class MessageCacheData
     : public Garbage
 {
 public:
-    MessageCacheData(): Garbage() {}
-    Map<Map<Message> > m;
+    MessageCacheData()
+        : Garbage(), newest( 0 ) {}
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry()
+            : Garbage(), mailbox( 0 ), uid( 0 ), message( 0 ),
+              newer( 0 ), older( 0 ),
+              state( 0 ), headers( 0 ), bodies( 0 ) {}
+
+        uint mailbox;
+        uint uid;
+        Message * message;
+        Entry * newer;
+        Entry * older;
+
+        // what message looked like when headers and bodies were
+        // last estimated
+        uint state;
+        uint headers;
+        uint bodies;
+    };
+
+    Map< Map<Entry> > m;
+    Entry * newest;
+
+    void unlink( Entry * );
+    void link( Entry * );
+    void evict( Entry * );
+    void estimate( Entry * );
 };
 
 
 /*! \class MessageCache messagecache.h
 
-  The MessageCache class caches messages until the Allocator decides
-  to clear out old Garbage. As a special feature, it can also cache
-  messages a few seconds longer, although that should be used
-  sparingly.
+    The MessageCache class keeps recently used messages in RAM, so
+    that e.g. a FETCH BODY[] following a FETCH ENVELOPE needn't
+    retrieve the header again.
+
+    The cache is a least-recently-used list with three budgets, one
+    for header fields and addresses, one for bodies and stored RFC
+    822 forms, and one for the per-message overhead (which is all a
+    message whose trivia alone has been fetched costs). The budgets
+    are fractions of the memory-limit.
+
+    Entries survive garbage collection; each time the Allocator
+    frees memory, clear() evicts the least recently used messages
+    until each budget is respected. Since the Fetcher fills in
+    messages after they've been inserted, the cost of each message
+    is estimated then, not when it's inserted.
+
+    Hits, misses, evictions and the estimated size are graphed as
+    message-cache-*.
 */
 
 
@@ -38,7 +90,12 @@ public:
 MessageCache::MessageCache()
     : Cache( 1 ), d( new MessageCacheData )
 {
-    // nothing
+    hits = new GraphableCounter( "message-cache-hits" );
+    misses = new GraphableCounter( "message-cache-misses" );
+    evictions = new GraphableCounter( "message-cache-evictions" );
+    headerBytes = new GraphableNumber( "message-cache-header-bytes" );
+    bodyBytes = new GraphableNumber( "message-cache-body-bytes" );
+    entries = new GraphableNumber( "message-cache-entries" );
 }
 
 
@@ -53,12 +110,24 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
         return;
     if ( !c )
         c = new MessageCache;
-    Map<Message> * mbcache = c->d->m.find( mb->id() );
+    Map<MessageCacheData::Entry> * mbcache = c->d->m.find( mb->id() );
     if ( !mbcache ) {
-        mbcache = new Map<Message>;
+        mbcache = new Map<MessageCacheData::Entry>;
         c->d->m.insert( mb->id(), mbcache );
     }
-    mbcache->insert( uid, m );
+    MessageCacheData::Entry * e = mbcache->find( uid );
+    if ( e ) {
+        c->d->unlink( e );
+        e->state = 0;
+    }
+    else {
+        e = new MessageCacheData::Entry;
+        e->mailbox = mb->id();
+        e->uid = uid;
+        mbcache->insert( uid, e );
+    }
+    e->message = m;
+    c->d->link( e );
 }
 
 
@@ -70,16 +139,60 @@ class Message * MessageCache::find( class Mailbox * mailbox, uint uid )
 {
     if ( !c )
         return 0;
-    Map<Message> * mbcache = c->d->m.find( mailbox->id() );
+    MessageCacheData::Entry * e = 0;
+    Map<MessageCacheData::Entry> * mbcache = c->d->m.find( mailbox->id() );
     if ( mbcache )
-        return mbcache->find( uid );
-    return 0;
+        e = mbcache->find( uid );
+    if ( !e ) {
+        misses->tick();
+        return 0;
+    }
+    hits->tick();
+    if ( e != c->d->newest ) {
+        c->d->unlink( e );
+        c->d->link( e );
+    }
+    return e->message;
 }
 
 
+/*! Evicts the least recently used messages until the cache is within
+    its budgets. Despite the name, this does not usually empty the
+    cache.
+*/
+
 void MessageCache::clear()
 {
-    d->m.clear();
+    uint limit = 1024 * 1024 *
+                 Configuration::scalar( Configuration::MemoryLimit );
+    uint headerBudget = limit / 16;
+    uint bodyBudget = limit / 8;
+    uint entryBudget = limit / 32 / 128;
+
+    uint h = 0;
+    uint b = 0;
+    uint n = 0;
+    MessageCacheData::Entry * e = d->newest;
+    while ( e ) {
+        MessageCacheData::Entry * older = e->older;
+        d->estimate( e );
+        if ( n >= entryBudget ||
+             ( e->headers && h + e->headers > headerBudget ) ||
+             ( e->bodies && b + e->bodies > bodyBudget ) ) {
+            d->evict( e );
+            evictions->tick();
+        }
+        else {
+            h += e->headers;
+            b += e->bodies;
+            n++;
+        }
+        e = older;
+    }
+
+    headerBytes->setValue( h );
+    bodyBytes->setValue( b );
+    entries->setValue( n );
 }
 
 
@@ -96,3 +209,104 @@ class Message * MessageCache::provide( class Mailbox * mailbox, uint uid )
     insert( mailbox, uid, m );
     return m;
 }
+
+
+/*! Removes \a e from the recency list. */
+
+void MessageCacheData::unlink( Entry * e )
+{
+    if ( e->newer )
+        e->newer->older = e->older;
+    else
+        newest = e->older;
+    if ( e->older )
+        e->older->newer = e->newer;
+    e->newer = 0;
+    e->older = 0;
+}
+
+
+/*! Adds \a e to the recency list as the most recently used entry. */
+
+void MessageCacheData::link( Entry * e )
+{
+    e->older = newest;
+    e->newer = 0;
+    if ( newest )
+        newest->newer = e;
+    newest = e;
+}
+
+
+/*! Removes \a e from the cache entirely. */
+
+void MessageCacheData::evict( Entry * e )
+{
+    unlink( e );
+    Map<Entry> * mbcache = m.find( e->mailbox );
+    if ( mbcache )
+        mbcache->remove( e->uid );
+}
+
+
+// Returns a number which changes whenever the Fetcher has filled in
+// more of \a m.
+
+static uint fetchState( Message * m )
+{
+    uint s = 1;
+    if ( m->hasHeaders() )
+        s |= 2;
+    if ( m->hasAddresses() )
+        s |= 4;
+    if ( m->hasBodies() )
+        s |= 8;
+    if ( m->hasRfc822() )
+        s |= 16;
+    return s;
+}
+
+
+// Returns an estimate of the bytes used by the header fields in \a h.
+
+static uint headerCost( Header * h )
+{
+    if ( !h )
+        return 0;
+    return h->fields()->count() * 160;
+}
+
+
+/*! Estimates the RAM used by the headers and bodies of the message
+    in \a e, unless that's already been done for the message as it
+    is now.
+*/
+
+void MessageCacheData::estimate( Entry * e )
+{
+    Message * m = e->message;
+    uint s = fetchState( m );
+    if ( s == e->state )
+        return;
+    e->state = s;
+    e->headers = headerCost( m->header() );
+    e->bodies = 0;
+    if ( m->hasRfc822() && !m->hasBodies() ) {
+        // setRfc822() keeps both forms, which may be different strings
+        EString utf8 = m->rfc822( false );
+        EString ascii = m->rfc822( true );
+        e->bodies = utf8.length();
+        if ( ascii.data() != utf8.data() )
+            e->bodies += ascii.length();
+    }
+    List<Bodypart>::Iterator i( m->allBodyparts() );
+    while ( i ) {
+        Bodypart * bp = i;
+        ++i;
+        if ( bp->header() != m->header() )
+            e->headers += headerCost( bp->header() );
+        if ( bp->message() )
+            e->headers += headerCost( bp->message()->header() );
+        e->bodies += bp->data().length() + bp->text().length() * 4;
+    }
+}
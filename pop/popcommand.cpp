@@ -650,18 +650,12 @@ bool PopCommand::retr( bool lines )
 
         d->started = true;
         Fetcher * f = new Fetcher( d->message, this );
-        if ( !d->message->hasBodies() )
-            f->fetch( Fetcher::Body );
-        if ( !d->message->hasHeaders() )
-            f->fetch( Fetcher::OtherHeader );
-        if ( !d->message->hasAddresses() )
-            f->fetch( Fetcher::Addresses );
+        if ( !d->message->hasRfc822() )
+            f->fetch( Fetcher::Rfc822 );
         f->execute();
     }
 
-    if ( !( d->message->hasBodies() &&
-            d->message->hasHeaders() &&
-            d->message->hasAddresses() ) )
+    if ( !d->message->hasRfc822() )
         return false;
 
     if ( d->message->rfc822Size() > 2 )
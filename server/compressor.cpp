@@ -0,0 +1,272 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "compressor.h"
+
+#include "log.h"
+#include "list.h"
+#include "buffer.h"
+#include "estring.h"
+#include "eventloop.h"
+#include "allocator.h"
+#include "configuration.h"
+
+// pipe, write
+#include <unistd.h>
+// fcntl, O_NONBLOCK
+#include <fcntl.h>
+// free
+#include <stdlib.h>
+
+#include <pthread.h>
+
+
+// Output smaller than this is compressed in the server process.
+static const uint minimum = 16384;
+
+
+class CompressionJob
+    : public Garbage
+{
+public:
+    CompressionJob()
+        : Garbage(),
+          connection( 0 ), buffer( 0 ), next( 0 ), output( 0 ),
+          length( 0 ), closed( false )
+        {}
+
+    Connection * connection;
+    Buffer * buffer;
+    EString input;
+    // the worker threads use the fields below
+    CompressionJob * next;
+    char * output;
+    uint length;
+    bool closed;
+};
+
+
+// The worker threads share these, and must hold lock while using
+// them. They don't allocate garbage-collected memory, so the jobs
+// are kept alive by jobs, which the main thread alone uses.
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static CompressionJob * firstQueued = 0;
+static CompressionJob * lastQueued = 0;
+static CompressionJob * done = 0;
+static int wakeup = -1;
+
+static List<CompressionJob> * jobs = 0;
+static uint workers = 0;
+
+
+static void * work( void * )
+{
+    pthread_mutex_lock( &lock );
+    while ( true ) {
+        while ( !firstQueued )
+            pthread_cond_wait( &ready, &lock );
+        CompressionJob * j = firstQueued;
+        firstQueued = j->next;
+        if ( !firstQueued )
+            lastQueued = 0;
+        pthread_mutex_unlock( &lock );
+
+        j->buffer->deflate( j->input, &j->output, &j->length );
+
+        pthread_mutex_lock( &lock );
+        j->next = done;
+        done = j;
+        char c = 0;
+        if ( ::write( wakeup, &c, 1 ) < 0 ) {
+            // the pipe is full, so the main thread will see this job
+            // when it empties the pipe
+        }
+    }
+    return 0;
+}
+
+
+/*! \class Compressor compressor.h
+    The Compressor class compresses output for Compressing Buffers in
+    worker threads, so that the EventLoop doesn't have to wait for
+    zlib while a large response is compressed.
+
+    Connection::write() calls compress() whenever its writeBuffer()
+    has something to compress. Small amounts are compressed at once,
+    and larger ones are given to a thread. Each Buffer has at most one
+    job at a time, so its output is added in order. When a thread is
+    done, it tells the Compressor via a pipe, and the Compressor adds
+    the output to the Buffer, asks the EventLoop to write it, and
+    starts compressing whatever was appended to the Buffer meanwhile.
+
+    The number of threads is set by the compression-threads
+    configuration variable. If it is 0, or if no thread can be
+    started, all compression is done by the server process. The
+    threads are started when they're first needed.
+*/
+
+
+/*! Constructs a Compressor which learns of finished jobs by reading
+    \a fd.
+*/
+
+Compressor::Compressor( int fd )
+    : Connection( fd, Connection::Pipe )
+{
+    EventLoop::global()->addConnection( this );
+}
+
+
+/*! Starts the worker threads, unless that's been done already, and
+    returns true if at least one is running.
+*/
+
+bool Compressor::start()
+{
+    if ( jobs )
+        return workers > 0;
+
+    jobs = new List<CompressionJob>;
+    Allocator::addEternal( jobs, "compression jobs" );
+
+    int fds[2];
+    if ( ::pipe( fds ) < 0 ) {
+        ::log( "Could not create pipe for compression threads",
+               Log::Error );
+        return false;
+    }
+    ::fcntl( fds[1], F_SETFL, ::fcntl( fds[1], F_GETFL ) | O_NONBLOCK );
+    wakeup = fds[1];
+    (void)new Compressor( fds[0] );
+
+    uint n = Configuration::scalar( Configuration::CompressionThreads );
+    while ( workers < n ) {
+        pthread_t t;
+        int r = pthread_create( &t, 0, work, 0 );
+        if ( r ) {
+            ::log( "pthread_create returned nonzero (" + fn( r ) + ")",
+                   Log::Error );
+            break;
+        }
+        pthread_detach( t );
+        workers++;
+    }
+    return workers > 0;
+}
+
+
+/*! Compresses the output appended to \a b, which is \a c's
+    writeBuffer(), or arranges for a thread to do so. Does nothing if
+    a thread is busy with \a b already; finish() calls compress()
+    again when it's done.
+*/
+
+void Compressor::compress( Connection * c, Buffer * b )
+{
+    uint n = b->uncompressed();
+    if ( !n || inFlight( b ) )
+        return;
+
+    if ( n < minimum ||
+         !Configuration::scalar( Configuration::CompressionThreads ) ||
+         !start() ) {
+        b->compress();
+        return;
+    }
+
+    CompressionJob * j = new CompressionJob;
+    j->connection = c;
+    j->buffer = b;
+    j->input = b->takeUncompressed();
+    jobs->append( j );
+
+    pthread_mutex_lock( &lock );
+    if ( lastQueued )
+        lastQueued->next = j;
+    else
+        firstQueued = j;
+    lastQueued = j;
+    pthread_cond_signal( &ready );
+    pthread_mutex_unlock( &lock );
+}
+
+
+/*! Returns the number of bytes a thread is compressing for \a b, or
+    0 if none is.
+*/
+
+uint Compressor::inFlight( Buffer * b )
+{
+    if ( !jobs || jobs->isEmpty() )
+        return 0;
+    List<CompressionJob>::Iterator i( jobs );
+    while ( i && i->buffer != b )
+        ++i;
+    if ( !i )
+        return 0;
+    return i->input.length();
+}
+
+
+/*! Records that the owner of \a b is closing, so its zlib state has
+    to be released once the thread using it is done. Returns true if
+    a thread is using \a b, and false if \a b can be closed at once.
+*/
+
+bool Compressor::close( Buffer * b )
+{
+    if ( !jobs || jobs->isEmpty() )
+        return false;
+    List<CompressionJob>::Iterator i( jobs );
+    while ( i && i->buffer != b )
+        ++i;
+    if ( !i )
+        return false;
+    i->closed = true;
+    return true;
+}
+
+
+void Compressor::react( Event e )
+{
+    if ( e == Read )
+        finish();
+}
+
+
+/*! Adds the output of each finished job to its Buffer, and writes it
+    to the Connection that owns the Buffer.
+*/
+
+void Compressor::finish()
+{
+    Buffer * r = readBuffer();
+    r->remove( r->size() );
+
+    pthread_mutex_lock( &lock );
+    CompressionJob * j = done;
+    done = 0;
+    pthread_mutex_unlock( &lock );
+
+    while ( j ) {
+        CompressionJob * next = j->next;
+        jobs->remove( j );
+        if ( j->closed ) {
+            j->buffer->close();
+        }
+        else if ( !j->output ) {
+            j->connection->log( "Could not allocate memory to compress " +
+                                fn( j->input.length() ) + " bytes",
+                                Log::Error );
+            j->connection->close();
+        }
+        else {
+            j->buffer->appendCompressed( j->output, j->length );
+            compress( j->connection, j->buffer );
+            EventLoop::global()->flushSoon( j->connection );
+        }
+        ::free( j->output );
+        j = next;
+    }
+}
@@ -0,0 +1,30 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include "connection.h"
+
+
+class Buffer;
+
+
+class Compressor
+    : public Connection
+{
+public:
+    static void compress( Connection *, Buffer * );
+    static uint inFlight( Buffer * );
+    static bool close( Buffer * );
+
+    void react( Event );
+
+private:
+    Compressor( int );
+
+    static bool start();
+    void finish();
+};
+
+
+#endif
@@ -3,6 +3,8 @@
 #include "connection.h"
 
 #include "tlsthread.h"
+#include "tlssocket.h"
+#include "compressor.h"
 
 #include "log.h"
 #include "file.h"
@@ -14,7 +16,10 @@
 #include "endpoint.h"
 #include "eventloop.h"
 #include "allocator.h"
+#include "timer.h"
+#include "event.h"
 #include "resolver.h"
+#include "configuration.h"
 #include "user.h"
 
 // errno
@@ -36,7 +41,7 @@ class ConnectionData
 public:
     ConnectionData()
         : r( 0 ), w( 0 ),
-          tls( 0 ), l( 0 ), session( 0 ),
+          tls( 0 ), ssl( 0 ), l( 0 ), session( 0 ), timer( 0 ),
           fd( -1 ), timeout( 0 ),
           wbt( 0 ), wbs( 0 ),
           state( Connection::Invalid ),
@@ -46,8 +51,10 @@ public:
 
     Buffer *r, *w;
     TlsThread * tls;
+    TlsSocket * ssl;
     Log *l;
     Session * session;
+    Timer * timer;
     int fd;
     uint timeout;
     uint wbt, wbs;
@@ -60,6 +67,30 @@ public:
 };
 
 
+class ConnectionTimeout
+    : public EventHandler
+{
+public:
+    ConnectionTimeout( Connection * connection )
+        : EventHandler(), c( connection ) {
+        setLog( c->log() );
+    }
+
+    void execute() {
+        if ( !c->valid() || !c->timeout() )
+            return;
+        uint now = time( 0 );
+        if ( c->timeout() > now )
+            // the wall clock moved backwards, so try again later
+            c->setTimeout( c->timeout() );
+        else
+            EventLoop::global()->dispatch( c, false, false, now );
+    }
+
+    Connection * c;
+};
+
+
 /*! \class Connection connection.h
     Represents a single TCP connection (or other socket).
 
@@ -161,6 +192,8 @@ void Connection::setState( Connection::State st )
              fn( EventLoop::global()->connections()->count() ) + " connections)",
              internal ? Log::Debug : Log::Info );
     d->state = st;
+    if ( st == Connecting || st == Closing )
+        EventLoop::global()->flushSoon( this );
 }
 
 
@@ -405,11 +438,30 @@ uint Connection::timeout() const
 }
 
 
-/*! Sets the connection timeout to \a tm seconds from the epoch. */
+/*! Sets the connection timeout to \a tm seconds from the epoch, or
+    removes the timeout if \a tm is 0.
+
+    The timeout is kept in the EventLoop's TimerQueue, along with all
+    other Timer objects, so the EventLoop doesn't need to look at
+    every Connection to find out which ones have timed out.
+*/
 
 void Connection::setTimeout( uint tm )
 {
     d->timeout = tm;
+    if ( !tm ) {
+        if ( d->timer )
+            d->timer->setTimeout( 0 );
+        return;
+    }
+
+    uint now = time( 0 );
+    int64 ms = Timer::now();
+    if ( tm > now )
+        ms += 1000 * (int64)( tm - now );
+    if ( !d->timer )
+        d->timer = new Timer( new ConnectionTimeout( this ), 0 );
+    d->timer->setTimeout( ms );
 }
 
 
@@ -418,7 +470,7 @@ void Connection::setTimeout( uint tm )
 
 void Connection::setTimeoutAfter( uint n )
 {
-    d->timeout = n + (uint)time(0);
+    setTimeout( n + (uint)time(0) );
 }
 
 
@@ -429,7 +481,7 @@ void Connection::setTimeoutAfter( uint n )
 void Connection::extendTimeout( uint n )
 {
     if ( d->timeout != 0 )
-        d->timeout += n;
+        setTimeout( d->timeout + n );
 }
 
 
@@ -464,14 +516,31 @@ Buffer *Connection::readBuffer() const
 }
 
 
-/*! Returns a pointer to the connection's write buffer. */
+/*! Returns a pointer to the connection's write buffer.
+
+    Since the caller may be about to append something, this also asks
+    the EventLoop to look at this Connection soon.
+*/
 
 Buffer *Connection::writeBuffer() const
 {
+    if ( EventLoop::global() )
+        EventLoop::global()->flushSoon( const_cast<Connection *>( this ) );
     return d->w;
 }
 
 
+/*! Returns the number of bytes in the connection's write buffer.
+    Unlike writeBuffer(), this doesn't ask the EventLoop to look at
+    this Connection.
+*/
+
+uint Connection::writeBufferSize() const
+{
+    return d->w ? d->w->size() : 0;
+}
+
+
 static union {
     struct sockaddr_in in;
     struct sockaddr_in6 in6;
@@ -518,12 +587,24 @@ Endpoint Connection::peer() const
 
 void Connection::close()
 {
-    if ( valid() && d->fd >= 0 )
+    if ( d->ssl )
+        d->ssl->close();
+    if ( valid() && d->fd >= 0 ) {
+        EventLoop::global()->forgetFd( d->fd );
         ::close( d->fd );
+    }
     if ( d->tls )
         d->tls->close();
+    if ( d->w->syscalls() )
+        log( "I/O: " + fn( d->r->syscalls() + d->w->syscalls() ) +
+             " system calls, " +
+             EString::humanNumber( d->r->copied() + d->w->copied() ) +
+             " bytes copied", Log::Debug );
     d->r->close();
-    d->w->close();
+    if ( !Compressor::close( d->w ) )
+        d->w->close();
+    if ( d->timer )
+        d->timer->setTimeout( 0 );
     setState( Invalid );
     d->session = 0;
     EventLoop::global()->removeConnection( this );
@@ -531,24 +612,67 @@ void Connection::close()
 
 
 /*! Reads waiting input from the connected socket. Does nothing in
-    case the Connection isn't valid(). */
+    case the Connection isn't valid().
+
+    If the peer has closed the connection, this makes Close pending,
+    so that the EventLoop closes this Connection after the last input
+    has been handled. */
 
 void Connection::read()
 {
-    if ( valid() )
-        d->r->read( d->fd );
+    if ( !valid() )
+        return;
+
+    if ( !d->ssl ) {
+        if ( d->r->read( d->fd ) ) {
+            d->event = Close;
+            d->pending = true;
+        }
+        return;
+    }
+
+    d->ssl->read( d->r );
+    if ( d->ssl->finished() ) {
+        // the peer is gone as far as TLS is concerned, even if the
+        // socket is still open
+        d->event = Close;
+        d->pending = true;
+    }
 }
 
 
 /*! Writes pending output to the connected socket. Does nothing in
-    case the Connection isn't valid(). */
+    case the Connection isn't valid().
+
+    If the writeBuffer() compresses, this first uses Compressor to
+    compress what has been appended to it.
+
+    If the socket has failed, this discards the output and makes
+    Close pending, just like read() does when the peer is gone.
+*/
 
 void Connection::write()
 {
     if ( !valid() )
         return;
 
-    d->w->write( d->fd );
+    if ( d->w->uncompressed() )
+        Compressor::compress( this, d->w );
+
+    if ( d->ssl ) {
+        // this may resume an SSL_read() that had to write first. the
+        // EventLoop won't report the socket as readable again, so if
+        // it produced input, we ask to be dispatched as readable.
+        uint s = d->r->size();
+        d->ssl->write( d->w );
+        if ( d->r->size() > s )
+            EventLoop::global()->readSoon( this );
+    }
+    else if ( d->w->write( d->fd ) ) {
+        d->w->remove( d->w->size() );
+        d->event = Close;
+        d->pending = true;
+    }
     uint wbs = d->w->size();
     if ( wbs && !d->wbs ) {
         d->wbt = time( 0 );
@@ -571,14 +695,36 @@ void Connection::write()
 }
 
 
-/*! Returns true if we have any data to send. */
+/*! Returns true if we have any data to send now. Output which a
+    Compressor thread is busy with doesn't count; the Compressor
+    calls EventLoop::flushSoon() when it's done.
+*/
 
 bool Connection::canWrite()
 {
+    if ( d->ssl && d->ssl->wantsWrite() )
+        return true;
+    if ( d->w->uncompressed() && !Compressor::inFlight( d->w ) )
+        return true;
     return d->w->size() > 0;
 }
 
 
+/*! Returns the number of bytes this Connection has yet to write,
+    including any not yet compressed. Subclasses which keep some
+    output outside the writeBuffer() may reimplement this to include
+    it.
+*/
+
+uint Connection::pendingOutput()
+{
+    if ( !d->w )
+        return 0;
+    return d->w->size() + d->w->uncompressed() +
+        Compressor::inFlight( d->w );
+}
+
+
 /*! Returns true only if the Event \a e is pending on this Connection.
 */
 
@@ -588,7 +734,8 @@ bool Connection::isPending( Event e )
 }
 
 
-/*! Appends \a s to this Connection's writeBuffer().
+/*! Appends \a s to this Connection's writeBuffer(). Subclasses may
+    reimplement this to hold output back while sending something else.
 */
 
 void Connection::enqueue( const EString &s )
@@ -604,11 +751,18 @@ void Connection::enqueue( const EString &s )
 */
 
 
-/*! Starts TLS negotiation on this connection. */
+/*! Starts TLS negotiation on this connection.
+
+    Normally the TLS session runs on the socket itself, using a
+    TlsSocket. If the use-tls-threads configuration variable is set,
+    or if OpenSSL cannot set up a TlsSocket, a TlsThread does the work
+    instead, and this Connection talks cleartext to it via a
+    socketpair.
+*/
 
 void Connection::startTls()
 {
-    if ( d->tls || !valid() )
+    if ( hasTls() || !valid() )
         return;
 
     write();
@@ -616,6 +770,16 @@ void Connection::startTls()
     log( "Negotiating TLS for client " + peer().string(),
          Log::Debug );
 
+    if ( !Configuration::toggle( Configuration::UseTlsThreads ) ) {
+        TlsSocket * s = new TlsSocket( d->fd );
+        if ( !s->broken() ) {
+            d->ssl = s;
+            return;
+        }
+        log( "Cannot start TLS on the socket, using a thread instead",
+             Log::Error );
+    }
+
     int sv[2];
     int r = ::socketpair( AF_UNIX, SOCK_STREAM, 0, sv );
     if ( r < 0 ) {
@@ -645,11 +809,13 @@ void Connection::startTls()
     if ( fcntl( sv[1], F_SETFL, flags ) < 0 )
         die( FD );
 
+    EventLoop::global()->forgetFd( d->fd );
     t->setClientFD( d->fd );
     t->setServerFD( sv[0] );
     d->fd = sv[1];
 
     d->tls = t;
+    EventLoop::global()->addConnection( this );
 }
 
 
@@ -659,7 +825,7 @@ void Connection::startTls()
 
 bool Connection::hasTls() const
 {
-    if ( d->tls )
+    if ( d->tls || d->ssl )
         return true;
     return false;
 }
@@ -1047,12 +1213,14 @@ int Connection::connect( const EString & address, uint port )
 void Connection::substitute( Connection * other, Event event )
 {
     EventLoop::global()->removeConnection( this );
-    setTimeoutAfter( 10 );
+    setTimeout( 0 );
+    d->timer = 0;
     d->type = other->d->type;
     d->l = other->d->l;
     other->d = d;
     other->d->pending = true;
     other->d->event = event;
+    other->setTimeoutAfter( 10 );
     EventLoop::global()->addConnection( other );
 }
 
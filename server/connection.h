@@ -56,6 +56,7 @@ public:
 
     Buffer * writeBuffer() const;
     Buffer * readBuffer() const;
+    uint writeBufferSize() const;
     Endpoint self() const;
     Endpoint peer() const;
     void setType( Type );
@@ -69,8 +70,9 @@ public:
     virtual void read();
     virtual void write();
     virtual bool canWrite();
+    virtual uint pendingOutput();
 
-    void enqueue( const EString & );
+    virtual void enqueue( const EString & );
 
     enum Event { Error, Connect, Read, Timeout, Close, Shutdown };
     virtual void react( Event ) = 0;
@@ -12,28 +12,22 @@
 #include "graph.h"
 #include "event.h"
 #include "list.h"
+#include "map.h"
 #include "log.h"
+#include "poller.h"
 
 // time
 #include <time.h>
 // errno
 #include <errno.h>
-// struct timeval, fd_set
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/select.h>
 // getsockopt, SOL_SOCKET, SO_ERROR
 #include <sys/socket.h>
-// read, select
+// read
 #include <unistd.h>
-// ioctl, FIONREAD
-#include <sys/ioctl.h>
-
-// memset (for FD_* under OpenBSD)
-#include <string.h>
 
 
 static bool freeMemorySoon;
+static bool freeNurserySoon;
 
 
 static EventLoop * loop;
@@ -44,17 +38,29 @@ class LoopData
 {
 public:
     LoopData()
-        : log( new Log ), startup( false ),
-          stop( false ), limit( 16 * 1024 * 1024 )
+        : log( new Log ), poller( 0 ),
+          flush( new List<Connection> ), readable( new List<Connection> ),
+          dispatching( 0 ),
+          startup( false ), stop( false ), limit( 16 * 1024 * 1024 )
     {}
 
     Log *log;
+    Poller * poller;
+    Map<Connection> watched;
+    Map<Connection> flushing;
+    List< Connection > * flush;
+    List< Connection > * readable;
+    Connection * dispatching;
     bool startup;
     bool stop;
     List< Connection > connections;
-    List< Timer > timers;
+    TimerQueue timers;
     uint limit;
 
+    void watch( Connection * );
+    void unwatch( int );
+    void updateInterest( Connection * );
+
     class Stopper
         : public EventHandler
     {
@@ -84,9 +90,64 @@ public:
     and periodically informs them about any events (e.g., read/write,
     errors, timeouts) that occur. The loop continues until something
     calls stop().
+
+    The EventLoop uses a Poller to learn which connections need
+    attention, and tells only those. A Connection that acquires
+    something to write while the EventLoop is busy with another one
+    calls flushSoon(), so that it is looked at on the next iteration.
 */
 
 
+// Returns true if \a c needs to know when its fd becomes writable.
+
+static bool wantsWrite( Connection * c )
+{
+    return c->canWrite() ||
+        c->state() == Connection::Connecting ||
+        c->state() == Connection::Closing;
+}
+
+
+// Tells the Poller about \a c, unless it knows already, or \a c is
+// a Listener and we're not ready to accept connections.
+
+void LoopData::watch( Connection * c )
+{
+    int fd = c->fd();
+    if ( !poller || fd < 0 )
+        return;
+    if ( startup && c->type() == Connection::Listener )
+        return;
+    if ( watched.find( fd ) == c )
+        return;
+    watched.insert( fd, c );
+    poller->add( fd, c->hasProperty( Connection::Listens ) );
+    poller->setWriteInterest( fd, wantsWrite( c ) );
+}
+
+
+// Tells the Poller to forget \a fd.
+
+void LoopData::unwatch( int fd )
+{
+    if ( fd < 0 || !watched.find( fd ) )
+        return;
+    watched.remove( fd );
+    if ( poller )
+        poller->remove( fd );
+}
+
+
+// Tells the Poller whether \a c wants to write.
+
+void LoopData::updateInterest( Connection * c )
+{
+    int fd = c->fd();
+    if ( poller && fd >= 0 && watched.find( fd ) == c )
+        poller->setWriteInterest( fd, wantsWrite( c ) );
+}
+
+
 /*! Creates the global EventLoop object or, if \a l is non-zero, sets
     the global EventLoop to \a l. This function expects to be called
     very early during the startup sequence.
@@ -122,22 +183,28 @@ EventLoop::~EventLoop()
     c, so that shutdown proceeds unhampered. This is likely to disturb
     \a c a little, but it's better than the alternative: Aborting the
     shutdown.
+
+    If \a c has been added already, but its fd() has changed since,
+    addConnection() starts watching the new fd.
 */
 
 void EventLoop::addConnection( Connection * c )
 {
+    Scope x( d->log );
+
+    if ( d->connections.find( c ) ) {
+        d->watch( c );
+        return;
+    }
+
     if ( d->stop ) {
         log( "Cannot add new Connection objects during shutdown",
              Log::Error );
         return;
     }
 
-    Scope x( d->log );
-
-    if ( d->connections.find( c ) )
-        return;
-
     d->connections.prepend( c );
+    d->watch( c );
     setConnectionCounts();
 }
 
@@ -150,6 +217,9 @@ void EventLoop::removeConnection( Connection * c )
 {
     Scope x( d->log );
 
+    if ( d->watched.find( c->fd() ) == c )
+        d->unwatch( c->fd() );
+
     if ( d->connections.remove( c ) == 0 )
         return;
     setConnectionCounts();
@@ -187,6 +257,69 @@ List< Connection > *EventLoop::connections() const
 
 static GraphableNumber * sizeinram = 0;
 
+static GraphableDataSet * gcPause = 0;
+static GraphableCounter * gcPauses[4];
+static GraphableCounter * gcNursery = 0;
+static GraphableCounter * gcFull = 0;
+static GraphableNumber * gcRoots = 0;
+static GraphableNumber * gcLive[32];
+static GraphableNumber * gcFreed[32];
+static GraphableCounter * victims = 0;
+
+
+// Records what the last garbage collection cost, so that GraphDumper
+// can tell anyone who asks.
+
+static void graphCollection()
+{
+    if ( !gcPause ) {
+        gcPause = new GraphableDataSet( "gc-pause-microseconds" );
+        gcPauses[0] = new GraphableCounter( "gc-pauses-under-1ms" );
+        gcPauses[1] = new GraphableCounter( "gc-pauses-1-10ms" );
+        gcPauses[2] = new GraphableCounter( "gc-pauses-10-100ms" );
+        gcPauses[3] = new GraphableCounter( "gc-pauses-over-100ms" );
+        gcNursery = new GraphableCounter( "gc-nursery-collections" );
+        gcFull = new GraphableCounter( "gc-full-collections" );
+        gcRoots = new GraphableNumber( "gc-eternal-roots" );
+    }
+
+    uint pause = Allocator::lastPause();
+    gcPause->addNumber( pause );
+    if ( pause < 1000 )
+        gcPauses[0]->tick();
+    else if ( pause < 10000 )
+        gcPauses[1]->tick();
+    else if ( pause < 100000 )
+        gcPauses[2]->tick();
+    else
+        gcPauses[3]->tick();
+
+    if ( Allocator::lastWasNursery() )
+        gcNursery->tick();
+    else
+        gcFull->tick();
+
+    gcRoots->setValue( Allocator::eternals() );
+
+    // size classes get their numbers once they're used, and then keep
+    // them
+    uint i = 0;
+    while ( i < 32 ) {
+        uint live = Allocator::liveBytes( i );
+        uint freed = Allocator::freedBytes( i );
+        if ( !gcLive[i] && ( live || freed ) ) {
+            EString size = fn( Allocator::classSize( i ) );
+            gcLive[i] = new GraphableNumber( "gc-live-bytes-" + size );
+            gcFreed[i] = new GraphableNumber( "gc-freed-bytes-" + size );
+        }
+        if ( gcLive[i] ) {
+            gcLive[i]->setValue( live );
+            gcFreed[i]->setValue( freed );
+        }
+        i++;
+    }
+}
+
 static const uint gcDelay = 30;
 
 
@@ -198,7 +331,19 @@ void EventLoop::start()
     time_t gc = time(0);
     bool haveLoggedStartup = false;
 
-    log( "Starting event loop", Log::Debug );
+    // we create the Poller here rather than in the constructor,
+    // since the server may fork() between the two, and an epoll
+    // instance must not be shared between processes.
+    if ( !d->poller ) {
+        d->poller = Poller::create();
+        List< Connection >::Iterator it( d->connections );
+        while ( it ) {
+            d->watch( it );
+            ++it;
+        }
+    }
+
+    log( "Starting event loop using " + d->poller->name(), Log::Debug );
 
     while ( !d->stop && !Log::disastersYet() ) {
         if ( !haveLoggedStartup && !inStartup() ) {
@@ -210,106 +355,88 @@ void EventLoop::start()
 
         Connection * c;
 
-        uint timeout = gcDelay;
-        int maxfd = -1;
-
-        fd_set r, w;
-        FD_ZERO( &r );
-        FD_ZERO( &w );
-
-        // Figure out what events each connection wants.
-
-        List< Connection >::Iterator it( d->connections );
-        while ( it ) {
-            c = it;
-            ++it;
-
-            int fd = c->fd();
-            if ( fd < 0 ) {
-                removeConnection( c );
-            }
-            else if ( c->type() == Connection::Listener && inStartup() ) {
-                // we don't accept new connections until we've
-                // completed startup
-            }
-            else {
-                if ( fd > maxfd )
-                    maxfd = fd;
-                FD_SET( fd, &r );
-                if ( c->canWrite() ||
-                     c->state() == Connection::Connecting ||
-                     c->state() == Connection::Closing )
-                    FD_SET( fd, &w );
-                if ( c->timeout() > 0 && c->timeout() < timeout )
-                    timeout = c->timeout();
-            }
-        }
-
-        // Figure out whether any timers need attention soon
-
-        List< Timer >::Iterator t( d->timers );
-        while ( t ) {
-            if ( t->active() && t->timeout() < timeout )
-                timeout = t->timeout();
-            ++t;
-        }
-
-        // Look for interesting input
+        // Sleep until the next timer expires, or until something
+        // happens, whichever comes first. If some connection is
+        // waiting to be flushed already, we only peek.
 
-        struct timeval tv;
-        tv.tv_sec = timeout - time( 0 );
-        tv.tv_usec = 0;
+        int64 now = Timer::now();
+        int64 sleep = 1000 * gcDelay;
+        Timer * t = d->timers.first();
+        if ( t && t->timeout() - now < sleep )
+            sleep = t->timeout() - now;
+        if ( sleep < 0 || !d->flush->isEmpty() || !d->readable->isEmpty() )
+            sleep = 0;
 
-        if ( tv.tv_sec < 0 )
-            tv.tv_sec = 0;
-        if ( tv.tv_sec > 60 )
-            tv.tv_sec = 60;
-
-        // we never ask the OS to sleep shorter than .2 seconds
-        if ( tv.tv_sec < 1 )
-            tv.tv_usec = 200000;
-
-        if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
-            // r and w are undefined. we clear them, and dispatch()
-            // won't jump to conclusions
-            FD_ZERO( &r );
-            FD_ZERO( &w );
-        }
-        time_t now = time( 0 );
+        d->poller->wait( (uint)sleep );
 
         // Graph our size before processing events
         if ( !sizeinram )
             sizeinram = new GraphableNumber( "memory-used" );
         sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
 
-        // Any interesting timers?
+        // Any interesting timers? We look at the ones that are due
+        // now, not at ones that are created or rescheduled while we
+        // handle those.
 
-        if ( !d->timers.isEmpty() ) {
-            uint now = time( 0 );
+        now = Timer::now();
+        List< Timer > due;
+        t = d->timers.first();
+        while ( t && t->timeout() <= now ) {
+            d->timers.remove( t );
+            due.append( t );
             t = d->timers.first();
-            while ( t ) {
-                Timer * tmp = t;
-                ++t;
-                if ( tmp->active() && tmp->timeout() <= now )
-                    tmp->execute();
-            }
+        }
+        List< Timer >::Iterator i( due );
+        while ( i ) {
+            t = i;
+            ++i;
+            if ( t->active() && t->timeout() <= now )
+                t->execute();
+        }
+
+        // Tell the connections whose fds are ready.
+
+        uint seconds = time( 0 );
+        uint r = 0;
+        uint n = d->poller->ready();
+        while ( r < n ) {
+            int fd = d->poller->fd( r );
+            c = d->watched.find( fd );
+            if ( !c || c->fd() != fd )
+                d->unwatch( fd );
+            else
+                dispatch( c, d->poller->readable( r ),
+                          d->poller->writable( r ), seconds,
+                          d->poller->broken( r ) );
+            r++;
+        }
+
+        // Listeners which stopped accepting before their queue was
+        // empty won't be told about it again, so they're told now.
+
+        List< Connection > * readable = d->readable;
+        d->readable = new List<Connection>;
+        List< Connection >::Iterator ri( readable );
+        while ( ri ) {
+            c = ri;
+            ++ri;
+            if ( d->watched.find( c->fd() ) == c )
+                dispatch( c, true, false, seconds );
         }
 
-        // Figure out what each connection cares about.
+        // Some connections may have been given something to write
+        // while we handled someone else.
 
-        it = d->connections.first();
+        List< Connection > * flush = d->flush;
+        d->flush = new List<Connection>;
+        List< Connection >::Iterator it( flush );
         while ( it ) {
             c = it;
             ++it;
-            int fd = c->fd();
-            if ( fd >= 0 ) {
-                dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
-                FD_CLR( fd, &r );
-                FD_CLR( fd, &w );
-            }
-            else {
-                removeConnection( c );
-            }
+            if ( d->flushing.find( c->fd() ) == c )
+                d->flushing.remove( c->fd() );
+            if ( d->watched.find( c->fd() ) == c )
+                dispatch( c, false, false, seconds );
         }
 
         // Graph our size after processing all the events too
@@ -324,7 +451,7 @@ void EventLoop::start()
         if ( !d->stop ) {
             if ( !::freeMemorySoon ) {
                 uint a = Allocator::inUse() + Allocator::allocated();
-                if ( now < gc ) {
+                if ( seconds < gc ) {
                     // time went backwards, best to be paranoid
                     ::freeMemorySoon = true;
                 }
@@ -339,7 +466,7 @@ void EventLoop::start()
                     // garbage every second.
                     uint factor = a / d->limit;
                     uint period = gcDelay >> factor;
-                    if ( (uint)(now - gc) > period )
+                    if ( (uint)(seconds - gc) > period )
                         ::freeMemorySoon = true;
                 }
             }
@@ -348,6 +475,10 @@ void EventLoop::start()
                 gc = time( 0 );
                 ::freeMemorySoon = false;
             }
+            else if ( ::freeNurserySoon && Allocator::freeNursery() ) {
+                graphCollection();
+            }
+            ::freeNurserySoon = false;
         }
     }
 
@@ -380,10 +511,20 @@ void EventLoop::start()
 
 /*! Calls Allocator::free() and does any necessary pre- and
     postprocessing.
+
+    If memory usage is below the limit, this tries a quick
+    Allocator::freeNursery() first, and only collects everything if
+    that isn't possible.
 */
 
 void EventLoop::freeMemory()
 {
+    if ( Allocator::inUse() + Allocator::allocated() < d->limit &&
+         Allocator::freeNursery() ) {
+        graphCollection();
+        return;
+    }
+
     List<Garbage> x;
     List<Connection>::Iterator i( d->connections );
     while ( i ) {
@@ -393,6 +534,7 @@ void EventLoop::freeMemory()
         ++i;
     }
     Garbage * biggest = Allocator::free( &x );
+    graphCollection();
     // x now points to free memory
     i = d->connections.first();
     Connection * victim = 0;
@@ -406,6 +548,9 @@ void EventLoop::freeMemory()
     if ( victim && Allocator::inUse() > d->limit ) {
         ::log( "Closing connection due to memory overload: " +
                victim->description() );
+        if ( !::victims )
+            ::victims = new GraphableCounter( "memory-victims" );
+        ::victims->tick();
         victim->react( Connection::Shutdown );
         victim->close();
     }
@@ -417,9 +562,13 @@ void EventLoop::freeMemory()
     if the FD may be read, and \a w is true if we know that the FD may
     be written to. If \a now is past that Connection's timeout, we
     must send a Timeout event.
+
+    \a b is true if the Poller reported an error or hangup. If nothing
+    can be read then, the connection is closed, since an
+    edge-triggered Poller won't report it again.
 */
 
-void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
+void EventLoop::dispatch( Connection * c, bool r, bool w, uint now, bool b )
 {
     int dummy1;
     socklen_t dummy2;
@@ -431,6 +580,9 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
         return;
     }
 
+    Connection * outer = d->dispatching;
+    d->dispatching = c;
+
     try {
         Scope x( c->log() );
         if ( c->timeout() != 0 && now >= c->timeout() ) {
@@ -476,14 +628,13 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
 
         if ( r ) {
             bool gone = false;
-            if ( !c->hasProperty( Connection::Listens ) ) {
-                int a = 0;
-                int r = ioctl( c->fd(), FIONREAD, &a );
-                if ( r >= 0 && a == 0 )
-                    gone = true;
-            }
-
+            uint s = c->readBuffer()->size();
             c->read();
+            if ( c->isPending( Connection::Close ) )
+                gone = true;
+            else if ( b && c->state() == Connection::Connected &&
+                      c->readBuffer()->size() == s )
+                gone = true;
             c->react( Connection::Read );
 
             if ( gone ) {
@@ -492,13 +643,20 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
             }
         }
 
-        uint s = c->writeBuffer()->size();
+        uint s = c->writeBufferSize();
         c->write();
+        // a failed write makes Close pending, and nothing else will
+        // tell us that the peer is gone
+        if ( c->state() == Connection::Connected &&
+             c->isPending( Connection::Close ) ) {
+            c->setState( Connection::Closing );
+            c->react( Connection::Close );
+        }
         // if we're closing anyway, and we can't write any of what we
         // want to write, then just forget the buffered data and go on
         // with the close
         if ( c->state() == Connection::Closing &&
-             s && s == c->writeBuffer()->size() )
+             s && s == c->writeBufferSize() )
             c->writeBuffer()->remove( s );
     }
     catch ( const Exception& e ) {
@@ -520,10 +678,17 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
             c->close();
     }
 
-    if ( c->state() == Connection::Closing && !c->canWrite() )
+    d->dispatching = outer;
+
+    // a Connection whose output is being compressed closes when
+    // that's been written
+    if ( c->state() == Connection::Closing &&
+         !c->canWrite() && !c->pendingOutput() )
         c->close();
     if ( !c->valid() )
         removeConnection( c );
+    else
+        d->updateInterest( c );
 }
 
 
@@ -627,6 +792,18 @@ bool EventLoop::inStartup() const
 void EventLoop::setStartup( bool p )
 {
     d->startup = p;
+
+    List< Connection >::Iterator it( d->connections );
+    while ( it ) {
+        Connection * c = it;
+        ++it;
+        if ( c->type() == Connection::Listener ) {
+            if ( p )
+                d->unwatch( c->fd() );
+            else
+                d->watch( c );
+        }
+    }
 }
 
 
@@ -660,13 +837,58 @@ void EventLoop::shutdown()
 }
 
 
+/*! Asks this EventLoop to look at \a c on its next iteration, even
+    if nothing happens to its fd. Connection calls this when something
+    may have been added to its write buffer, or its state() has
+    changed, so the EventLoop can write, connect or close as
+    appropriate.
+
+    Does nothing if \a c is being dispatched right now, since
+    dispatch() writes anyway.
+*/
+
+void EventLoop::flushSoon( Connection * c )
+{
+    if ( c == d->dispatching )
+        return;
+    int fd = c->fd();
+    if ( fd < 0 || d->flushing.find( fd ) == c )
+        return;
+    d->flushing.insert( fd, c );
+    d->flush->append( c );
+}
+
+
+/*! Asks this EventLoop to dispatch \a c as readable on its next
+    iteration, even if the Poller doesn't report it. A Listener calls
+    this when it stops accepting before its queue is empty, since its
+    fd won't be reported again until another connection arrives.
+*/
+
+void EventLoop::readSoon( Connection * c )
+{
+    d->readable->append( c );
+}
+
+
+/*! Tells this EventLoop to stop watching \a fd, which is about to be
+    closed or given to someone else (as Connection::startTls() does).
+*/
+
+void EventLoop::forgetFd( int fd )
+{
+    d->unwatch( fd );
+}
+
+
 /*! Records that \a t exists, so that the event loop will process \a
-    t.
+    t when its Timer::timeout() arrives. If \a t is known already,
+    addTimer() notes that its timeout may have changed.
 */
 
 void EventLoop::addTimer( Timer * t )
 {
-    d->timers.append( t );
+    d->timers.insert( t );
 }
 
 
@@ -676,9 +898,7 @@ void EventLoop::addTimer( Timer * t )
 
 void EventLoop::removeTimer( Timer * t )
 {
-    List<Timer>::Iterator i( d->timers.find( t ) );
-    if ( i )
-        d->timers.take( i );
+    d->timers.remove( t );
 }
 
 static GraphableNumber * imapgraph = 0;
@@ -794,6 +1014,30 @@ void EventLoop::freeMemorySoon()
 }
 
 
+/*! Notes that a unit of work, such as an IMAP command, has just
+    finished, so most of what it allocated has become garbage.
+
+    If nursery collection is possible and enough has been allocated
+    since the last collection to make it worthwhile, this asks the
+    event loop to collect the nursery at the end of the current
+    iteration. That frees the work's temporary objects in bulk and
+    promotes those it handed on to others, long before the periodic
+    collection would get to them.
+
+    This never leads to a full collection. If nursery collection
+    isn't possible, for instance because the kernel doesn't track
+    soft-dirty pages, it does nothing.
+*/
+
+void EventLoop::freeNurserySoon()
+{
+    EventLoop * l = global();
+    if ( l && Allocator::allocated() >= l->d->limit / 8 &&
+         Allocator::generational() )
+        ::freeNurserySoon = true;
+}
+
+
 /*! Instructs this event loop to collect garbage when memory usage
     passes \a limit bytes. The default is 0, which means to collect
     garbage even if very little is being used.
@@ -24,7 +24,10 @@ public:
     void closeAllExceptListeners();
     void flushAll();
 
-    void dispatch( Connection *, bool, bool, uint );
+    void dispatch( Connection *, bool, bool, uint, bool = false );
+    void flushSoon( Connection * );
+    void readSoon( Connection * );
+    void forgetFd( int );
 
     bool inStartup() const;
     void setStartup( bool );
@@ -37,6 +40,7 @@ public:
     static EventLoop * global();
     static void shutdown();
     static void freeMemorySoon();
+    static void freeNurserySoon();
 
     virtual void addTimer( class Timer * );
     virtual void removeTimer( class Timer * );
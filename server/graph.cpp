@@ -10,6 +10,7 @@
 
 
 static List<GraphableNumber> * numbers = 0;
+static List<GraphableReport> * reports = 0;
 
 
 static const uint graphableHistorySize = 960; // 15 minutes and a little bit
@@ -221,7 +222,7 @@ class GraphableDataSetData
     : public Garbage
 {
 public:
-    GraphableDataSetData(): t( 0 ), n( 0 ) {}
+    GraphableDataSetData(): t( 0 ), s( 0 ), n( 0 ) {}
     uint t;
     uint s;
     uint n;
@@ -241,7 +242,7 @@ public:
 /*! Constructs an empty data set named \a name. */
 
 GraphableDataSet::GraphableDataSet( const EString & name )
-    : GraphableNumber( name )
+    : GraphableNumber( name ), d( new GraphableDataSetData )
 {
 }
 
@@ -256,13 +257,55 @@ void GraphableDataSet::addNumber( uint n )
         d->n = 0;
         d->s = 0;
     }
-    n++;
+    d->n++;
     d->s += n;
     if ( d->n )
         setValue( ( d->s + (d->n/2) ) / d->n );
 }
 
 
+/*! \class GraphableReport graph.h
+
+    The GraphableReport class is an abstract superclass for statistics
+    that aren't a single number, such as a list of the busiest items
+    of some kind. GraphDumper sends the report() of each extant
+    GraphableReport after the GraphableNumber values.
+*/
+
+
+/*! Constructs a GraphableReport and makes sure GraphDumper will use
+    it until it's destroyed.
+*/
+
+GraphableReport::GraphableReport()
+    : Garbage()
+{
+    if ( !reports ) {
+        reports = new List<GraphableReport>;
+        Allocator::addEternal( reports, "reports for statistics" );
+    }
+    reports->append( this );
+}
+
+
+/*! Destroys the report and ensures GraphDumper won't use it any more. */
+
+GraphableReport::~GraphableReport()
+{
+    if ( reports )
+        reports->remove( this );
+}
+
+
+/*! \fn EString GraphableReport::report()
+
+    Implemented by subclasses to return the current state as zero or
+    more lines, each ending with CRLF. The first word of each line
+    should identify the report, and must not be the name of a
+    GraphableNumber.
+*/
+
+
 /*! \class GraphDumper graph.h
     This Connection subclass is responsible for transferring statistics
     en masse to any client that asks.
@@ -307,6 +350,11 @@ GraphDumper::GraphDumper( int fd )
         }
         ++i;
     }
+    List<GraphableReport>::Iterator r( reports );
+    while ( r ) {
+        enqueue( r->report() );
+        ++r;
+    }
     setTimeoutAfter( 0 );
 }
 
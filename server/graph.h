@@ -53,6 +53,17 @@ private:
 };
 
 
+class GraphableReport
+    : public Garbage
+{
+public:
+    GraphableReport();
+    virtual ~GraphableReport();
+
+    virtual EString report() = 0;
+};
+
+
 class GraphDumper
     : public Connection
 {
@@ -2,117 +2,965 @@
 
 #include "integerset.h"
 
-#include "estringlist.h"
-#include "map.h"
+#include "allocator.h"
 
+#include <string.h> // memcpy, memmove, memset
 
-static inline uint bitsSet( uint b )
+
+typedef unsigned long long Word;
+
+static const uint ChunkSize = 65536;
+static const uint WordBits = 8 * sizeof( Word );
+static const uint BitmapWords = ChunkSize / WordBits;
+static const uint BitmapBytes = ChunkSize / 8;
+static const uint ArrayLimit = 4096;
+
+
+// the number of bits set in w; a single instruction on CPUs which
+// have one
+static inline uint bitsSet( Word w )
+{
+    return __builtin_popcountll( w );
+}
+
+
+// the position of the lowest bit set in w, which must not be 0
+static inline uint lowestBit( Word w )
+{
+    return __builtin_ctzll( w );
+}
+
+
+// the position of the highest bit set in w, which must not be 0
+static inline uint highestBit( Word w )
+{
+    return WordBits - 1 - __builtin_clzll( w );
+}
+
+
+// a word with bits lo to hi set, both within the same word
+static inline Word mask( uint lo, uint hi )
+{
+    return ( ~(Word)0 << ( lo % WordBits ) ) &
+        ( ~(Word)0 >> ( WordBits - 1 - hi % WordBits ) );
+}
+
+
+// sets bits lo to hi, inclusive, in the bitmap w, and returns the
+// number of bits which weren't set before
+static uint setBits( Word * w, uint lo, uint hi )
 {
+    uint a = lo / WordBits;
+    uint b = hi / WordBits;
     uint r = 0;
-    while ( b ) {
-        switch ( b & 15 ) {
-        case 0:
-            r += 0;
-            break;
-        case 1:
-        case 2:
-        case 4:
-        case 8:
-            r += 1;
-            break;
-        case 3:
-        case 5:
-        case 6:
-        case 9:
-        case 10:
-        case 12:
-            r += 2;
-            break;
-        case 7:
-        case 11:
-        case 13:
-        case 14:
-            r += 3;
-            break;
-        case 15:
-            r += 4;
-            break;
-        }
-        b >>= 4;
+    if ( a == b ) {
+        Word m = mask( lo, hi );
+        r = bitsSet( m & ~w[a] );
+        w[a] |= m;
+        return r;
     }
+    Word m = mask( lo, WordBits - 1 );
+    r += bitsSet( m & ~w[a] );
+    w[a] |= m;
+    while ( ++a < b ) {
+        r += WordBits - bitsSet( w[a] );
+        w[a] = ~(Word)0;
+    }
+    m = mask( 0, hi );
+    r += bitsSet( m & ~w[b] );
+    w[b] |= m;
     return r;
-};
+}
 
 
-static const uint BlockSize = 8192;
-static const uint BitsPerUint = 8 * sizeof(uint);
-static const uint ArraySize = (BlockSize + BitsPerUint - 1) / BitsPerUint;
+// clears bits lo to hi, inclusive, in the bitmap w, and returns the
+// number of bits which were set before
+static uint clearBits( Word * w, uint lo, uint hi )
+{
+    uint a = lo / WordBits;
+    uint b = hi / WordBits;
+    uint r = 0;
+    if ( a == b ) {
+        Word m = mask( lo, hi );
+        r = bitsSet( m & w[a] );
+        w[a] &= ~m;
+        return r;
+    }
+    Word m = mask( lo, WordBits - 1 );
+    r += bitsSet( m & w[a] );
+    w[a] &= ~m;
+    while ( ++a < b ) {
+        r += bitsSet( w[a] );
+        w[a] = 0;
+    }
+    m = mask( 0, hi );
+    r += bitsSet( m & w[b] );
+    w[b] &= ~m;
+    return r;
+}
 
 
-class SetData
+// finds the first bit set at or after v in the bitmap w, stores the
+// last bit of the run of set bits starting there in end, and returns
+// the first. returns ChunkSize if there are no more bits set.
+static uint nextRun( const Word * w, uint v, uint & end )
+{
+    uint i = v / WordBits;
+    Word x = w[i] & ( ~(Word)0 << ( v % WordBits ) );
+    while ( !x && ++i < BitmapWords )
+        x = w[i];
+    if ( !x )
+        return ChunkSize;
+    uint s = i * WordBits + lowestBit( x );
+
+    x = ~w[i] & ( ~(Word)0 << ( s % WordBits ) );
+    while ( !x && ++i < BitmapWords )
+        x = ~w[i];
+    if ( x )
+        end = i * WordBits + lowestBit( x ) - 1;
+    else
+        end = ChunkSize - 1;
+    return s;
+}
+
+
+class Chunk
     : public Garbage
 {
 public:
-    SetData() {}
-
-    class Block
-        : public Garbage
-    {
-    public:
-        Block( uint s )
-            : Garbage(), start( s ), count( 0 ) {
-            setFirstNonPointer( &start );
-            uint i = 0;
-            while ( i < ArraySize )
-                contents[i++] = 0;
-        }
-        Block( const Block & other )
-            : Garbage(), start( other.start ), count( other.count ) {
-            setFirstNonPointer( &start );
-            uint i = 0;
-            while ( i < ArraySize ) {
-                contents[i] = other.contents[i];
-                ++i;
+    enum Kind { Array, Bitmap, Run };
+
+    Chunk( uint k )
+        : Garbage(), values( 0 ), bits( 0 ),
+          key( k ), kind( Array ), count( 0 ), n( 0 ), capacity( 0 ),
+          rank( 0 ) {
+        setFirstNonPointer( &key );
+    }
+
+    Chunk( const Chunk & other )
+        : Garbage(), values( 0 ), bits( 0 ),
+          key( other.key ), kind( other.kind ), count( other.count ),
+          n( other.n ), capacity( 0 ), rank( other.rank ) {
+        setFirstNonPointer( &key );
+        if ( kind == Bitmap ) {
+            bits = (Word*)Allocator::alloc( BitmapBytes, 0 );
+            memcpy( bits, other.bits, BitmapBytes );
+        }
+        else if ( n ) {
+            reserve( other.used() );
+            memcpy( values, other.values, other.used() * sizeof( ushort ) );
+        }
+    }
+
+    // Array: n sorted values. Run: n (first, last) pairs, sorted and
+    // neither overlapping nor adjacent.
+    ushort * values;
+    // Bitmap: BitmapWords words.
+    Word * bits;
+    // no pointers after this line
+    uint key;
+    Kind kind;
+    uint count;
+    uint n;
+    uint capacity;
+    uint rank;
+
+    uint first() const { return key * ChunkSize; }
+    uint used() const { return kind == Run ? 2 * n : n; }
+
+    void reserve( uint );
+
+    uint lowerBound( uint ) const;
+    uint runAt( uint ) const;
+    void replaceRuns( uint, uint, const uint *, uint );
+
+    bool contains( uint ) const;
+    uint smallest() const;
+    uint largest() const;
+    uint rankOf( uint ) const;
+    uint select( uint ) const;
+    uint runFrom( uint, uint & ) const;
+
+    void insert( uint, uint );
+    void erase( uint, uint );
+
+    void add( const Chunk * );
+    void remove( const Chunk * );
+    Chunk * intersection( const Chunk * ) const;
+    bool includes( const Chunk * ) const;
+
+    void toBitmap( Word * ) const;
+    void setBitmap( const Word * );
+    void optimise();
+};
+
+
+// makes room for at least e ushorts in values
+void Chunk::reserve( uint e )
+{
+    if ( capacity >= e )
+        return;
+    uint c = capacity * 2;
+    if ( c < e )
+        c = e;
+    if ( c < 4 )
+        c = 4;
+    ushort * v = (ushort*)Allocator::alloc( c * sizeof( ushort ), 0 );
+    if ( values )
+        memcpy( v, values, used() * sizeof( ushort ) );
+    values = v;
+    capacity = c;
+}
+
+
+// returns the index of the first Array value >= v
+uint Chunk::lowerBound( uint v ) const
+{
+    uint lo = 0;
+    uint hi = n;
+    while ( lo < hi ) {
+        uint m = ( lo + hi ) / 2;
+        if ( values[m] < v )
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+
+// returns the index of the first run whose last value is >= v
+uint Chunk::runAt( uint v ) const
+{
+    uint lo = 0;
+    uint hi = n;
+    while ( lo < hi ) {
+        uint m = ( lo + hi ) / 2;
+        if ( values[2*m+1] < v )
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+
+// replaces runs i to j-1 with the k (first, last) pairs in r
+void Chunk::replaceRuns( uint i, uint j, const uint * r, uint k )
+{
+    if ( k > j - i ) {
+        reserve( 2 * ( n + k - ( j - i ) ) );
+        memmove( values + 2 * ( i + k ), values + 2 * j,
+                 2 * ( n - j ) * sizeof( ushort ) );
+    }
+    else if ( k < j - i ) {
+        memmove( values + 2 * ( i + k ), values + 2 * j,
+                 2 * ( n - j ) * sizeof( ushort ) );
+    }
+    n = n + k - ( j - i );
+    uint x = 0;
+    while ( x < 2 * k ) {
+        values[2*i+x] = r[x];
+        x++;
+    }
+}
+
+
+bool Chunk::contains( uint v ) const
+{
+    if ( kind == Bitmap )
+        return ( bits[v/WordBits] >> ( v % WordBits ) ) & 1;
+    if ( kind == Array ) {
+        uint i = lowerBound( v );
+        return i < n && values[i] == v;
+    }
+    uint i = runAt( v );
+    return i < n && values[2*i] <= v;
+}
+
+
+uint Chunk::smallest() const
+{
+    if ( kind != Bitmap )
+        return values[0];
+    uint i = 0;
+    while ( !bits[i] )
+        i++;
+    return i * WordBits + lowestBit( bits[i] );
+}
+
+
+uint Chunk::largest() const
+{
+    if ( kind == Array )
+        return values[n-1];
+    if ( kind == Run )
+        return values[2*n-1];
+    uint i = BitmapWords - 1;
+    while ( !bits[i] )
+        i--;
+    return i * WordBits + highestBit( bits[i] );
+}
+
+
+// returns the number of members <= v
+uint Chunk::rankOf( uint v ) const
+{
+    if ( kind == Array )
+        return lowerBound( v + 1 );
+
+    uint r = 0;
+    uint i = 0;
+    if ( kind == Run ) {
+        while ( i < n && values[2*i+1] < v ) {
+            r += values[2*i+1] - values[2*i] + 1;
+            i++;
+        }
+        if ( i < n && values[2*i] <= v )
+            r += v - values[2*i] + 1;
+        return r;
+    }
+
+    uint w = v / WordBits;
+    while ( i < w )
+        r += bitsSet( bits[i++] );
+    return r + bitsSet( bits[w] & mask( 0, v ) );
+}
+
+
+// returns member number i, counting from 0
+uint Chunk::select( uint i ) const
+{
+    if ( kind == Array )
+        return values[i];
+
+    uint j = 0;
+    if ( kind == Run ) {
+        while ( i > (uint)( values[2*j+1] - values[2*j] ) ) {
+            i -= values[2*j+1] - values[2*j] + 1;
+            j++;
+        }
+        return values[2*j] + i;
+    }
+
+    uint b = bitsSet( bits[0] );
+    while ( i >= b ) {
+        i -= b;
+        b = bitsSet( bits[++j] );
+    }
+    Word x = bits[j];
+    while ( i-- )
+        x &= x - 1;
+    return j * WordBits + lowestBit( x );
+}
+
+
+// returns the first member >= v and sets end to the last member of
+// the consecutive run starting there, or returns ChunkSize
+uint Chunk::runFrom( uint v, uint & end ) const
+{
+    if ( kind == Bitmap )
+        return nextRun( bits, v, end );
+
+    if ( kind == Run ) {
+        uint i = runAt( v );
+        if ( i >= n )
+            return ChunkSize;
+        end = values[2*i+1];
+        if ( values[2*i] > v )
+            return values[2*i];
+        return v;
+    }
+
+    uint i = lowerBound( v );
+    if ( i >= n )
+        return ChunkSize;
+    uint j = i;
+    while ( j + 1 < n && values[j+1] == values[j] + 1 )
+        j++;
+    end = values[j];
+    return values[i];
+}
+
+
+// adds lo to hi, inclusive
+void Chunk::insert( uint lo, uint hi )
+{
+    if ( kind == Bitmap ) {
+        count += setBits( bits, lo, hi );
+        return;
+    }
+
+    if ( kind == Array ) {
+        if ( hi - lo >= 16 ) {
+            optimise();
+            if ( kind == Array ) {
+                // few values, but scattered. store them as runs.
+                uint * r = (uint*)Allocator::alloc( 2 * n * sizeof( uint ), 0 );
+                uint i = 0;
+                while ( i < n ) {
+                    r[2*i] = values[i];
+                    r[2*i+1] = values[i];
+                    i++;
+                }
+                uint c = n;
+                kind = Run;
+                n = 0;
+                replaceRuns( 0, 0, r, c );
             }
+            insert( lo, hi );
+            return;
+        }
+        uint v = lo;
+        while ( v <= hi ) {
+            uint i = lowerBound( v );
+            if ( i >= n || values[i] != v ) {
+                if ( n == ArrayLimit - 1 ) {
+                    optimise();
+                    if ( kind == Array ) {
+                        bits = (Word*)Allocator::alloc( BitmapBytes, 0 );
+                        toBitmap( bits );
+                        kind = Bitmap;
+                        values = 0;
+                        capacity = 0;
+                    }
+                    insert( v, hi );
+                    return;
+                }
+                reserve( n + 1 );
+                memmove( values + i + 1, values + i,
+                         ( n - i ) * sizeof( ushort ) );
+                values[i] = v;
+                n++;
+                count++;
+            }
+            v++;
+        }
+        return;
+    }
+
+    // extend a run, perhaps merging several, or add a new one
+    uint i = lo ? runAt( lo - 1 ) : 0;
+    uint j = i;
+    uint r[2];
+    r[0] = lo;
+    r[1] = hi;
+    while ( j < n && values[2*j] <= hi + 1 ) {
+        if ( values[2*j] < r[0] )
+            r[0] = values[2*j];
+        if ( values[2*j+1] > r[1] )
+            r[1] = values[2*j+1];
+        count -= values[2*j+1] - values[2*j] + 1;
+        j++;
+    }
+    replaceRuns( i, j, r, 1 );
+    count += r[1] - r[0] + 1;
+    if ( 4 * n >= BitmapBytes )
+        optimise();
+}
+
+
+// removes lo to hi, inclusive
+void Chunk::erase( uint lo, uint hi )
+{
+    if ( kind == Bitmap ) {
+        count -= clearBits( bits, lo, hi );
+        return;
+    }
+
+    if ( kind == Array ) {
+        uint i = lowerBound( lo );
+        uint j = lowerBound( hi + 1 );
+        if ( i == j )
+            return;
+        memmove( values + i, values + j, ( n - j ) * sizeof( ushort ) );
+        n -= j - i;
+        count = n;
+        return;
+    }
+
+    uint i = runAt( lo );
+    uint j = i;
+    uint r[4];
+    uint k = 0;
+    while ( j < n && values[2*j] <= hi ) {
+        uint f = values[2*j];
+        uint l = values[2*j+1];
+        if ( f < lo ) {
+            r[k++] = f;
+            r[k++] = lo - 1;
+        }
+        if ( l > hi ) {
+            r[k++] = hi + 1;
+            r[k++] = l;
         }
+        count -= l - f + 1;
+        j++;
+    }
+    if ( i == j )
+        return;
+    uint x = 0;
+    while ( x < k ) {
+        count += r[x+1] - r[x] + 1;
+        x += 2;
+    }
+    replaceRuns( i, j, r, k / 2 );
+}
 
-        uint start;
-        uint count;
-        uint contents[ArraySize];
 
-        inline void insert( uint n ) {
-            if ( n < start )
-                return;
-            uint i = n - start;
-            if ( i >= BlockSize )
+// adds the members of o
+void Chunk::add( const Chunk * o )
+{
+    if ( kind == Bitmap && o->kind == Bitmap ) {
+        count = 0;
+        uint i = 0;
+        while ( i < BitmapWords ) {
+            bits[i] |= o->bits[i];
+            count += bitsSet( bits[i] );
+            i++;
+        }
+        return;
+    }
+
+    if ( kind == Bitmap ) {
+        uint v = 0;
+        uint e = 0;
+        while ( ( v = o->runFrom( v, e ) ) < ChunkSize ) {
+            count += setBits( bits, v, e );
+            v = e + 1;
+            if ( v >= ChunkSize )
+                break;
+        }
+        return;
+    }
+
+    if ( kind == Run && o->kind == Run ) {
+        uint i = 0;
+        while ( i < o->n ) {
+            insert( o->values[2*i], o->values[2*i+1] );
+            if ( kind != Run ) {
+                add( o );
                 return;
+            }
+            i++;
+        }
+        return;
+    }
 
-            if ( !(contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) )
-                count++;
-            contents[i/BitsPerUint] |= 1 << ( i % BitsPerUint );
+    if ( kind == Array && o->kind == Array && n + o->n < ArrayLimit ) {
+        ushort * v = (ushort*)Allocator::alloc( ( n + o->n ) * sizeof( ushort ),
+                                                0 );
+        uint a = 0;
+        uint b = 0;
+        uint c = 0;
+        while ( a < n || b < o->n ) {
+            if ( b >= o->n || ( a < n && values[a] < o->values[b] ) )
+                v[c++] = values[a++];
+            else if ( a >= n || o->values[b] < values[a] )
+                v[c++] = o->values[b++];
+            else
+                v[c++] = o->values[b++], a++;
+        }
+        values = v;
+        capacity = n + o->n;
+        n = c;
+        count = c;
+        return;
+    }
+
+    Word x[BitmapWords];
+    Word y[BitmapWords];
+    toBitmap( x );
+    o->toBitmap( y );
+    uint i = 0;
+    while ( i < BitmapWords ) {
+        x[i] |= y[i];
+        i++;
+    }
+    setBitmap( x );
+}
+
+
+// removes the members of o
+void Chunk::remove( const Chunk * o )
+{
+    if ( kind == Array ) {
+        uint a = 0;
+        uint c = 0;
+        while ( a < n ) {
+            if ( !o->contains( values[a] ) )
+                values[c++] = values[a];
+            a++;
+        }
+        n = c;
+        count = c;
+        return;
+    }
+
+    if ( o->kind != Bitmap && ( kind == Bitmap || o->count < 64 ) ) {
+        uint v = 0;
+        uint e = 0;
+        while ( ( v = o->runFrom( v, e ) ) < ChunkSize ) {
+            erase( v, e );
+            v = e + 1;
+            if ( v >= ChunkSize )
+                break;
+        }
+        return;
+    }
+
+    Word x[BitmapWords];
+    Word y[BitmapWords];
+    toBitmap( x );
+    o->toBitmap( y );
+    uint i = 0;
+    while ( i < BitmapWords ) {
+        x[i] &= ~y[i];
+        i++;
+    }
+    setBitmap( x );
+}
+
+
+// returns a new chunk containing the members of both this and o
+Chunk * Chunk::intersection( const Chunk * o ) const
+{
+    Chunk * r = new Chunk( key );
+
+    if ( kind == Array || o->kind == Array ) {
+        const Chunk * a = this;
+        const Chunk * b = o;
+        if ( a->kind != Array || ( b->kind == Array && b->n < a->n ) ) {
+            a = o;
+            b = this;
+        }
+        r->reserve( a->n );
+        uint i = 0;
+        if ( b->kind == Array ) {
+            // merge, galloping through b if it's much bigger than a
+            uint j = 0;
+            while ( i < a->n && j < b->n ) {
+                if ( a->values[i] < b->values[j] ) {
+                    i++;
+                }
+                else if ( b->values[j] < a->values[i] ) {
+                    if ( b->n > 16 * a->n ) {
+                        uint lo = j;
+                        uint hi = b->n;
+                        while ( lo < hi ) {
+                            uint m = ( lo + hi ) / 2;
+                            if ( b->values[m] < a->values[i] )
+                                lo = m + 1;
+                            else
+                                hi = m;
+                        }
+                        j = lo;
+                    }
+                    else {
+                        j++;
+                    }
+                }
+                else {
+                    r->values[r->n++] = a->values[i];
+                    i++;
+                    j++;
+                }
+            }
+        }
+        else {
+            while ( i < a->n ) {
+                if ( b->contains( a->values[i] ) )
+                    r->values[r->n++] = a->values[i];
+                i++;
+            }
+        }
+        r->count = r->n;
+        return r;
+    }
+
+    if ( kind == Run && o->kind == Run ) {
+        r->kind = Run;
+        r->reserve( 2 * ( n + o->n ) );
+        uint i = 0;
+        uint j = 0;
+        while ( i < n && j < o->n ) {
+            uint f = values[2*i];
+            if ( o->values[2*j] > f )
+                f = o->values[2*j];
+            uint l = values[2*i+1];
+            if ( o->values[2*j+1] < l )
+                l = o->values[2*j+1];
+            if ( f <= l ) {
+                r->values[2*r->n] = f;
+                r->values[2*r->n+1] = l;
+                r->n++;
+                r->count += l - f + 1;
+            }
+            if ( values[2*i+1] < o->values[2*j+1] )
+                i++;
+            else
+                j++;
+        }
+        return r;
+    }
+
+    Word x[BitmapWords];
+    Word y[BitmapWords];
+    toBitmap( x );
+    o->toBitmap( y );
+    uint i = 0;
+    while ( i < BitmapWords ) {
+        x[i] &= y[i];
+        i++;
+    }
+    r->setBitmap( x );
+    return r;
+}
+
+
+// returns true if every member of o is a member of this
+bool Chunk::includes( const Chunk * o ) const
+{
+    if ( o->count > count )
+        return false;
+
+    if ( o->kind == Array ) {
+        uint i = 0;
+        while ( i < o->n ) {
+            if ( !contains( o->values[i] ) )
+                return false;
+            i++;
+        }
+        return true;
+    }
+
+    if ( o->kind == Run && kind == Run ) {
+        uint i = 0;
+        while ( i < o->n ) {
+            uint j = runAt( o->values[2*i] );
+            if ( j >= n || values[2*j] > o->values[2*i] ||
+                 values[2*j+1] < o->values[2*i+1] )
+                return false;
+            i++;
         }
+        return true;
+    }
 
-        void recount() {
-            count = 0;
-            uint i = 0;
-            while ( i < ArraySize )
-                count += bitsSet( contents[i++] );
+    Word x[BitmapWords];
+    Word y[BitmapWords];
+    toBitmap( x );
+    o->toBitmap( y );
+    uint i = 0;
+    while ( i < BitmapWords ) {
+        if ( ( x[i] & y[i] ) != y[i] )
+            return false;
+        i++;
+    }
+    return true;
+}
+
+
+// writes the members to the bitmap w
+void Chunk::toBitmap( Word * w ) const
+{
+    if ( kind == Bitmap ) {
+        memcpy( w, bits, BitmapBytes );
+        return;
+    }
+    memset( w, 0, BitmapBytes );
+    uint i = 0;
+    if ( kind == Array ) {
+        while ( i < n ) {
+            w[values[i]/WordBits] |= (Word)1 << ( values[i] % WordBits );
+            i++;
         }
+    }
+    else {
+        while ( i < n ) {
+            setBits( w, values[2*i], values[2*i+1] );
+            i++;
+        }
+    }
+}
+
 
-        void merge( Block * other ) {
-            count = 0;
-            uint i = 0;
-            while ( i < ArraySize ) {
-                contents[i] |= other->contents[i];
-                ++i;
+// replaces the contents with the members of the bitmap w, using
+// whichever representation needs the least memory
+void Chunk::setBitmap( const Word * w )
+{
+    uint c = 0;
+    uint runs = 0;
+    Word carry = 0;
+    uint i = 0;
+    while ( i < BitmapWords ) {
+        c += bitsSet( w[i] );
+        runs += bitsSet( w[i] & ~( ( w[i] << 1 ) | carry ) );
+        carry = w[i] >> ( WordBits - 1 );
+        i++;
+    }
+
+    count = c;
+    n = 0;
+    if ( 4 * runs < BitmapBytes && ( runs * 2 < c || c >= ArrayLimit ) ) {
+        kind = Run;
+        bits = 0;
+        reserve( 2 * runs );
+        uint v = 0;
+        uint e = 0;
+        while ( ( v = nextRun( w, v, e ) ) < ChunkSize ) {
+            values[2*n] = v;
+            values[2*n+1] = e;
+            n++;
+            v = e + 1;
+            if ( v >= ChunkSize )
+                break;
+        }
+    }
+    else if ( c < ArrayLimit ) {
+        kind = Array;
+        bits = 0;
+        reserve( c );
+        i = 0;
+        while ( i < BitmapWords ) {
+            Word x = w[i];
+            while ( x ) {
+                values[n++] = i * WordBits + lowestBit( x );
+                x &= x - 1;
             }
+            i++;
         }
-    };
+    }
+    else {
+        kind = Bitmap;
+        values = 0;
+        capacity = 0;
+        if ( !bits )
+            bits = (Word*)Allocator::alloc( BitmapBytes, 0 );
+        if ( bits != w )
+            memcpy( bits, w, BitmapBytes );
+    }
+}
+
+
+// switches to whichever representation needs the least memory
+void Chunk::optimise()
+{
+    Word b[BitmapWords];
+    toBitmap( b );
+    setBitmap( b );
+}
 
-    Map<Block> b;
+
+class SetData
+    : public Garbage
+{
+public:
+    SetData()
+        : Garbage(), chunks( 0 ), n( 0 ), capacity( 0 ), ranked( false ) {
+        setFirstNonPointer( &n );
+    }
+
+    // sorted by key; none are empty
+    Chunk ** chunks;
+    // no pointers after this line
+    uint n;
+    uint capacity;
+    bool ranked;
+
+    uint position( uint ) const;
+    Chunk * find( uint ) const;
+    Chunk * make( uint );
+    void insert( uint, Chunk * );
+    void removeAt( uint );
+    void summarise();
 };
 
 
+// returns the index of the first chunk whose key is >= k
+uint SetData::position( uint k ) const
+{
+    uint lo = 0;
+    uint hi = n;
+    while ( lo < hi ) {
+        uint m = ( lo + hi ) / 2;
+        if ( chunks[m]->key < k )
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+
+// returns the chunk for key k, or a null pointer
+Chunk * SetData::find( uint k ) const
+{
+    uint i = position( k );
+    if ( i < n && chunks[i]->key == k )
+        return chunks[i];
+    return 0;
+}
+
+
+// returns the chunk for key k, creating an empty one if necessary
+Chunk * SetData::make( uint k )
+{
+    uint i = position( k );
+    if ( i < n && chunks[i]->key == k )
+        return chunks[i];
+    Chunk * c = new Chunk( k );
+    insert( i, c );
+    return c;
+}
+
+
+// inserts c at index i
+void SetData::insert( uint i, Chunk * c )
+{
+    if ( n == capacity ) {
+        uint nc = capacity * 2;
+        if ( nc < 4 )
+            nc = 4;
+        Chunk ** a = (Chunk**)Allocator::alloc( nc * sizeof( Chunk * ) );
+        if ( n )
+            memcpy( a, chunks, n * sizeof( Chunk * ) );
+        chunks = a;
+        capacity = nc;
+    }
+    memmove( chunks + i + 1, chunks + i, ( n - i ) * sizeof( Chunk * ) );
+    chunks[i] = c;
+    n++;
+    ranked = false;
+}
+
+
+// removes the chunk at index i
+void SetData::removeAt( uint i )
+{
+    memmove( chunks + i, chunks + i + 1, ( n - i - 1 ) * sizeof( Chunk * ) );
+    n--;
+    chunks[n] = 0;
+    ranked = false;
+}
+
+
+// records in each chunk how many members precede it, so value() and
+// index() can find the right chunk by binary search
+void SetData::summarise()
+{
+    if ( ranked )
+        return;
+    uint r = 0;
+    uint i = 0;
+    while ( i < n ) {
+        chunks[i]->rank = r;
+        r += chunks[i]->count;
+        i++;
+    }
+    ranked = true;
+}
+
+
 /*! \class IntegerSet integerset.h
     This class contains a set of integers.
 
@@ -120,6 +968,14 @@ public:
     members to the set, find its members by value() or index() (sorted
     by size, with 1 first), look for the largest contained number, and
     produce an SQL "where" clause matching its contents.
+
+    The set is split into chunks of 65536 numbers, and each chunk is
+    stored in whichever of three forms is smallest: a sorted array of
+    16-bit offsets for sparse chunks, a bitmap for dense ones, or a
+    list of ranges for chunks which consist mostly of consecutive
+    numbers, as the UIDs in a mailbox do. Each chunk knows how many
+    numbers the preceding chunks contain, so value() and index() need
+    only look at one chunk.
 */
 
 
@@ -149,10 +1005,10 @@ IntegerSet& IntegerSet::operator=( const IntegerSet & other )
         return *this;
 
     d = new SetData;
-    Map<SetData::Block>::Iterator i( other.d->b );
-    while ( i ) {
-        d->b.insert( i->start, new SetData::Block( *i ) );
-        ++i;
+    uint i = 0;
+    while ( i < other.d->n ) {
+        d->insert( i, new Chunk( *other.d->chunks[i] ) );
+        i++;
     }
     return *this;
 }
@@ -177,25 +1033,20 @@ void IntegerSet::add( uint n1, uint n2 )
         return;
     }
 
-    uint n = n1;
-    uint s = n - (n%BlockSize);
-    SetData::Block * b = d->b.find( s );
-    if ( !b ) {
-        b = new SetData::Block( s );
-        d->b.insert( s, b );
-    }
-    b->insert( n );
-    while ( n < n2 ) {
-        ++n;
-        if ( s != n - (n%BlockSize) ) {
-            s = n - (n%BlockSize);
-            b = d->b.find( s );
-            if ( !b ) {
-                b = new SetData::Block( s );
-                d->b.insert( s, b );
-            }
-        }
-        b->insert( n );
+    d->ranked = false;
+    uint k = n1 / ChunkSize;
+    while ( k <= n2 / ChunkSize ) {
+        Chunk * c = d->make( k );
+        uint lo = 0;
+        uint hi = ChunkSize - 1;
+        if ( k == n1 / ChunkSize )
+            lo = n1 % ChunkSize;
+        if ( k == n2 / ChunkSize )
+            hi = n2 % ChunkSize;
+        c->insert( lo, hi );
+        if ( k == n2 / ChunkSize )
+            break;
+        k++;
     }
 }
 
@@ -208,15 +1059,16 @@ void IntegerSet::add( const IntegerSet & set )
         *this = set;
         return;
     }
-    Map<SetData::Block>::Iterator i( set.d->b );
-    while( i ) {
-        SetData::Block * b = d->b.find( i->start );
-        if ( b )
-            b->merge( i );
+    d->ranked = false;
+    uint i = 0;
+    while ( i < set.d->n ) {
+        Chunk * o = set.d->chunks[i];
+        uint p = d->position( o->key );
+        if ( p < d->n && d->chunks[p]->key == o->key )
+            d->chunks[p]->add( o );
         else
-            d->b.insert( i->start, new SetData::Block( *i ) );
-
-        ++i;
+            d->insert( p, new Chunk( *o ) );
+        i++;
     }
 }
 
@@ -227,7 +1079,9 @@ void IntegerSet::add( const IntegerSet & set )
 
 uint IntegerSet::smallest() const
 {
-    return value( 1 );
+    if ( !d->n )
+        return 0;
+    return d->chunks[0]->first() + d->chunks[0]->smallest();
 }
 
 
@@ -237,17 +1091,10 @@ uint IntegerSet::smallest() const
 
 uint IntegerSet::largest() const
 {
-    SetData::Block * b = d->b.last();
-    if ( !b )
+    if ( !d->n )
         return 0;
-    uint i = ArraySize - 1;
-    while ( i && !b->contents[i] )
-        i--;
-    uint x = b->contents[i];
-    uint j = BitsPerUint-1;
-    while ( !(x & 1 << j) )
-        j--;
-    return b->start + i * BitsPerUint + j;
+    Chunk * c = d->chunks[d->n-1];
+    return c->first() + c->largest();
 }
 
 
@@ -255,14 +1102,11 @@ uint IntegerSet::largest() const
 
 uint IntegerSet::count() const
 {
-    recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i ) {
-        c += i->count;
-        ++i;
-    }
-    return c;
+    if ( !d->n )
+        return 0;
+    d->summarise();
+    Chunk * c = d->chunks[d->n-1];
+    return c->rank + c->count;
 }
 
 
@@ -270,7 +1114,7 @@ uint IntegerSet::count() const
 
 bool IntegerSet::isEmpty() const
 {
-    return d->b.isEmpty();
+    return d->n == 0;
 }
 
 
@@ -283,33 +1127,24 @@ bool IntegerSet::isEmpty() const
 
 uint IntegerSet::value( uint index ) const
 {
-    if ( !index )
+    if ( !index || !d->n )
         return 0;
-    recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i && c + i->count < index ) {
-        c += i->count;
-        ++i;
+    d->summarise();
+
+    // find the last chunk which starts before index
+    uint lo = 0;
+    uint hi = d->n;
+    while ( hi - lo > 1 ) {
+        uint m = ( lo + hi ) / 2;
+        if ( d->chunks[m]->rank < index )
+            lo = m;
+        else
+            hi = m;
     }
-    if ( !i )
+    Chunk * c = d->chunks[lo];
+    if ( index > c->rank + c->count )
         return 0;
-
-    uint bs = bitsSet( i->contents[0] );
-    uint n = 0;
-    while ( c + bs < index ) {
-        c += bs;
-        n++;
-        bs = bitsSet( i->contents[n] );
-    }
-    uint j = 0;
-    while ( c < index && j < BitsPerUint ) {
-        if ( i->contents[n] & ( 1 << j ) )
-            c++;
-        if ( c < index )
-            j++;
-    }
-    return i->start + n*BitsPerUint + j;
+    return c->first() + c->select( index - c->rank - 1 );
 }
 
 
@@ -322,29 +1157,11 @@ uint IntegerSet::value( uint index ) const
 
 uint IntegerSet::index( uint value ) const
 {
-    recount();
-    uint i = 0;
-    Map<SetData::Block>::Iterator b( d->b );
-    while ( b && b->start + BlockSize - 1 < value ) {
-        i += b->count;
-        ++b;
-    }
-    if ( !b )
-        return 0;
-
-    if ( b->start > value )
-        return 0;
-
-    uint vi = (value-b->start)/BitsPerUint;
-    if ( !(b->contents[vi] & 1 << (value%BitsPerUint)) )
+    Chunk * c = d->find( value / ChunkSize );
+    if ( !c || !c->contains( value % ChunkSize ) )
         return 0;
-    uint n = 0;
-    while ( n < vi ) {
-        i += bitsSet( b->contents[n] );
-        n++;
-    }
-    i += bitsSet ( b->contents[vi] & ~( 0xfffffffe << (value%BitsPerUint) ) );
-    return i;
+    d->summarise();
+    return c->rank + c->rankOf( value % ChunkSize );
 }
 
 
@@ -352,13 +1169,8 @@ uint IntegerSet::index( uint value ) const
 
 bool IntegerSet::contains( uint value ) const
 {
-    SetData::Block * b = d->b.find( value - (value%BlockSize) );
-    if ( !b )
-        return false;
-    uint n = value%BlockSize;
-    if ( b->contents[n/BitsPerUint] & ( 1 << n%BitsPerUint ) )
-        return true;
-    return false;
+    Chunk * c = d->find( value / ChunkSize );
+    return c && c->contains( value % ChunkSize );
 }
 
 
@@ -367,26 +1179,7 @@ bool IntegerSet::contains( uint value ) const
 
 void IntegerSet::remove( uint value )
 {
-    SetData::Block * b = d->b.find( value - (value%BlockSize) );
-    if ( !b )
-        return;
-
-    uint i = value - b->start;
-    if ( i >= BlockSize )
-        return;
-
-    if ( ! ( (b->contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) ) )
-        return;
-
-    b->contents[i/BitsPerUint] &= ~(1 << ( i % BitsPerUint ) );
-    if ( b->count ) {
-        b->count--;
-        if ( !b->count )
-            d->b.remove( b->start );
-    }
-    else {
-        recount();
-    }
+    remove( value, value );
 }
 
 
@@ -394,9 +1187,27 @@ void IntegerSet::remove( uint value )
 
 void IntegerSet::remove( uint v1, uint v2 )
 {
-    IntegerSet r;
-    r.add( v1, v2 );
-    remove( r );
+    if ( v2 < v1 ) {
+        remove( v2, v1 );
+        return;
+    }
+
+    uint i = d->position( v1 / ChunkSize );
+    while ( i < d->n && d->chunks[i]->key <= v2 / ChunkSize ) {
+        Chunk * c = d->chunks[i];
+        uint lo = 0;
+        uint hi = ChunkSize - 1;
+        if ( c->key == v1 / ChunkSize )
+            lo = v1 % ChunkSize;
+        if ( c->key == v2 / ChunkSize )
+            hi = v2 % ChunkSize;
+        c->erase( lo, hi );
+        d->ranked = false;
+        if ( c->count )
+            i++;
+        else
+            d->removeAt( i );
+    }
 }
 
 
@@ -404,28 +1215,30 @@ void IntegerSet::remove( uint v1, uint v2 )
 
 void IntegerSet::remove( const IntegerSet & other )
 {
-    Map<SetData::Block>::Iterator mine( d->b );
-    Map<SetData::Block>::Iterator hers( other.d->b );
-    while ( mine && hers ) {
-        while ( mine && mine->start < hers->start )
-            ++mine;
-        if ( mine )
-            while ( hers && hers->start < mine->start )
-                ++hers;
-        if ( mine && hers ) {
-            uint i = 0;
-            uint u = 0;
-            uint s = mine->start;
-            while ( i < ArraySize ) {
-                mine->contents[i] &= ~ hers->contents[i];
-                u |= mine->contents[i];
+    if ( &other == this ) {
+        clear();
+        return;
+    }
+
+    uint i = 0;
+    uint j = 0;
+    while ( i < d->n && j < other.d->n ) {
+        Chunk * mine = d->chunks[i];
+        Chunk * hers = other.d->chunks[j];
+        if ( mine->key < hers->key ) {
+            i++;
+        }
+        else if ( hers->key < mine->key ) {
+            j++;
+        }
+        else {
+            mine->remove( hers );
+            d->ranked = false;
+            if ( mine->count )
                 i++;
-            }
-            mine->count = 0;
-            ++mine;
-            ++hers;
-            if ( !u )
-                d->b.remove( s );
+            else
+                d->removeAt( i );
+            j++;
         }
     }
 }
@@ -437,27 +1250,23 @@ void IntegerSet::remove( const IntegerSet & other )
 IntegerSet IntegerSet::intersection( const IntegerSet & other ) const
 {
     IntegerSet r;
-    Map<SetData::Block>::Iterator mine( d->b );
-    Map<SetData::Block>::Iterator hers( other.d->b );
-    while ( mine && hers ) {
-        while ( mine && mine->start < hers->start )
-            ++mine;
-        if ( mine )
-            while ( hers && hers->start < mine->start )
-                ++hers;
-        if ( mine && hers ) {
-            SetData::Block * b = new SetData::Block( mine->start );
-            uint u = 0;
-            uint i = 0;
-            while ( i < ArraySize ) {
-                b->contents[i] = mine->contents[i] & hers->contents[i];
-                u |= b->contents[i];
-                i++;
-            }
-            if ( u )
-                r.d->b.insert( b->start, b );
-            ++mine;
-            ++hers;
+    uint i = 0;
+    uint j = 0;
+    while ( i < d->n && j < other.d->n ) {
+        Chunk * mine = d->chunks[i];
+        Chunk * hers = other.d->chunks[j];
+        if ( mine->key < hers->key ) {
+            i++;
+        }
+        else if ( hers->key < mine->key ) {
+            j++;
+        }
+        else {
+            Chunk * c = mine->intersection( hers );
+            if ( c->count )
+                r.d->insert( r.d->n, c );
+            i++;
+            j++;
         }
     }
     return r;
@@ -501,36 +1310,26 @@ EString IntegerSet::set() const
     uint s = 0;
     uint e = 0;
 
-    Map<SetData::Block>::Iterator it( d->b );
-    while ( it ) {
-        uint v = it->start;
-        uint n = 0;
-        while ( n < ArraySize ) {
-            uint j = 0;
-            uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !e ) {
-                            s = v + j;
-                            e = s;
-                        }
-                        else if ( e + 1 < v + j ) {
-                            addRange( r, s, e );
-                            s = v + j;
-                            e = s;
-                        }
-                        else {
-                            e = v + j;
-                        }
-                    }
-                    j++;
-                }
+    uint i = 0;
+    while ( i < d->n ) {
+        Chunk * c = d->chunks[i];
+        uint v = 0;
+        uint l = 0;
+        while ( ( v = c->runFrom( v, l ) ) < ChunkSize ) {
+            if ( e && e + 1 == c->first() + v ) {
+                e = c->first() + l;
             }
-            n++;
-            v += BitsPerUint;
+            else {
+                if ( e )
+                    addRange( r, s, e );
+                s = c->first() + v;
+                e = c->first() + l;
+            }
+            v = l + 1;
+            if ( v >= ChunkSize )
+                break;
         }
-        ++it;
+        i++;
     }
     if ( e )
         addRange( r, s, e );
@@ -547,45 +1346,80 @@ EString IntegerSet::csl() const
     EString r;
     r.reserve( 2222 );
 
-    Map<SetData::Block>::Iterator it( d->b );
-    while ( it ) {
-        uint n = 0;
-        while ( n < ArraySize ) {
-            uint j = 0;
-            uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !r.isEmpty() )
-                            r.append( ',' );
-                        r.appendNumber( it->start + n * BitsPerUint + j );
-                    }
-                    j++;
-                }
+    uint i = 0;
+    while ( i < d->n ) {
+        Chunk * c = d->chunks[i];
+        uint v = 0;
+        uint l = 0;
+        while ( ( v = c->runFrom( v, l ) ) < ChunkSize ) {
+            while ( v <= l ) {
+                if ( !r.isEmpty() )
+                    r.append( ',' );
+                r.appendNumber( c->first() + v );
+                v++;
             }
-            n++;
+            if ( v >= ChunkSize )
+                break;
         }
-        ++it;
+        i++;
     }
     return r;
 }
 
 
-/*! This private helper ensures that all blocks have an accurate count
-    of set bits, and that no blocks are empty.
+// appends the 32-bit big-endian representation of n to r
+static inline void appendInt32( char * r, uint n )
+{
+    r[0] = (char)( n >> 24 );
+    r[1] = (char)( n >> 16 );
+    r[2] = (char)( n >> 8 );
+    r[3] = (char)( n );
+}
+
+
+/*! Returns the contents of this set as a one-dimensional integer
+    array in the PostgreSQL binary format, suitable for binding
+    directly to an int4[] parameter. See Query::bind().
+
+    The values must all fit in a signed 32-bit integer.
 */
 
-void IntegerSet::recount() const
+EString IntegerSet::array() const
 {
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i ) {
-        SetData::Block * b = i;
-        ++i;
-        if ( !b->count )
-            b->recount();
-        if ( !b->count )
-            d->b.remove( b->start );
+    uint c = count();
+    EString r;
+    r.reserve( 20 + 8 * c );
+
+    char b[20];
+    appendInt32( b, c ? 1 : 0 ); // dimensions
+    appendInt32( b + 4, 0 ); // no nulls
+    appendInt32( b + 8, 23 ); // int4
+    if ( !c ) {
+        r.append( b, 12 );
+        return r;
     }
+    appendInt32( b + 12, c );
+    appendInt32( b + 16, 1 ); // lower bound
+    r.append( b, 20 );
+
+    appendInt32( b, 4 );
+    uint i = 0;
+    while ( i < d->n ) {
+        Chunk * ch = d->chunks[i];
+        uint v = 0;
+        uint l = 0;
+        while ( ( v = ch->runFrom( v, l ) ) < ChunkSize ) {
+            while ( v <= l ) {
+                appendInt32( b + 4, ch->first() + v );
+                r.append( b, 8 );
+                v++;
+            }
+            if ( v >= ChunkSize )
+                break;
+        }
+        i++;
+    }
+    return r;
 }
 
 
@@ -595,24 +1429,17 @@ void IntegerSet::recount() const
 
 bool IntegerSet::contains( const IntegerSet & other ) const
 {
-    Map<SetData::Block>::Iterator m( d->b );
-    Map<SetData::Block>::Iterator h( other.d->b );
-    while ( h ) {
-        while ( m && m->start < h->start )
-            ++m;
-        if ( !m )
-            return false;
-        if ( h->start < m->start )
+    uint i = 0;
+    uint j = 0;
+    while ( j < other.d->n ) {
+        Chunk * h = other.d->chunks[j];
+        while ( i < d->n && d->chunks[i]->key < h->key )
+            i++;
+        if ( i >= d->n || d->chunks[i]->key != h->key )
             return false;
-        if ( h->count && m->count && h->count > m->count )
+        if ( !d->chunks[i]->includes( h ) )
             return false;
-        uint i = 0;
-        while ( i < ArraySize ) {
-            if ( ( m->contents[i] & h->contents[i] ) != h->contents[i] )
-                return false;
-            i++;
-        }
-        ++h;
+        j++;
     }
     return true;
 }
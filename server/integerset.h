@@ -28,6 +28,7 @@ public:
 
     EString set() const;
     EString csl() const;
+    EString array() const;
 
     void add( uint, uint );
     void add( uint n ) { add( n, n ); }
@@ -42,7 +43,6 @@ public:
 
 private:
     class SetData * d;
-    void recount() const;
 };
 
 
@@ -47,10 +47,21 @@ public:
         if ( state() == Closing )
             return;
 
+        // we take only a few connections at a time, so that our
+        // other clients are served meanwhile, and any process woken
+        // by a new arrival shares the queue with us. the EventLoop
+        // won't tell us about the rest, so we ask it to come back.
+        uint n = 0;
         int s = accept();
-        if ( s >= 0 ) {
+        while ( s >= 0 ) {
             Connection * c = new T(s);
             c->setState( Connected );
+            n++;
+            if ( n >= 4 ) {
+                EventLoop::global()->readSoon( this );
+                return;
+            }
+            s = accept();
         }
     }
 
@@ -25,6 +25,8 @@
 static Map<Mailbox> * mailboxes = 0;
 static UDict<Mailbox> * mailboxesByName = 0;
 static bool wiped = false;
+// the highest mailboxes.change we've read
+static int64 lastChange = 0;
 
 
 class MailboxData
@@ -80,7 +82,7 @@ public:
     Query * q;
     bool done;
 
-    MailboxReader( EventHandler * ev, int64 );
+    MailboxReader( EventHandler * ev, int64, IntegerSet * = 0 );
     void execute();
 };
 
@@ -88,7 +90,10 @@ public:
 static List<MailboxReader> * readers = 0;
 
 
-MailboxReader::MailboxReader( EventHandler * ev, int64 c )
+// Reads the mailboxes whose change is greater than \a c (or all of
+// them if \a c is 0), and also those in \a ids, if supplied.
+
+MailboxReader::MailboxReader( EventHandler * ev, int64 c, IntegerSet * ids )
     : owner( ev ), q( 0 ), done( false )
 {
     if ( !::readers ) {
@@ -96,13 +101,20 @@ MailboxReader::MailboxReader( EventHandler * ev, int64 c )
         Allocator::addEternal( ::readers, "active mailbox readers" );
     }
     ::readers->append( this );
-    q = new Query( "select m.id, m.name, m.deleted, m.owner, "
-                   "m.uidnext, m.nextmodseq, m.uidvalidity "
-                   //"m.change " // better: m.change
-                   "from mailboxes m ",
-                   //"where change>=$1"
-                   this );
-    c = c; //query->bind( 1, c );
+    EString s( "select m.id, m.name, m.deleted, m.owner, "
+               "m.uidnext, m.nextmodseq, m.uidvalidity, m.change "
+               "from mailboxes m" );
+    if ( c ) {
+        s.append( " where m.change>$1" );
+        if ( ids && !ids->isEmpty() )
+            s.append( " or m.id=any($2)" );
+    }
+    q = new Query( s, this );
+    if ( c ) {
+        q->bind( 1, c );
+        if ( ids && !ids->isEmpty() )
+            q->bind( 2, *ids );
+    }
     if ( !::mailboxes )
         Mailbox::setup();
 }
@@ -139,6 +151,10 @@ void MailboxReader::execute() {
         m->setUidnextAndNextModSeq( r->getInt( "uidnext" ),
                                     r->getBigint( "nextmodseq" ),
                                     q->transaction() );
+
+        int64 change = r->getBigint( "change" );
+        if ( change > ::lastChange )
+            ::lastChange = change;
     }
 
     if ( !q->done() || done )
@@ -162,18 +178,74 @@ void MailboxReader::execute() {
 };
 
 
+// The mailbox_change trigger notifies mailboxes_updated with a
+// payload for each row it changes: "id uidnext nextmodseq" if only
+// those columns (or first_recent) changed, and just "id" otherwise.
+// The former can be applied directly. For the latter, we read the
+// mailboxes with those ids, and if there was a notification without
+// a payload, we also read any mailbox whose change is greater than
+// the last one we've seen.
+
 class MailboxesWatcher
     : public EventHandler
 {
 public:
-    MailboxesWatcher(): EventHandler(), t( 0 ), m( 0 ) {
-        (void)new DatabaseSignal( "mailboxes_updated", this );
+    MailboxesWatcher()
+        : EventHandler(), t( 0 ), m( 0 ), s( 0 ),
+          ids( new IntegerSet ), changes( false ) {
+        s = new DatabaseSignal( "mailboxes_updated", this );
+    }
+    void apply( const EString & payload ) {
+        EStringList * w = EStringList::split( ' ', payload );
+        bool ok = true;
+        uint id = 0;
+        if ( w->firstElement() )
+            id = w->firstElement()->number( &ok );
+        if ( !ok || !id ) {
+            changes = true;
+            return;
+        }
+        Mailbox * mb = ::mailboxes->find( id );
+        if ( w->count() != 3 || !mb ) {
+            ids->add( id );
+            return;
+        }
+        EStringList::Iterator i( w );
+        ++i;
+        uint uidnext = i->number( &ok );
+        ++i;
+        int64 nextmodseq = 0;
+        EString n = *i;
+        for ( uint j = 0; j < n.length() && ok; j++ ) {
+            if ( n[j] < '0' || n[j] > '9' )
+                ok = false;
+            else
+                nextmodseq = nextmodseq * 10 + n[j] - '0';
+        }
+        // notifications may arrive after a newer state has been
+        // applied, so only ever move forward
+        if ( !ok )
+            ids->add( id );
+        else if ( nextmodseq > mb->nextModSeq() )
+            mb->setUidnextAndNextModSeq( uidnext, nextmodseq, 0 );
     }
     void execute() {
         if ( EventLoop::global()->inShutdown() )
             return;
 
-        if ( !t ) {
+        EStringList * payloads = s->takePayloads();
+        if ( !payloads && !( t && !t->active() ) )
+            changes = true; // a NOTIFY without payload, not the timer
+        EStringList::Iterator p( payloads );
+        while ( p ) {
+            apply( *p );
+            ++p;
+        }
+
+        if ( ids->isEmpty() && !changes ) {
+            // that's it, no need to query
+        }
+        else if ( !t ) {
             // use a timer to run only one mailboxreader per 2-3
             // seconds.
             t = new Timer( this, 2 );
@@ -189,12 +261,17 @@ public:
         else {
             // time's out, time to work
             t = 0;
-            m = new MailboxReader( 0, 0 );
+            m = new MailboxReader( 0, ::lastChange, ids );
             m->q->execute();
+            ids = new IntegerSet;
+            changes = false;
         }
     }
     Timer * t;
     MailboxReader * m;
+    DatabaseSignal * s;
+    IntegerSet * ids;
+    bool changes;
 };
 
 
@@ -214,6 +291,7 @@ public:
             ::mailboxes->clear();
             ::mailboxesByName->clear();
             ::wiped = true;
+            ::lastChange = 0;
             (void)Mailbox::root();
             mr = new MailboxReader( this, 0 );
             mr->q->execute();
@@ -632,7 +710,7 @@ Query * Mailbox::create( Transaction * t, User * owner )
         m = m->parent();
     }
 
-    t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+    // the mailbox_change trigger notifies the other processes
 
     return q;
 }
@@ -658,8 +736,6 @@ Query * Mailbox::remove( Transaction * t )
     q->bind( 1, id() );
     t->enqueue( q );
 
-    t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
-
     return q;
 }
 
@@ -671,10 +747,9 @@ Query * Mailbox::remove( Transaction * t )
 void Mailbox::refreshMailboxes( class Transaction * t )
 {
     Scope x( new Log );
-    MailboxReader * mr = new MailboxReader( 0, 0 );
+    MailboxReader * mr = new MailboxReader( 0, ::lastChange );
     Transaction * s = t->subTransaction( mr );
     s->enqueue( mr->q );
-    s->enqueue( new Query( "notify mailboxes_updated", 0 ) );
     s->execute();
 }
 
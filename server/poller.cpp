@@ -0,0 +1,512 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "poller.h"
+
+#include "allocator.h"
+#include "estring.h"
+#include "log.h"
+
+// errno
+#include <errno.h>
+// close
+#include <unistd.h>
+// struct timeval, fd_set, select
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+// memset (for FD_* under OpenBSD)
+#include <string.h>
+
+#if defined(__linux__)
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+#define USE_EPOLL 1
+#endif
+
+
+class PollerData
+    : public Garbage
+{
+public:
+    PollerData()
+        : fds( 0 ), flags( 0 ), capacity( 0 ), n( 0 )
+    {
+        setFirstNonPointer( &capacity );
+    }
+
+    int * fds;
+    char * flags;
+    // no pointers after this line
+    uint capacity;
+    uint n;
+};
+
+
+static const char Readable = 1;
+static const char Writable = 2;
+static const char Broken = 4;
+
+
+/*! \class Poller poller.h
+    The Poller class tells the EventLoop which file descriptors are
+    ready for reading or writing.
+
+    EventLoop used to build two fd_sets on every iteration and call
+    select(). That costs time proportional to the number of
+    connections on every wakeup, and select() cannot handle FDs above
+    FD_SETSIZE at all. Poller instead remembers the FDs it has been
+    told about with add(), so the EventLoop only has to speak up when
+    something changes (setWriteInterest() and remove()), and after
+    wait() it can look at the ready() FDs and nothing else.
+
+    There are two implementations: SelectPoller, which works
+    everywhere, and EpollPoller, which uses edge-triggered epoll on
+    Linux. create() picks the best one available.
+
+    An edge-triggered Poller reports each FD only when its state
+    changes, so its users must read and write until the kernel says
+    EAGAIN. Buffer::read() and Buffer::write() already do that.
+*/
+
+
+/*! Constructs an empty Poller. */
+
+Poller::Poller()
+    : d( new PollerData )
+{
+}
+
+
+/*! Exists only to avoid compiler warnings. */
+
+Poller::~Poller()
+{
+}
+
+
+/*! \fn void Poller::add( int fd, bool exclusive )
+
+    Starts watching \a fd. Initially the Poller is interested in
+    reading, and not in writing.
+
+    If \a exclusive is true, \a fd is a listening socket shared with
+    other processes, and only one of the processes waiting for it
+    needs to be woken when a new connection arrives. Implementations
+    that can't do that may ignore \a exclusive; the other processes
+    then see EAGAIN when they try to accept.
+*/
+
+
+/*! \fn void Poller::remove( int fd )
+
+    Stops watching \a fd. Does nothing if \a fd isn't being watched.
+*/
+
+
+/*! \fn void Poller::setWriteInterest( int fd, bool w )
+
+    Records whether the owner of \a fd wants to know when \a fd
+    becomes writable (\a w is true) or not (\a w is false).
+    Edge-triggered implementations may ignore this.
+*/
+
+
+/*! \fn void Poller::wait( uint ms )
+
+    Waits for at most \a ms milliseconds until at least one FD is
+    ready, and records the ready FDs so they can be examined using
+    ready(), fd(), readable() and writable(). Returns early if a
+    signal arrives.
+*/
+
+
+/*! \fn EString Poller::name() const
+
+    Returns a short name for this implementation, for logging.
+*/
+
+
+/*! Returns the number of FDs found to be ready by the last wait(). */
+
+uint Poller::ready() const
+{
+    return d->n;
+}
+
+
+/*! Returns the \a i'th ready FD, or -1 if \a i is out of range. */
+
+int Poller::fd( uint i ) const
+{
+    if ( i >= d->n )
+        return -1;
+    return d->fds[i];
+}
+
+
+/*! Returns true if fd( \a i ) may be read, and false if not. */
+
+bool Poller::readable( uint i ) const
+{
+    if ( i >= d->n )
+        return false;
+    return d->flags[i] & Readable;
+}
+
+
+/*! Returns true if fd( \a i ) may be written to, and false if not. */
+
+bool Poller::writable( uint i ) const
+{
+    if ( i >= d->n )
+        return false;
+    return d->flags[i] & Writable;
+}
+
+
+/*! Returns true if the kernel reported an error or hangup on fd( \a
+    i ), and false if not. A broken FD is also readable() and
+    writable().
+*/
+
+bool Poller::broken( uint i ) const
+{
+    if ( i >= d->n )
+        return false;
+    return d->flags[i] & Broken;
+}
+
+
+/*! Returns true if this Poller is edge-triggered, ie. reports each
+    state change only once, and false if it reports ready FDs for as
+    long as they stay ready. The default implementation returns false.
+*/
+
+bool Poller::edgeTriggered() const
+{
+    return false;
+}
+
+
+/*! Makes sure that at least \a n ready FDs can be recorded. */
+
+void Poller::reserve( uint n )
+{
+    if ( n <= d->capacity )
+        return;
+    uint c = 128;
+    while ( c < n )
+        c *= 2;
+    int * fds = (int*)Allocator::alloc( c * sizeof( int ), 0 );
+    char * flags = (char*)Allocator::alloc( c, 0 );
+    if ( d->n ) {
+        memmove( fds, d->fds, d->n * sizeof( int ) );
+        memmove( flags, d->flags, d->n );
+    }
+    d->fds = fds;
+    d->flags = flags;
+    d->capacity = c;
+}
+
+
+/*! Forgets the FDs recorded by the last wait(). */
+
+void Poller::clearReady()
+{
+    d->n = 0;
+}
+
+
+/*! Records that \a fd is ready for reading if \a r is true, and for
+    writing if \a w is true. Does nothing if both are false. \a b is
+    true if the kernel reported an error or hangup on \a fd.
+*/
+
+void Poller::addReady( int fd, bool r, bool w, bool b )
+{
+    if ( !r && !w )
+        return;
+    reserve( d->n + 1 );
+    d->fds[d->n] = fd;
+    d->flags[d->n] = ( r ? Readable : 0 ) | ( w ? Writable : 0 ) |
+                     ( b ? Broken : 0 );
+    d->n++;
+}
+
+
+/*! Returns a pointer to a new Poller, using the best implementation
+    available on this system.
+*/
+
+Poller * Poller::create()
+{
+    EpollPoller * e = new EpollPoller;
+    if ( e->valid() )
+        return e;
+    return new SelectPoller;
+}
+
+
+class SelectPollerData
+    : public Garbage
+{
+public:
+    SelectPollerData(): maxfd( -1 ) {
+        setFirstNonPointer( &maxfd );
+        FD_ZERO( &r );
+        FD_ZERO( &w );
+    }
+
+    // no pointers after this line
+    int maxfd;
+    fd_set r;
+    fd_set w;
+};
+
+
+/*! \class SelectPoller poller.h
+    The SelectPoller uses select() to find out which FDs are ready.
+
+    It keeps its fd_sets between calls to wait(), but select() still
+    costs time proportional to the highest FD, and FDs above
+    FD_SETSIZE cannot be used at all. SelectPoller logs an error and
+    ignores such FDs.
+*/
+
+
+/*! Constructs a SelectPoller watching no FDs. */
+
+SelectPoller::SelectPoller()
+    : Poller(), d( new SelectPollerData )
+{
+}
+
+
+void SelectPoller::add( int fd, bool )
+{
+    if ( fd < 0 )
+        return;
+    if ( fd >= FD_SETSIZE ) {
+        ::log( "Cannot watch fd " + fn( fd ) + " using select(), "
+               "which supports only " + fn( FD_SETSIZE ) + " FDs",
+               Log::Error );
+        return;
+    }
+    FD_SET( fd, &d->r );
+    FD_CLR( fd, &d->w );
+    if ( fd > d->maxfd )
+        d->maxfd = fd;
+}
+
+
+void SelectPoller::remove( int fd )
+{
+    if ( fd < 0 || fd >= FD_SETSIZE )
+        return;
+    FD_CLR( fd, &d->r );
+    FD_CLR( fd, &d->w );
+    while ( d->maxfd >= 0 &&
+            !FD_ISSET( d->maxfd, &d->r ) && !FD_ISSET( d->maxfd, &d->w ) )
+        d->maxfd--;
+}
+
+
+void SelectPoller::setWriteInterest( int fd, bool w )
+{
+    if ( fd < 0 || fd >= FD_SETSIZE || !FD_ISSET( fd, &d->r ) )
+        return;
+    if ( w )
+        FD_SET( fd, &d->w );
+    else
+        FD_CLR( fd, &d->w );
+}
+
+
+void SelectPoller::wait( uint ms )
+{
+    clearReady();
+
+    fd_set r, w;
+    memmove( &r, &d->r, sizeof( fd_set ) );
+    memmove( &w, &d->w, sizeof( fd_set ) );
+
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = ( ms % 1000 ) * 1000;
+
+    // r and w are undefined if select() fails, so we report nothing.
+    if ( select( d->maxfd+1, &r, &w, 0, &tv ) <= 0 )
+        return;
+
+    int fd = 0;
+    while ( fd <= d->maxfd ) {
+        addReady( fd, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ) );
+        fd++;
+    }
+}
+
+
+EString SelectPoller::name() const
+{
+    return "select";
+}
+
+
+class EpollPollerData
+    : public Garbage
+{
+public:
+    EpollPollerData(): events( 0 ), fd( -1 ), capacity( 0 ) {
+        setFirstNonPointer( &fd );
+    }
+
+    void * events;
+    // no pointers after this line
+    int fd;
+    uint capacity;
+};
+
+
+/*! \class EpollPoller poller.h
+    The EpollPoller uses edge-triggered epoll to find out which FDs
+    are ready.
+
+    Each FD is registered once, for both reading and writing, so
+    setWriteInterest() costs nothing and wait() costs time
+    proportional to the number of ready FDs, not the number of
+    watched FDs.
+
+    EpollPoller is only available on Linux. On other systems valid()
+    returns false and Poller::create() falls back to SelectPoller.
+
+    The epoll instance is created by the constructor, which means
+    that an EpollPoller must not be shared across fork(). EventLoop
+    creates its Poller in EventLoop::start() for that reason.
+*/
+
+
+/*! Constructs an EpollPoller watching no FDs. */
+
+EpollPoller::EpollPoller()
+    : Poller(), d( new EpollPollerData )
+{
+#if defined(USE_EPOLL)
+    d->fd = ::epoll_create( 1024 );
+    if ( d->fd < 0 )
+        return;
+    d->capacity = 256;
+    d->events = Allocator::alloc( d->capacity * sizeof( struct epoll_event ),
+                                  0 );
+    reserve( d->capacity );
+#endif
+}
+
+
+/*! Returns true if this EpollPoller is usable, and false if epoll
+    isn't available on this system.
+*/
+
+bool EpollPoller::valid() const
+{
+    return d->fd >= 0;
+}
+
+
+void EpollPoller::add( int fd, bool exclusive )
+{
+#if defined(USE_EPOLL)
+    if ( fd < 0 || d->fd < 0 )
+        return;
+    struct epoll_event e;
+    memset( &e, 0, sizeof( e ) );
+    e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+#if defined(EPOLLEXCLUSIVE)
+    // all the server processes listen to the same sockets. this
+    // wakes only one of them per incoming connection, and since
+    // busy processes aren't waiting, an idle one gets it.
+    if ( exclusive )
+        e.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+#endif
+    e.data.fd = fd;
+    int r = ::epoll_ctl( d->fd, EPOLL_CTL_ADD, fd, &e );
+    if ( r < 0 && errno == EEXIST ) {
+        // EPOLL_CTL_MOD rejects EPOLLEXCLUSIVE, so we start over
+        ::epoll_ctl( d->fd, EPOLL_CTL_DEL, fd, &e );
+        r = ::epoll_ctl( d->fd, EPOLL_CTL_ADD, fd, &e );
+    }
+    if ( r < 0 )
+        ::log( "epoll_ctl( ADD, " + fn( fd ) + " ) returned errno " +
+               fn( errno ), Log::Error );
+#else
+    (void)fd;
+    (void)exclusive;
+#endif
+}
+
+
+void EpollPoller::remove( int fd )
+{
+#if defined(USE_EPOLL)
+    if ( fd < 0 || d->fd < 0 )
+        return;
+    // the kernel removes closed FDs by itself, so we ignore errors
+    struct epoll_event e;
+    memset( &e, 0, sizeof( e ) );
+    ::epoll_ctl( d->fd, EPOLL_CTL_DEL, fd, &e );
+#else
+    (void)fd;
+#endif
+}
+
+
+void EpollPoller::setWriteInterest( int, bool )
+{
+    // we always ask for EPOLLOUT, and since it's edge-triggered, we
+    // only hear about it when a full socket buffer drains.
+}
+
+
+void EpollPoller::wait( uint ms )
+{
+    clearReady();
+#if defined(USE_EPOLL)
+    if ( d->fd < 0 )
+        return;
+
+    struct epoll_event * events = (struct epoll_event *)d->events;
+    int n = ::epoll_wait( d->fd, events, d->capacity, ms );
+    int i = 0;
+    while ( i < n ) {
+        uint e = events[i].events;
+        // errors and hangups are reported as both readable and
+        // writable, just like select() does.
+        bool broken = e & ( EPOLLERR | EPOLLHUP );
+        addReady( events[i].data.fd,
+                  broken || ( e & ( EPOLLIN | EPOLLRDHUP ) ),
+                  broken || ( e & EPOLLOUT ), broken );
+        i++;
+    }
+
+    // if we filled the array, there may be more next time, so give
+    // the kernel more room.
+    if ( n > 0 && (uint)n == d->capacity && d->capacity < 16384 ) {
+        d->capacity *= 2;
+        d->events = Allocator::alloc( d->capacity *
+                                      sizeof( struct epoll_event ), 0 );
+    }
+#else
+    (void)ms;
+#endif
+}
+
+
+bool EpollPoller::edgeTriggered() const
+{
+    return true;
+}
+
+
+EString EpollPoller::name() const
+{
+    return "epoll";
+}
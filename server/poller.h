@@ -0,0 +1,87 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "global.h"
+
+
+class EString;
+
+
+class Poller
+    : public Garbage
+{
+public:
+    Poller();
+    virtual ~Poller();
+
+    virtual void add( int, bool = false ) = 0;
+    virtual void remove( int ) = 0;
+    virtual void setWriteInterest( int, bool ) = 0;
+
+    virtual void wait( uint ) = 0;
+
+    uint ready() const;
+    int fd( uint ) const;
+    bool readable( uint ) const;
+    bool writable( uint ) const;
+    bool broken( uint ) const;
+
+    virtual bool edgeTriggered() const;
+    virtual EString name() const = 0;
+
+    static Poller * create();
+
+protected:
+    void reserve( uint );
+    void clearReady();
+    void addReady( int, bool, bool, bool = false );
+
+private:
+    class PollerData * d;
+};
+
+
+class SelectPoller
+    : public Poller
+{
+public:
+    SelectPoller();
+
+    void add( int, bool );
+    void remove( int );
+    void setWriteInterest( int, bool );
+
+    void wait( uint );
+
+    EString name() const;
+
+private:
+    class SelectPollerData * d;
+};
+
+
+class EpollPoller
+    : public Poller
+{
+public:
+    EpollPoller();
+
+    bool valid() const;
+
+    void add( int, bool );
+    void remove( int );
+    void setWriteInterest( int, bool );
+
+    void wait( uint );
+
+    bool edgeTriggered() const;
+    EString name() const;
+
+private:
+    class EpollPollerData * d;
+};
+
+
+#endif
@@ -18,6 +18,7 @@
 #include "dbsignal.h"
 #include "field.h"
 #include "user.h"
+#include "trigrams.h"
 
 #include <time.h> // whereAge() calls time()
 
@@ -926,20 +927,24 @@ EString Selector::whereHeaderField()
     EString jn = fn( ++root()->d->join );
     EString j = " left join header_fields hf" + jn +
                " on (" + mm() + ".message=hf" + jn + ".message";
+    EString trigrams;
     if ( t == HeaderField::MessageId &&
          d->s16.startsWith( "<" ) && d->s16.endsWith( ">" ) ) {
         uint like = placeHolder( q( d->s16 ) );
         j.append( " and hf" + jn + ".value=$" + fn( like ) );
     }
-    else if ( t == HeaderField::Subject &&
-              ::tsearchAvailable && sensibleWords( d->s16 ) ) {
-        uint like = placeHolder( q( d->s16 ) );
-        j.append( " and (" + matchTsvector( "hf" + jn + ".value", like ) + " "
-                  "and hf" + jn + ".value ilike " + matchAny( like ) + ")" );
-    }
     else if ( !d->s16.isEmpty() ) {
+        trigrams = whereTrigrams( "header_trigrams", "message",
+                                  mm() + ".message" );
         uint like = placeHolder( q( d->s16 ) );
-        j.append( " and hf" + jn + ".value ilike " + matchAny( like ) );
+        if ( trigrams.isEmpty() && t == HeaderField::Subject &&
+             ::tsearchAvailable && sensibleWords( d->s16 ) )
+            j.append( " and (" +
+                      matchTsvector( "hf" + jn + ".value", like ) + " "
+                      "and hf" + jn + ".value ilike " + matchAny( like ) +
+                      ")" );
+        else
+            j.append( " and hf" + jn + ".value ilike " + matchAny( like ) );
     }
 
     if ( t ) {
@@ -954,6 +959,9 @@ EString Selector::whereHeaderField()
     j.append( ")" );
     root()->d->leftJoins.append( j );
 
+    if ( !trigrams.isEmpty() )
+        return "(" + trigrams +
+            " and hf" + jn + ".field is not null)";
     return "hf" + jn + ".field is not null";
 }
 
@@ -1439,10 +1447,13 @@ EString Selector::whereHeader()
     pictures. (For some formats we search on the text part, because
     the injector sets bodyparts.text based on bodyparts.data.)
 
-    This function uses full-text search if available, but filters the
-    results with a plain 'ilike' in order to avoid overly liberal
-    stemming. (Perhaps we actually want liberal stemming. I don't
-    know. IMAP says not to do it, but do we listen?)
+    The bodypart_trigrams table narrows the search down to the
+    bodyparts which contain all the trigrams of the search string, and
+    'ilike' removes the few false positives. If the string is too
+    short to have trigrams, this function uses full-text search if
+    available, but filters the results with a plain 'ilike' in order
+    to avoid overly liberal stemming. (Perhaps we actually want liberal
+    stemming. I don't know. IMAP says not to do it, but do we listen?)
 */
 
 EString Selector::whereBody()
@@ -1452,8 +1463,13 @@ EString Selector::whereBody()
     EString s;
 
     uint bt = placeHolder( q( d->s16 ) );
+    EString trigrams( whereTrigrams( "bodypart_trigrams", "bodypart",
+                                     "bp.id" ) );
 
-    if ( ::tsearchAvailable && sensibleWords( d->s16 ) )
+    if ( !trigrams.isEmpty() )
+        s.append( "(" + trigrams + " "
+                  "and bp.text ilike " + matchAny( bt ) + ")" );
+    else if ( ::tsearchAvailable && sensibleWords( d->s16 ) )
         s.append( "(" + matchTsvector( "bp.text", bt ) + " "
                   "and bp.text ilike " + matchAny( bt ) + ")" );
     else
@@ -1557,6 +1573,37 @@ EString Selector::whereSet( const IntegerSet & s )
 }
 
 
+/*! Returns a condition which is true if the row in \a table whose
+    \a column is \a outer has the trigrams of this Selector's string,
+    or an empty string if the string is too short to have any
+    trigrams. \a table is either bodypart_trigrams or header_trigrams.
+
+    The condition is a correlated subquery, so the planner can start
+    from the mailbox and check only the rows that are in it.
+
+    The subquery looks for a sample of the trigrams only, and trigrams
+    don't record order, so callers must still check the text itself.
+*/
+
+EString Selector::whereTrigrams( const EString & table,
+                                 const EString & column,
+                                 const EString & outer )
+{
+    Utf8Codec c;
+    IntegerSet t;
+    Trigrams::add( t, c.fromUnicode( d->s16 ) );
+    if ( t.isEmpty() )
+        return "";
+    t = Trigrams::sample( t, 8 );
+
+    uint n = placeHolder();
+    root()->d->query->bind( n, t );
+    return "exists (select 1 from " + table + " tg"
+        " where tg." + column + "=" + outer +
+        " and tg.trigrams@>$" + fn( n ) + "::int[])";
+}
+
+
 /*! This implements searches on whether a message has the right UID.
 */
 
@@ -2033,7 +2080,11 @@ Selector::MatchResult Selector::match( Session * s, uint uid )
                 return Yes;
             return No;
         }
-        return Punt;
+        if ( !s->flagsKnown().contains( uid ) )
+            return Punt;
+        if ( s->hasFlag( d->s8, uid ) )
+            return Yes;
+        return No;
     }
     else if ( d->a == Not ) {
         MatchResult sub = d->children->first()->match( s, uid );
@@ -2052,6 +2103,73 @@ Selector::MatchResult Selector::match( Session * s, uint uid )
 }
 
 
+/*! Finds all the messages in the session \a s that match this
+    condition, and stores their UIDs in \a result. Returns Yes if it
+    could do that using only what \a s knows, and Punt (leaving \a
+    result in an undefined state) if the database must be asked.
+
+    This does the same as the other match(), but works on whole sets
+    at a time, so it's fast enough for mailboxes of any size. Flag
+    conditions can be evaluated only if Session::flagsKnown() includes
+    all the messages.
+*/
+
+Selector::MatchResult Selector::match( Session * s, IntegerSet & result )
+{
+    IntegerSet all( s->messages() );
+    all.remove( s->expunged() );
+
+    if ( d->a == And || d->a == Or ) {
+        if ( d->a == And )
+            result = all;
+        else
+            result.clear();
+        List< Selector >::Iterator i( d->children );
+        while ( i ) {
+            IntegerSet sub;
+            if ( i->match( s, sub ) == Punt )
+                return Punt;
+            if ( d->a == And )
+                result = result.intersection( sub );
+            else
+                result.add( sub );
+            ++i;
+        }
+    }
+    else if ( d->a == Contains && d->f == Uid ) {
+        result = all.intersection( d->s );
+    }
+    else if ( d->a == Contains && d->f == Flags ) {
+        if ( d->s8 == "\\recent" ) {
+            result = all.intersection( s->recent() );
+        }
+        else {
+            if ( !s->flagsKnown().contains( all ) )
+                return Punt;
+            result = all.intersection( s->flagged( d->s8 ) );
+        }
+    }
+    else if ( d->a == Not ) {
+        IntegerSet sub;
+        if ( d->children->first()->match( s, sub ) == Punt )
+            return Punt;
+        result = all;
+        result.remove( sub );
+    }
+    else if ( d->a == All ) {
+        result = all;
+    }
+    else if ( d->a == None ) {
+        result.clear();
+    }
+    else {
+        return Punt;
+    }
+
+    return Yes;
+}
+
+
 /*! Returns true if this condition needs an updated Session to be
     correctly evaluated, and false if not.
 */
@@ -72,6 +72,7 @@ public:
         Punt // really "ThrowHandsUpInAirAndDespair"
     };
     MatchResult match( class Session *, uint );
+    MatchResult match( class Session *, IntegerSet & );
 
     EString string();
 
@@ -119,6 +120,8 @@ private:
     EString m();
 
     EString whereSet( const IntegerSet & );
+    EString whereTrigrams( const EString &, const EString &,
+                           const EString & );
 };
 
 
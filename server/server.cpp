@@ -558,6 +558,12 @@ void Server::secure()
         }
         break;
     }
+
+    // /proc is out of reach after chroot(), so this process opens
+    // its soft-dirty files first. The children maintainChildren()
+    // forks later can't, so they fall back to full collections.
+    Allocator::trackDirtyPages();
+
     if ( chroot( root.cstr() ) ) {
         log( "Cannot secure server " + d->name + " since chroot( \"" +
              root + "\" ) failed with error " + fn( errno ),
@@ -13,6 +13,7 @@
 #include "scope.h"
 #include "flag.h"
 #include "map.h"
+#include "dict.h"
 #include "log.h"
 
 
@@ -24,9 +25,19 @@ public:
         : readOnly( true ),
           mailbox( 0 ),
           uidnext( 1 ), nextModSeq( 1 ),
-          permissions( 0 )
+          permissions( 0 ),
+          flagGeneration( 1 ), flagHorizon( 1 )
     {}
 
+    class FlagChange
+        : public Garbage
+    {
+    public:
+        FlagChange(): generation( 0 ) {}
+        uint generation;
+        IntegerSet uids;
+    };
+
     bool readOnly;
     Mailbox * mailbox;
     IntegerSet msns;
@@ -36,9 +47,21 @@ public:
     int64 nextModSeq;
     Permissions * permissions;
     IntegerSet unannounced;
+    IntegerSet flagsKnown;
+    Dict<IntegerSet> flagged;
+    EStringList flagNames;
+    uint flagGeneration;
+    uint flagHorizon;
+    List<FlagChange> flagChanges;
 };
 
 
+// forgetFlags() remembers this many changes, so that flag fetches
+// which started before them can be checked
+
+static const uint maxFlagChanges = 128;
+
+
 /*! \class Session session.h
     This class contains all data associated with the single use of a
     Mailbox, such as the number of messages visible, etc. Subclasses
@@ -760,6 +783,7 @@ IntegerSet Session::unannounced() const
 void Session::addUnannounced( const IntegerSet & s )
 {
     d->unannounced.add( s );
+    forgetFlags( s );
 }
 
 
@@ -771,6 +795,11 @@ void Session::addUnannounced( const IntegerSet & s )
 void Session::addUnannounced( uint uid )
 {
     d->unannounced.add( uid );
+    if ( d->flagsKnown.contains( uid ) ) {
+        IntegerSet s;
+        s.add( uid );
+        forgetFlags( s );
+    }
 }
 
 
@@ -783,6 +812,141 @@ void Session::clearUnannounced()
 }
 
 
+/*! Returns the set of messages whose flags this Session knows, ie.
+    for which flagged() and hasFlag() give the right answer.
+
+    The Session learns the flags of a message when a Fetch retrieves
+    all of them from the database (typically because the client asked
+    for FLAGS, or to announce a change), and forgets them whenever the
+    message is changed, until the next such Fetch. Selector::match()
+    uses this to answer flag searches without the database.
+*/
+
+const IntegerSet & Session::flagsKnown() const
+{
+    return d->flagsKnown;
+}
+
+
+/*! Returns the set of messages which have \a flag (compared
+    case-insensitively), as far as this Session knows. Only the
+    messages in flagsKnown() are relevant.
+*/
+
+IntegerSet Session::flagged( const EString & flag ) const
+{
+    IntegerSet * s = d->flagged.find( flag.lower() );
+    if ( s )
+        return *s;
+    return IntegerSet();
+}
+
+
+/*! Returns true if the message \a uid has \a flag, as far as this
+    Session knows, and false if not. This is only meaningful if \a uid
+    is in flagsKnown().
+*/
+
+bool Session::hasFlag( const EString & flag, uint uid ) const
+{
+    IntegerSet * s = d->flagged.find( flag.lower() );
+    return s && s->contains( uid );
+}
+
+
+/*! Records that the message \a uid has \a flag. Used by Fetch, which
+    calls learnFlags() once all flags have been added.
+*/
+
+void Session::addFlag( const EString & flag, uint uid )
+{
+    EString f = flag.lower();
+    IntegerSet * s = d->flagged.find( f );
+    if ( !s ) {
+        s = new IntegerSet;
+        d->flagged.insert( f, s );
+        d->flagNames.append( f );
+    }
+    s->add( uid );
+}
+
+
+/*! Returns the current flag generation. forgetFlags() increments
+    it. A Fetch notes it when it starts retrieving flags, and later
+    gives it to flagsUnchanged().
+*/
+
+uint Session::flagGeneration() const
+{
+    return d->flagGeneration;
+}
+
+
+/*! Returns the messages in \a uids which haven't been forgotten by
+    forgetFlags() since flagGeneration() returned \a generation, so
+    that flags retrieved since then are still correct for them.
+    Returns an empty set if \a generation is too old to tell.
+*/
+
+IntegerSet Session::flagsUnchanged( const IntegerSet & uids,
+                                    uint generation ) const
+{
+    if ( generation < d->flagHorizon )
+        return IntegerSet();
+    IntegerSet r( uids );
+    List<SessionData::FlagChange>::Iterator c( d->flagChanges );
+    while ( c && !r.isEmpty() ) {
+        if ( c->generation > generation )
+            r.remove( c->uids );
+        ++c;
+    }
+    return r;
+}
+
+
+/*! Records that addFlag() has been called for all flags of each
+    message in \a uids, so that they're in flagsKnown(). Messages that
+    have changed in the meantime (and are in unannounced()) are left
+    out. The caller should use flagsUnchanged() to leave out messages
+    whose flags were forgotten while they were being fetched.
+*/
+
+void Session::learnFlags( const IntegerSet & uids )
+{
+    IntegerSet l( uids );
+    l.remove( d->unannounced );
+    d->flagsKnown.add( l );
+}
+
+
+/*! Removes \a uids from flagsKnown() and forgets their flags. Called
+    whenever those messages may have changed, and by Fetch before it
+    retrieves their flags. This starts a new flagGeneration().
+*/
+
+void Session::forgetFlags( const IntegerSet & uids )
+{
+    d->flagGeneration++;
+    SessionData::FlagChange * c = new SessionData::FlagChange;
+    c->generation = d->flagGeneration;
+    c->uids = uids;
+    d->flagChanges.append( c );
+    if ( d->flagChanges.count() > maxFlagChanges )
+        d->flagHorizon = d->flagChanges.shift()->generation;
+
+    if ( d->flagsKnown.isEmpty() && d->flagNames.isEmpty() )
+        return;
+    d->flagsKnown.remove( uids );
+    EStringList::Iterator i( d->flagNames );
+    while ( i ) {
+        IntegerSet * s = d->flagged.find( *i );
+        if ( s )
+            s->remove( uids );
+        ++i;
+    }
+}
+
+
 /*! Does whatever is necessary to tell the client about new
     flags. This is really a hack for ImapSession.
 */
@@ -67,6 +67,15 @@ public:
     void addUnannounced( const IntegerSet & );
     void clearUnannounced();
 
+    const IntegerSet & flagsKnown() const;
+    IntegerSet flagged( const EString & ) const;
+    bool hasFlag( const EString &, uint ) const;
+    void addFlag( const EString &, uint );
+    void learnFlags( const IntegerSet & );
+    uint flagGeneration() const;
+    IntegerSet flagsUnchanged( const IntegerSet &, uint ) const;
+    void forgetFlags( const IntegerSet & );
+
     virtual void sendFlagUpdate();
 
 private:
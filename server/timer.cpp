@@ -7,7 +7,9 @@
 #include "connection.h"
 #include "scope.h"
 
-// time
+#include "allocator.h"
+
+// clock_gettime, CLOCK_MONOTONIC, time
 #include <time.h>
 
 
@@ -15,10 +17,17 @@ class TimerData
     : public Garbage
 {
 public:
-    TimerData(): owner( 0 ), timeout( 0 ), interval( 0 ), repeating( false ) {}
+    TimerData()
+        : owner( 0 ), timeout( 0 ), interval( 0 ), index( 0 ),
+          repeating( false )
+    {
+        setFirstNonPointer( &timeout );
+    }
     EventHandler * owner;
-    uint timeout;
-    uint interval;
+    // no pointers after this line
+    int64 timeout;
+    int64 interval;
+    uint index;
     bool repeating;
 };
 
@@ -30,10 +39,10 @@ public:
     intervals. The default is one callback; calling setRepeating()
     changes that.
 
-    The class provides second resolution, nothing better. Creating a
-    timer with delay/interval of 1 provides the first callback after
-    1-2 seconds and (if repeating() is true) at 1-second intervals
-    thereafter.
+    Timers use a monotonic millisecond clock (see now()), so a timer
+    created with a delay of 1 provides the first callback after one
+    second, not "1-2 seconds", and changing the system's wall clock
+    does not affect it.
 
     If the system is badly overloaded, callbacks may be skipped. There
     never is more than one activation pending for a single Timer.
@@ -41,18 +50,15 @@ public:
 
 
 /*!  Constructs an timer which will notify \a owner after \a delay
-     seconds, or slightly more.
+     seconds.
 */
 
 Timer::Timer( class EventHandler * owner, uint delay )
     : Garbage(), d( new TimerData )
 {
-    uint now = time( 0 );
-    if ( delay + now < now )
-        return; // would be after the end of the universe...
     d->owner = owner;
-    d->timeout = delay + now;
-    d->interval = delay;
+    d->interval = 1000 * (int64)delay;
+    d->timeout = now() + d->interval;
     EventLoop::global()->addTimer( this );
 }
 
@@ -80,17 +86,32 @@ bool Timer::active() const
 }
 
 
-/*! Returns the time (as an integer number of seconds increasing
-    towards the future) at which this Timer will call
-    EventHandler::execute(), or 0 if it is not active().
+/*! Returns the time (as reported by now()) at which this Timer will
+    call EventHandler::execute(), or 0 if it is not active().
 */
 
-uint Timer::timeout() const
+int64 Timer::timeout() const
 {
     return d->timeout;
 }
 
 
+/*! Instructs this Timer to call EventHandler::execute() at \a t
+    milliseconds (as reported by now()), or never if \a t is 0.
+
+    If the Timer is repeating(), the interval is unchanged.
+*/
+
+void Timer::setTimeout( int64 t )
+{
+    d->timeout = t;
+    if ( t )
+        EventLoop::global()->addTimer( this );
+    else
+        EventLoop::global()->removeTimer( this );
+}
+
+
 /*! Returns a pointer to the the EventHandler object that this Timer
     will notify.
 */
@@ -105,12 +126,14 @@ class EventHandler * Timer::owner()
 
 void Timer::execute()
 {
-    if ( d->repeating ) {
+    if ( d->repeating && d->interval ) {
         d->timeout += d->interval;
-        uint now = time( 0 );
-        // if we can't make the required frequency, get as close as we can
-        if ( d->timeout <= now )
-            d->timeout = now + 1;
+        int64 n = now();
+        // if we can't make the required frequency, skip the
+        // activations we've missed
+        while ( d->timeout <= n )
+            d->timeout += d->interval;
+        EventLoop::global()->addTimer( this );
     }
     else {
         d->timeout = 0;
@@ -190,3 +213,177 @@ bool Timer::repeating() const
 {
     return d->repeating;
 }
+
+
+/*! Returns the current time in milliseconds, according to a clock
+    that never goes backwards. The clock's epoch is arbitrary, but
+    the value is always positive, so 0 can be used to mean "never".
+*/
+
+int64 Timer::now()
+{
+    struct timespec ts;
+    if ( ::clock_gettime( CLOCK_MONOTONIC, &ts ) < 0 )
+        return 1000 * (int64)time( 0 );
+    return 1 + 1000 * (int64)ts.tv_sec + ts.tv_nsec / 1000000;
+}
+
+
+class TimerQueueData
+    : public Garbage
+{
+public:
+    TimerQueueData(): timers( 0 ), n( 0 ), capacity( 0 ) {
+        setFirstNonPointer( &n );
+    }
+
+    Timer ** timers;
+    // no pointers after this line
+    uint n;
+    uint capacity;
+};
+
+
+/*! \class TimerQueue timer.h
+
+    The TimerQueue class keeps a set of active Timer objects sorted by
+    Timer::timeout(), so the EventLoop can find the next one to expire
+    without looking at all of them.
+
+    It is a binary min-heap. insert() and remove() cost O(log n) and
+    first() is O(1). Each Timer remembers its position in the heap,
+    so a Timer can be in at most one TimerQueue.
+*/
+
+
+/*! Constructs an empty TimerQueue. */
+
+TimerQueue::TimerQueue()
+    : d( new TimerQueueData )
+{
+}
+
+
+/*! Adds \a t to this queue, or moves it to the right place if its
+    Timer::timeout() has changed since it was added.
+*/
+
+void TimerQueue::insert( Timer * t )
+{
+    uint i = t->d->index;
+    if ( i && i <= d->n && d->timers[i-1] == t ) {
+        up( i );
+        down( t->d->index );
+        return;
+    }
+
+    if ( d->n == d->capacity ) {
+        uint c = d->capacity * 2;
+        if ( c < 64 )
+            c = 64;
+        Timer ** a = (Timer**)Allocator::alloc( c * sizeof( Timer * ) );
+        uint j = 0;
+        while ( j < d->n ) {
+            a[j] = d->timers[j];
+            j++;
+        }
+        while ( j < c )
+            a[j++] = 0;
+        d->timers = a;
+        d->capacity = c;
+    }
+    d->n++;
+    place( t, d->n );
+    up( d->n );
+}
+
+
+/*! Removes \a t from this queue. Does nothing if \a t isn't in the
+    queue.
+*/
+
+void TimerQueue::remove( Timer * t )
+{
+    uint i = t->d->index;
+    if ( !i || i > d->n || d->timers[i-1] != t )
+        return;
+
+    t->d->index = 0;
+    Timer * last = d->timers[d->n-1];
+    d->timers[d->n-1] = 0;
+    d->n--;
+    if ( last == t )
+        return;
+    place( last, i );
+    up( i );
+    down( last->d->index );
+}
+
+
+/*! Returns the Timer with the earliest Timer::timeout(), or a null
+    pointer if the queue is empty.
+*/
+
+Timer * TimerQueue::first() const
+{
+    if ( !d->n )
+        return 0;
+    return d->timers[0];
+}
+
+
+/*! Returns the number of Timer objects in this queue. */
+
+uint TimerQueue::count() const
+{
+    return d->n;
+}
+
+
+/*! Stores \a t at the 1-based position \a i. */
+
+void TimerQueue::place( Timer * t, uint i )
+{
+    d->timers[i-1] = t;
+    t->d->index = i;
+}
+
+
+/*! Moves the Timer at position \a i towards the top of the heap
+    until its parent expires no later than it.
+*/
+
+void TimerQueue::up( uint i )
+{
+    Timer * t = d->timers[i-1];
+    while ( i > 1 ) {
+        Timer * p = d->timers[i/2-1];
+        if ( p->d->timeout <= t->d->timeout )
+            break;
+        place( p, i );
+        i = i / 2;
+    }
+    place( t, i );
+}
+
+
+/*! Moves the Timer at position \a i towards the bottom of the heap
+    until both its children expire no earlier than it.
+*/
+
+void TimerQueue::down( uint i )
+{
+    Timer * t = d->timers[i-1];
+    while ( 2 * i <= d->n ) {
+        uint c = 2 * i;
+        if ( c < d->n &&
+             d->timers[c]->d->timeout < d->timers[c-1]->d->timeout )
+            c++;
+        Timer * child = d->timers[c-1];
+        if ( t->d->timeout <= child->d->timeout )
+            break;
+        place( child, i );
+        i = c;
+    }
+    place( t, i );
+}
@@ -15,7 +15,8 @@ public:
     ~Timer();
 
     bool active() const;
-    uint timeout() const;
+    int64 timeout() const;
+    void setTimeout( int64 );
 
     class EventHandler * owner();
 
@@ -25,8 +26,31 @@ public:
     void setRepeating( bool );
     bool repeating() const;
 
+    static int64 now();
+
 private:
     class TimerData * d;
+    friend class TimerQueue;
+};
+
+
+class TimerQueue
+    : public Garbage
+{
+public:
+    TimerQueue();
+
+    void insert( Timer * );
+    void remove( Timer * );
+
+    Timer * first() const;
+    uint count() const;
+
+private:
+    class TimerQueueData * d;
+    void up( uint );
+    void down( uint );
+    void place( Timer *, uint );
 };
 
 #endif
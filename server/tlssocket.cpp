@@ -0,0 +1,284 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tlssocket.h"
+
+#include "tlsthread.h"
+#include "estring.h"
+#include "buffer.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+
+// the largest chunk we hand to SSL_write() at once; one TLS record
+static const uint chunk = 16384;
+
+
+class TlsSocketData
+    : public Garbage
+{
+public:
+    TlsSocketData()
+        : Garbage(), ssl( 0 ), input( 0 ), output( 0 ),
+          wantsWrite( false ), readWantsWrite( false ),
+          writeWantsRead( false ), finished( false ), broken( false )
+    {
+        setFirstNonPointer( &wantsWrite );
+    }
+
+    SSL * ssl;
+    Buffer * input;
+    Buffer * output;
+    // no pointers after this line
+    bool wantsWrite;
+    bool readWantsWrite;
+    bool writeWantsRead;
+    bool finished;
+    bool broken;
+};
+
+
+/*! \class TlsSocket tlssocket.h
+    Runs TLS directly on a nonblocking socket, inside the event loop.
+
+    Connection::startTls() uses this instead of a TlsThread unless the
+    use-tls-threads configuration variable is set. The SSL object
+    reads and writes the socket itself, so there is no socketpair, no
+    thread and no copying through BIO pairs; the Connection calls
+    read() and write() whenever the EventLoop says the socket is
+    ready, and OpenSSL resumes the handshake or record processing
+    wherever it left off.
+
+    Since the sockets are nonblocking, each call may be cut short by
+    SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE. read() and write()
+    both run until OpenSSL reports one of those, so a socket is always
+    drained before the EventLoop waits for it again, as edge-triggered
+    polling requires.
+
+    During renegotiation, SSL_read() may have to write and SSL_write()
+    may have to read. TlsSocket remembers which one was blocked, and
+    write() retries a blocked SSL_read(), read() a blocked
+    SSL_write(), since the EventLoop only reports the direction the
+    socket became ready in.
+*/
+
+
+/*! Constructs a TlsSocket which will use the connected socket \a fd.
+    If \a asClient is true, this end initiates the TLS handshake; by
+    default it waits for the peer to do so.
+
+    If OpenSSL cannot create a session, the object is broken() from
+    the start, and the caller may fall back to a TlsThread.
+*/
+
+TlsSocket::TlsSocket( int fd, bool asClient )
+    : d( new TlsSocketData )
+{
+    d->ssl = ::SSL_new( TlsThread::context() );
+    if ( !d->ssl || !::SSL_set_fd( d->ssl, fd ) ) {
+        d->broken = true;
+        if ( d->ssl )
+            ::SSL_free( d->ssl );
+        d->ssl = 0;
+        return;
+    }
+
+    // write() copies each chunk out of the Buffer, so the retry after
+    // SSL_ERROR_WANT_WRITE may come from a different address
+    ::SSL_set_mode( d->ssl,
+                    SSL_MODE_ENABLE_PARTIAL_WRITE |
+                    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+    if ( asClient )
+        ::SSL_set_connect_state( d->ssl );
+    else
+        ::SSL_set_accept_state( d->ssl );
+}
+
+
+/*! Frees the OpenSSL session, if close() hasn't already. This does
+    not talk to the peer, since the socket may be gone by now.
+*/
+
+TlsSocket::~TlsSocket()
+{
+    if ( d->ssl )
+        ::SSL_free( d->ssl );
+    d->ssl = 0;
+}
+
+
+/*! Decrypts as much as can be read from the socket and appends the
+    cleartext to \a b. This also drives the TLS handshake, and resumes
+    an SSL_write() that had to wait for the socket to be readable.
+*/
+
+void TlsSocket::read( Buffer * b )
+{
+    if ( !d->ssl || d->finished )
+        return;
+
+    d->input = b;
+    if ( d->writeWantsRead && d->output )
+        send( d->output );
+    receive( b );
+}
+
+
+/*! Encrypts and writes as much of \a b as the socket accepts, and
+    removes what was written from \a b. If the handshake is still in
+    progress, this continues it first. If an SSL_read() had to wait
+    for the socket to be writable, this resumes it, and the cleartext
+    is appended to the Buffer last given to read().
+*/
+
+void TlsSocket::write( Buffer * b )
+{
+    if ( !d->ssl || d->finished )
+        return;
+
+    d->output = b;
+    if ( !::SSL_is_init_finished( d->ssl ) ) {
+        int r = ::SSL_do_handshake( d->ssl );
+        if ( r <= 0 ) {
+            handle( r, false );
+            return;
+        }
+        d->wantsWrite = false;
+    }
+
+    if ( d->readWantsWrite && d->input )
+        receive( d->input );
+    send( b );
+}
+
+
+/*! Calls SSL_read() until it has nothing more to give, and appends
+    what it returns to \a b.
+*/
+
+void TlsSocket::receive( Buffer * b )
+{
+    char buf[chunk];
+    int n = 1;
+    while ( n > 0 && !d->finished ) {
+        d->readWantsWrite = false;
+        n = ::SSL_read( d->ssl, buf, chunk );
+        if ( n > 0 ) {
+            d->wantsWrite = false;
+            b->append( buf, n );
+        }
+        else {
+            handle( n, true );
+        }
+    }
+}
+
+
+/*! Calls SSL_write() until \a b is empty or the socket is full, and
+    removes what was written from \a b.
+*/
+
+void TlsSocket::send( Buffer * b )
+{
+    int n = 1;
+    d->writeWantsRead = false;
+    while ( n > 0 && b->size() > 0 && !d->finished ) {
+        uint l = b->size();
+        if ( l > chunk )
+            l = chunk;
+        EString s( b->string( l ) );
+        n = ::SSL_write( d->ssl, s.data(), s.length() );
+        if ( n > 0 ) {
+            d->wantsWrite = false;
+            b->remove( n );
+        }
+        else {
+            handle( n, false );
+        }
+    }
+}
+
+
+/*! Records what the OpenSSL result \a r means for the future: Either
+    we wait for the socket, or the TLS session is over. \a reading is
+    true if \a r was returned by SSL_read(), and false if by
+    SSL_write() or SSL_do_handshake().
+*/
+
+void TlsSocket::handle( int r, bool reading )
+{
+    switch ( ::SSL_get_error( d->ssl, r ) ) {
+    case SSL_ERROR_NONE:
+        break;
+
+    case SSL_ERROR_WANT_READ:
+        if ( !reading )
+            d->writeWantsRead = true;
+        break;
+
+    case SSL_ERROR_WANT_WRITE:
+        d->wantsWrite = true;
+        if ( reading )
+            d->readWantsWrite = true;
+        break;
+
+    case SSL_ERROR_ZERO_RETURN:
+        // not an error, the peer closed cleanly
+        d->finished = true;
+        break;
+
+    default:
+        d->finished = true;
+        d->broken = true;
+        ::ERR_clear_error();
+        break;
+    }
+}
+
+
+/*! Returns true if OpenSSL must write to the socket before it can
+    make progress (typically during the handshake), even though the
+    caller may have no cleartext to send.
+*/
+
+bool TlsSocket::wantsWrite() const
+{
+    return d->wantsWrite && !d->finished;
+}
+
+
+/*! Returns true if the TLS session is over, whether because the peer
+    closed it or because of an error, and false if it's still usable.
+*/
+
+bool TlsSocket::finished() const
+{
+    return d->finished;
+}
+
+
+/*! Returns true if this TlsSocket is broken somehow, and false if
+    it's in working order.
+*/
+
+bool TlsSocket::broken() const
+{
+    return d->broken;
+}
+
+
+/*! Sends a TLS close notification if it can do so without waiting,
+    and frees the OpenSSL session. The socket itself is left for the
+    Connection to close.
+*/
+
+void TlsSocket::close()
+{
+    if ( !d->ssl )
+        return;
+    if ( !d->finished && ::SSL_is_init_finished( d->ssl ) )
+        ::SSL_shutdown( d->ssl );
+    ::SSL_free( d->ssl );
+    d->ssl = 0;
+    d->finished = true;
+}
@@ -0,0 +1,35 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef TLSSOCKET_H
+#define TLSSOCKET_H
+
+#include "global.h"
+
+
+class Buffer;
+
+
+class TlsSocket
+    : public Garbage
+{
+public:
+    TlsSocket( int, bool = false );
+    ~TlsSocket();
+
+    void read( Buffer * );
+    void write( Buffer * );
+
+    bool wantsWrite() const;
+    bool finished() const;
+    bool broken() const;
+
+    void close();
+
+private:
+    class TlsSocketData * d;
+    void receive( Buffer * );
+    void send( Buffer * );
+    void handle( int, bool );
+};
+
+#endif
@@ -125,6 +125,18 @@ void TlsThread::setup()
 }
 
 
+/*! Returns the OpenSSL context shared by all TLS sessions, calling
+    setup() first if necessary. TlsSocket uses this too.
+*/
+
+SSL_CTX * TlsThread::context()
+{
+    if ( !ctx )
+        setup();
+    return ctx;
+}
+
+
 /*! \class TlsThread tlsthread.h
     Creates and manages a thread for TLS processing using openssl
 */
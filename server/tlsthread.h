@@ -14,6 +14,7 @@ public:
     ~TlsThread();
 
     static void setup();
+    static struct ssl_ctx_st * context();
 
     void setServerFD( int );
     void setClientFD( int );
@@ -0,0 +1,77 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "trigrams.h"
+
+#include "integerset.h"
+#include "estring.h"
+
+
+// folds c the way ilike does for ASCII, and maps every byte of a
+// multibyte UTF-8 sequence to 128, so that case variants of non-ASCII
+// letters share their trigrams.
+static inline uint fold( char c )
+{
+    uint b = (uint)(unsigned char)c;
+    if ( b >= 'A' && b <= 'Z' )
+        return b + 32;
+    if ( b >= 128 )
+        return 128;
+    return b;
+}
+
+
+/*! \class Trigrams trigrams.h
+    Computes the trigram codes used by the bodypart_trigrams and
+    header_trigrams tables.
+
+    Each sequence of three bytes in the UTF-8 form of a string is
+    folded to lower case (bytes belonging to non-ASCII characters all
+    become 128) and packed into an integer, so that any string which
+    matches "ilike '%s%'" contains every trigram of s. Selector uses
+    that to find candidate bodyparts and messages without reading
+    their text, and then uses ilike to remove false positives.
+
+    The injector and the schema upgrade to revision 99 must compute
+    exactly the same codes. If this changes, the tables must be
+    rebuilt.
+*/
+
+
+/*! Adds the trigram codes of the UTF-8 string \a s to \a set. Strings
+    shorter than three bytes have no trigrams.
+*/
+
+void Trigrams::add( IntegerSet & set, const EString & s )
+{
+    uint l = s.length();
+    if ( l < 3 )
+        return;
+    uint c = ( fold( s[0] ) << 8 ) | fold( s[1] );
+    uint i = 2;
+    while ( i < l ) {
+        c = ( ( c << 8 ) | fold( s[i] ) ) & 0xffffff;
+        set.add( c );
+        i++;
+    }
+}
+
+
+/*! Returns at most \a max codes from \a set, spread evenly over it.
+    Every string which contains all the codes in \a set contains all
+    those in the sample, and a small sample keeps the posting lists
+    Selector has to intersect short.
+*/
+
+IntegerSet Trigrams::sample( const IntegerSet & set, uint max )
+{
+    uint c = set.count();
+    if ( c <= max )
+        return set;
+    IntegerSet r;
+    uint i = 0;
+    while ( i < max ) {
+        r.add( set.value( 1 + i * c / max ) );
+        i++;
+    }
+    return r;
+}
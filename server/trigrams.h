@@ -0,0 +1,22 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef TRIGRAMS_H
+#define TRIGRAMS_H
+
+#include "global.h"
+
+
+class EString;
+class IntegerSet;
+
+
+class Trigrams
+    : public Garbage
+{
+public:
+    static void add( IntegerSet &, const EString & );
+    static IntegerSet sample( const IntegerSet &, uint );
+};
+
+
+#endif
@@ -113,7 +113,7 @@ void DeliveryAgent::execute()
 
         d->qr = new Query(
             "select recipient,localpart::text,domain::text,action,status,"
-            "extract(epoch from last_attempt)::integer as last_attempt "
+            "last_attempt "
             "from delivery_recipients dr join addresses "
             "on (recipient=addresses.id) "
             "where delivery=$1",
@@ -291,7 +291,7 @@ void DeliveryAgent::createDSN()
 
         if ( !r->isNull( "last_attempt" ) ) {
             Date * date = new Date;
-            date->setUnixTime( r->getInt( "last_attempt" ) );
+            date->setUnixTime( r->getTimestamp( "last_attempt" ) );
             recipient->setLastAttempt( date );
         }
 
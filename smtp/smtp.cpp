@@ -29,7 +29,8 @@ public:
         inputState( SMTP::Command ),
         dialect( SMTP::Smtp ),
         sieve( 0 ), user( 0 ), permittedAddresses( 0 ),
-        recipients( new List<SmtpRcptTo> ), now( 0 ) {}
+        recipients( new List<SmtpRcptTo> ), declaredSize( 0 ),
+        now( 0 ) {}
 
     bool executing;
     bool executeAgain;
@@ -42,6 +43,7 @@ public:
     List<Address> * permittedAddresses;
     List<SmtpRcptTo> * recipients;
     EString body;
+    uint declaredSize;
     Date * now;
     EString id;
 
@@ -276,6 +278,7 @@ void SMTP::reset()
     d->sieve = 0;
     d->recipients = new List<SmtpRcptTo>;
     d->body.truncate();
+    d->declaredSize = 0;
     d->id.truncate();
     d->now = 0;
 }
@@ -410,6 +413,17 @@ void SMTP::setBody( const EString & b )
 }
 
 
+/*! Appends \a b to the body() in place. Unlike setBody( body() + \a
+    b ), this copies the body only if someone else shares it, so a
+    message sent in many BDAT chunks isn't copied once per chunk.
+*/
+
+void SMTP::appendBody( const EString & b )
+{
+    d->body.append( b );
+}
+
+
 /*! Returns what setBody() set. Used for SmtpBdat instances to
     coordinate the body.
 */
@@ -420,6 +434,26 @@ EString SMTP::body() const
 }
 
 
+/*! Records that the client declared (using the SIZE extension) that
+    the message will be \a n bytes long. reset() clears this.
+*/
+
+void SMTP::setDeclaredSize( uint n )
+{
+    d->declaredSize = n;
+}
+
+
+/*! Returns the size set by setDeclaredSize(), or 0 if the client
+    didn't declare any.
+*/
+
+uint SMTP::declaredSize() const
+{
+    return d->declaredSize;
+}
+
+
 /*! Returns true if \a c is the oldest command in the SMTP server's
     queue of outstanding commands, and false if the queue is empty or
     there is a command older than \a c in the queue.
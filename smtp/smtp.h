@@ -49,8 +49,12 @@ public:
     List<class SmtpRcptTo> * rcptTo() const;
 
     void setBody( const EString & );
+    void appendBody( const EString & );
     EString body() const;
 
+    void setDeclaredSize( uint );
+    uint declaredSize() const;
+
     bool isFirstCommand( SmtpCommand * ) const;
 
     void setTransactionId( const EString & );
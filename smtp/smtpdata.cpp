@@ -9,7 +9,9 @@
 #include "spoolmanager.h"
 #include "sieveaction.h"
 #include "smtpparser.h"
+#include "mimefields.h"
 #include "injector.h"
+#include "bodypart.h"
 #include "address.h"
 #include "imapurl.h"
 #include "mailbox.h"
@@ -30,13 +32,30 @@ class SmtpDataData
 {
 public:
     SmtpDataData()
-        : state( 2 ), message( 0 ), ok( "OK" )
+        : state( 2 ), message( 0 ), ok( "OK" ), declared( 0 ),
+          scanning( false ), scanned( 0 ), inPart( false ), closed( false ),
+          digest( false ), released( 0 ), partial( 0 ), spooler( 0 )
     {}
 
     EString body;
     uint state;
     Injectee * message;
     EString ok;
+    uint declared;
+    EString trace;
+
+    // for parsing and spooling bodyparts while DATA arrives
+    bool scanning;
+    uint scanned;
+    bool inPart;
+    bool closed;
+    bool digest;
+    uint released;
+    EString boundary;
+    EString header;
+    EString preamble;
+    Injectee * partial;
+    BodypartSpooler * spooler;
 };
 
 
@@ -122,41 +141,64 @@ void SmtpData::execute()
         server()->enqueue( r );
         server()->setInputState( SMTP::Data );
         d->state = 1;
+
+        // if the client told us how large the message is, the body
+        // can grow towards that size as data arrives (below), so it
+        // isn't copied so often. a sufficiently large lie could
+        // exhaust RAM, so not too much, and only once it's been sent.
+        uint size = server()->declaredSize();
+        uint limit = Configuration::scalar( Configuration::MemoryLimit ) *
+                     1024 * 1024 / 4;
+        if ( size > limit )
+            size = limit;
+        d->declared = size + size / 32;
+        if ( d->declared )
+            d->body.reserve( d->declared < 16384 ? d->declared : 16384 );
+
+        // a message copy has to be verbatim, so the body can only be
+        // parsed (and its raw text discarded) as it arrives if no
+        // copy is made.
+        if ( Configuration::text( Configuration::MessageCopy ).lower()
+             == "none" )
+            d->scanning = true;
     }
 
     // state 1: have sent 354, have not yet received CR LF "." CR LF.
-    while ( d->state == 1 ) {
+    if ( d->state == 1 ) {
         Buffer * r = server()->readBuffer();
-        EString * line = r->removeLine( 262144 );
-        if ( !line && r->size() > 262144 ) {
-            respond( 500, "Line too long (legal maximum is 998 bytes)",
-                     "5.5.2" );
-            finish();
-            server()->setState( Connection::Closing );
+        uint received = d->body.length() + r->size();
+        if ( received > d->body.capacity() &&
+             d->declared > d->body.capacity() ) {
+            uint size = received * 2;
+            if ( size > d->declared )
+                size = d->declared;
+            d->body.reserve( size );
         }
-        if ( !line )
+        bool complete = r->removeDotStuffed( &d->body );
+        if ( d->scanning )
+            parseFinishedParts();
+        if ( !complete ) {
+            if ( r->size() > 262144 ) {
+                respond( 500, "Line too long (legal maximum is 998 bytes)",
+                         "5.5.2" );
+                finish();
+                server()->setState( Connection::Closing );
+            }
             return;
-
-        if ( *line == "." ) {
-            d->state = 2;
-            server()->setInputState( SMTP::Command );
-            server()->setBody( d->body );
-        }
-        else if ( (*line)[0] == '.' ) {
-            d->body.append( line->mid( 1 ) );
-            d->body.append( "\r\n" );
-        }
-        else {
-            d->body.append( *line );
-            d->body.append( "\r\n" );
         }
+        d->state = 2;
+        server()->setInputState( SMTP::Command );
+        server()->setBody( d->body );
     }
 
     // bdat/burl start at state 2.
 
     // state 2: have received CR LF "." CR LF, have not started injection
     if ( d->state == 2 ) {
-        server()->sieve()->setMessage( message( server()->body() ),
+        message( server()->body() );
+        if ( d->spooler && !d->spooler->done() )
+            return;
+        server()->sieve()->setMessage( d->message,
                                        server()->transactionTime() );
         if ( server()->dialect() == SMTP::Submit &&
              d->message->error().isEmpty() &&
@@ -194,7 +236,7 @@ void SmtpData::execute()
             // for SMTP/LMTP, we wrap the unparsable message
             Injectee * m =
                 Injectee::wrapUnparsableMessage(
-                    d->body, d->message->error(),
+                    rawMessage(), d->message->error(),
                     "Message arrived but could not be stored",
                     server()->transactionId()
                 );
@@ -394,14 +436,10 @@ void SmtpData::checkField( HeaderField::Type t )
 
 
 /*! Parses \a body and returns a pointer to the parsed message,
-    including a prepended Received field.
+    including the trace fields returned by trace().
 
     This may also do some of the submission-time changes suggested by
     RFC 4409.
-
-    The prepended Received field uses the transmission information
-    specified by RFC 3848. In general it includes little information
-    if the message came from a logged-in user, much more if not.
 */
 
 Injectee * SmtpData::message( const EString & body )
@@ -409,69 +447,47 @@ Injectee * SmtpData::message( const EString & body )
     if ( d->message )
         return d->message;
 
-    EString received( "Received: from " );
-    if ( server()->user() ) {
-        received.append( server()->user()->address()->lpdomain() );
+    Injectee * m = 0;
+    if ( d->partial ) {
+        m = d->partial;
+        if ( !d->closed ) {
+            // the last bodypart ends where the data does
+            List<Bodypart> * children = m->children();
+            uint n = children->count();
+            Bodypart::parseMultipart( 0, d->body.length(), d->body,
+                                      d->boundary, d->digest,
+                                      children, m, n + 1 );
+            List<Bodypart>::Iterator i( children );
+            while ( i ) {
+                if ( n )
+                    n--;
+                else
+                    d->spooler->add( i );
+                ++i;
+            }
+        }
+        EString raw;
+        if ( m->hasPGPsignedPart() )
+            raw = rawBody();
+        m->finishParsing( raw );
     }
     else {
-        received.append( server()->peer().address() );
-        received.append( " (HELO " );
-        received.append( server()->heloName() );
-        received.append( ")" );
-    }
-    received.append( " by " );
-    received.append( Configuration::hostname() );
-    received.append( " (Archiveopteryx " );
-    received.append( Configuration::compiledIn( Configuration::Version )  );
-    received.append( ")" );
-
-    switch ( server()->dialect() ) {
-    case SMTP::Lmtp:
-        received.append( " with lmtp" );
-        break;
-    case SMTP::Smtp:
-    case SMTP::Submit:
-        received.append( " with esmtp" );
-        break;
-    }
-    if ( server()->hasTls() )
-        received.append( "s" );
-    if ( server()->user() )
-        received.append( "a" );
-
-    if ( server()->sieve()->forwardingDate() )
-        received.append( " (delay until " +
-                         server()->sieve()->forwardingDate()->isoDateTime() +
-                         " requested)" );
-
-    received.append( " id " );
-    received.append( server()->transactionId() );
-    uint recipients = server()->rcptTo()->count();
-    if ( server()->user() ) {
-        // reveal nothing
-    }
-    else if ( recipients == 1 ) {
-        Address * a = server()->rcptTo()->firstElement()->address();
-        received.append( " for " + a->localpart().utf8() +
-                         "@" + a->domain().utf8() );
-    }
-    else if ( recipients > 1 ) {
-        received.append( " (" + fn( recipients ) + " recipients)" );
+        // the trace fields are parsed along with the message's own
+        // header, without copying the (possibly very large) body.
+        d->body = body;
+        d->trace = trace();
+        uint i = 0;
+        Message::parseHeader( i, body.length(), body, Header::Rfc2822 );
+        EString top = d->trace + body.mid( 0, i );
+        uint j = 0;
+        m = new Injectee;
+        m->setHeader( Message::parseHeader( j, top.length(), top,
+                                            Header::Rfc2822 ) );
+        m->parseBody( i, body );
     }
-    received.append( "; " );
-    received.append( server()->transactionTime()->rfc822() );
-    received = received.wrapped( 72, "", " ", false );
-    received.append( "\r\n" );
-
-    EString rp;
-    if ( server()->sieve()->sender() )
-        rp = "Return-Path: " +
-             server()->sieve()->sender()->toString( false ) +
-             "\r\n";
-
-    d->body = rp + received + body;
-    Injectee * m = new Injectee;
-    m->parse( d->body );
+    // the SMTP server's copy isn't needed any more, and keeping it
+    // would keep a second copy of a possibly very large message
+    server()->setBody( "" );
     // if the sender is another dickhead specifying <> in From to
     // evade replies, let's try harder.
     if ( !m->error().isEmpty() &&
@@ -546,6 +562,294 @@ Injectee * SmtpData::message( const EString & body )
 }
 
 
+static bool isBoundary( const EString & s, uint i, const EString & b,
+                        bool & last )
+{
+    // the same test as Bodypart::parseMultipart(), but without mid(),
+    // which would make the next append() copy all of \a s.
+    if ( s[i] != '-' || s[i+1] != '-' )
+        return false;
+    uint k = 0;
+    while ( k < b.length() && s[i+2+k] == b[k] )
+        k++;
+    if ( k < b.length() )
+        return false;
+    uint j = i + 2 + k;
+    last = false;
+    if ( s[j] == '-' && s[j+1] == '-' ) {
+        j += 2;
+        last = true;
+    }
+    while ( s[j] == ' ' || s[j] == '\t' )
+        j++;
+    return s[j] == 13 || s[j] == 10 || j >= s.length();
+}
+
+
+/*! Returns the trace fields prepended to the message: Return-Path,
+    if there is a sender, and a Received field.
+
+    The Received field uses the transmission information specified by
+    RFC 3848. In general it includes little information if the message
+    came from a logged-in user, much more if not.
+*/
+
+EString SmtpData::trace() const
+{
+    EString received( "Received: from " );
+    if ( server()->user() ) {
+        received.append( server()->user()->address()->lpdomain() );
+    }
+    else {
+        received.append( server()->peer().address() );
+        received.append( " (HELO " );
+        received.append( server()->heloName() );
+        received.append( ")" );
+    }
+    received.append( " by " );
+    received.append( Configuration::hostname() );
+    received.append( " (Archiveopteryx " );
+    received.append( Configuration::compiledIn( Configuration::Version )  );
+    received.append( ")" );
+
+    switch ( server()->dialect() ) {
+    case SMTP::Lmtp:
+        received.append( " with lmtp" );
+        break;
+    case SMTP::Smtp:
+    case SMTP::Submit:
+        received.append( " with esmtp" );
+        break;
+    }
+    if ( server()->hasTls() )
+        received.append( "s" );
+    if ( server()->user() )
+        received.append( "a" );
+
+    if ( server()->sieve()->forwardingDate() )
+        received.append( " (delay until " +
+                         server()->sieve()->forwardingDate()->isoDateTime() +
+                         " requested)" );
+
+    received.append( " id " );
+    received.append( server()->transactionId() );
+    uint recipients = server()->rcptTo()->count();
+    if ( server()->user() ) {
+        // reveal nothing
+    }
+    else if ( recipients == 1 ) {
+        Address * a = server()->rcptTo()->firstElement()->address();
+        received.append( " for " + a->localpart().utf8() +
+                         "@" + a->domain().utf8() );
+    }
+    else if ( recipients > 1 ) {
+        received.append( " (" + fn( recipients ) + " recipients)" );
+    }
+    received.append( "; " );
+    received.append( server()->transactionTime()->rfc822() );
+    received = received.wrapped( 72, "", " ", false );
+    received.append( "\r\n" );
+
+    EString rp;
+    if ( server()->sieve()->sender() )
+        rp = "Return-Path: " +
+             server()->sieve()->sender()->toString( false ) +
+             "\r\n";
+
+    return rp + received;
+}
+
+
+/*! Parses whatever can be parsed of the DATA received so far. Each
+    complete top-level bodypart is parsed, handed to a BodypartSpooler
+    to be stored in the database, and its raw text is discarded, so
+    that a large message is not kept in RAM both raw and parsed until
+    the last byte has arrived.
+
+    This handles only multipart messages whose header can be repaired
+    without looking at the body. For all others it stops scanning as
+    soon as the header has arrived, and message() parses the whole
+    message at the end, as before.
+*/
+
+void SmtpData::parseFinishedParts()
+{
+    while ( d->scanning ) {
+        uint i = d->scanned;
+        int lf = d->body.find( '\n', i );
+        if ( lf < 0 )
+            return;
+        d->scanned = lf + 1;
+        bool last = false;
+        if ( !d->partial ) {
+            if ( lf == (int)i || ( lf == (int)i + 1 && d->body[i] == 13 ) )
+                startParts( i );
+        }
+        else if ( isBoundary( d->body, i, d->boundary, last ) ) {
+            if ( d->inPart )
+                finishPart( i );
+            else
+                d->preamble = copy( 0, i );
+            discard( i );
+            d->inPart = true;
+            if ( last ) {
+                // the rest is the epilogue, which isn't parsed
+                d->closed = true;
+                d->scanning = false;
+            }
+        }
+    }
+}
+
+
+/*! Parses the header of the message, which ends at \a end, and
+    decides whether the bodyparts can be parsed as they arrive.
+*/
+
+void SmtpData::startParts( uint end )
+{
+    d->scanning = false;
+
+    // the bodyparts' headers are repaired using the message's
+    // header, so the trace fields have to be part of it from the
+    // start.
+    EString header = copy( 0, end );
+    d->trace = trace();
+    EString top = d->trace + header;
+    uint i = 0;
+    Header * h = Message::parseHeader( i, top.length(), top,
+                                       Header::Rfc2822 );
+    if ( i < top.length() )
+        return;
+
+    // Header::repair() looks at the body if there are several
+    // Content-Type or Content-Transfer-Encoding fields, if either is
+    // bad, or if the message is a report. multipart/signed needs the
+    // raw body.
+    HeaderField * cte = h->field( HeaderField::ContentTransferEncoding );
+    ContentType * ct = h->contentType();
+    if ( h->field( HeaderField::ContentType, 1 ) ||
+         h->field( HeaderField::ContentTransferEncoding, 1 ) ||
+         ( cte && !cte->valid() ) ||
+         !ct || !ct->valid() || ct->type() != "multipart" ||
+         ct->subtype() == "signed" || ct->subtype() == "report" ||
+         ct->parameter( "boundary" ).isEmpty() )
+        return;
+
+    Injectee * m = new Injectee;
+    m->setHeader( h );
+    h->repair();
+    h->repair( m, "" );
+
+    // an unparsable message is wrapped, which needs the raw text
+    List<HeaderField>::Iterator it( h->fields() );
+    while ( it && it->valid() )
+        ++it;
+    ct = h->contentType();
+    if ( it || !h->valid() || !ct || ct->type() != "multipart" )
+        return;
+
+    d->partial = m;
+    d->header = header;
+    d->boundary = ct->parameter( "boundary" );
+    d->digest = ct->subtype() == "digest";
+    d->spooler = new BodypartSpooler( this );
+    d->scanning = true;
+    discard( end );
+}
+
+
+/*! Parses the bodypart at the start of the received data, which ends
+    at \a end, and starts storing it. The raw text is discarded by
+    the caller.
+*/
+
+void SmtpData::finishPart( uint end )
+{
+    EString raw = copy( 0, end );
+    List<Bodypart> * children = d->partial->children();
+    uint n = children->count();
+    Bodypart::parseMultipart( 0, raw.length(), raw, d->boundary, d->digest,
+                              children, d->partial, n + 1 );
+    List<Bodypart>::Iterator i( children );
+    while ( i ) {
+        if ( n )
+            n--;
+        else
+            d->spooler->add( i );
+        ++i;
+    }
+    d->released = children->count();
+}
+
+
+/*! Returns a copy of \a n bytes of the received data, starting at
+    \a start. Unlike mid(), this doesn't keep the received data alive.
+*/
+
+EString SmtpData::copy( uint start, uint n ) const
+{
+    EString r;
+    r.reserve( n );
+    r.append( d->body.mid( start, n ) );
+    return r;
+}
+
+
+/*! Discards the first \a n bytes of the received data. */
+
+void SmtpData::discard( uint n )
+{
+    d->body = copy( n, d->body.length() - n );
+    d->scanned -= n;
+}
+
+
+/*! Returns the body of the message as received, except that the
+    bodyparts whose raw text was discarded by parseFinishedParts() are
+    regenerated from their parsed form.
+*/
+
+EString SmtpData::rawBody() const
+{
+    EString r;
+    r.append( d->preamble );
+    ContentType * ct = d->partial->header()->contentType();
+    List<Bodypart>::Iterator i( d->partial->children() );
+    uint n = 0;
+    while ( i && n < d->released ) {
+        r.append( "--" + d->boundary + "\r\n" );
+        r.append( i->header()->asText( false ) );
+        r.append( "\r\n" );
+        d->partial->appendAnyPart( r, i, ct, false );
+        r.append( "\r\n" );
+        ++i;
+        n++;
+    }
+    r.append( d->body );
+    return r;
+}
+
+
+/*! Returns the message as received, including the trace fields
+    added by message(). This is used only when the message can't be
+    parsed, so it's fine to copy it.
+*/
+
+EString SmtpData::rawMessage() const
+{
+    EString r( d->trace );
+    if ( d->partial ) {
+        r.append( d->header );
+        r.append( rawBody() );
+    }
+    else {
+        r.append( d->body );
+    }
+    return r;
+}
+
+
 class SmtpBdatData
     : public Garbage
 {
@@ -599,9 +903,8 @@ void SmtpBdat::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b = server()->body();
-    b.append( d->chunk );
-    server()->setBody( b );
+    server()->appendBody( d->chunk );
+    d->chunk.truncate();
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -687,9 +990,7 @@ void SmtpBurl::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b( server()->body() );
-    b.append( d->url->text() );
-    server()->setBody( b );
+    server()->appendBody( d->url->text() );
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -755,5 +1056,6 @@ void SmtpData::makeCopy( bool soft ) const
 
     f.write( "\n" );
 
+    f.write( d->trace );
     f.write( d->body );
 }
@@ -25,6 +25,15 @@ public:
 
 private:
     class SmtpDataData * d;
+
+    void parseFinishedParts();
+    EString trace() const;
+    void startParts( uint );
+    void finishPart( uint );
+    EString copy( uint, uint ) const;
+    void discard( uint );
+    EString rawBody() const;
+    EString rawMessage() const;
 };
 
 
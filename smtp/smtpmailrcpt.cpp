@@ -140,6 +140,8 @@ void SmtpMailFrom::addParam( const EString & name, const EString & value )
         if ( SmtpClient::observedSize() && n > SmtpClient::observedSize() )
             respond( 501, "Cannot deliver mail larger than " +
                      EString::humanNumber( SmtpClient::observedSize() ) );
+        if ( ok )
+            server()->setDeclaredSize( n );
     }
     else if ( name == "auth" ) {
         // RFC 2554 page 4